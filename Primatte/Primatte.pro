@@ -7,9 +7,13 @@ CONFIG += link_pkgconfig
 PKGCONFIG += opencv
 
 QMAKE_CXXFLAGS += -std=c++0x -Wall
+
+#Counts the allocations made through operator new (see allocationcounter.h).
+#DEFINES += ANIMA_COUNT_ALLOCATIONS
 INCLUDEPATH += /usr/include
 LIBS += -L/usr/lib
 LIBS += -lqglviewer-qt4 -lGLU
+LIBS += -lrt -lpthread
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -28,7 +32,15 @@ SOURCES += main.cpp \
     alphalocator.cpp \
     fittingalgorithms.cpp \
     spherepolyhedron.cpp \
-    averagebackgroundcolourlocators.cpp
+    averagebackgroundcolourlocators.cpp \
+    compositor.cpp \
+    modelfile.cpp \
+    matteserver.cpp \
+    framering.cpp \
+    parametersweep.cpp \
+    taskscheduler.cpp \
+    allocationcounter.cpp \
+    radialtexture.cpp
 
 HEADERS  += \
     io.h \
@@ -46,6 +58,15 @@ HEADERS  += \
     boundingpolyhedron.h \
     ialgorithm.h \
     averagebackgroundcolourlocators.h \
-    iaveragebackgroundcolourlocator.h
+    iaveragebackgroundcolourlocator.h \
+    compositor.h \
+    modelfile.h \
+    matteserver.h \
+    framering.h \
+    parametersweep.h \
+    taskscheduler.h \
+    allocationcounter.h \
+    pointspan.h \
+    radialtexture.h
 
 
@@ -3,7 +3,13 @@
 #include "icoloursegmenter.h"
 #include "ifittingalgorithm.h"
 #include "inputassembler.h"
+#include "modelfile.h"
+#include "taskscheduler.h"
 #include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <future>
 #include "io.h"
 
 
@@ -13,10 +19,69 @@ namespace anima
     {
         namespace primatte
         {
+            namespace
+            {
+                /* Converts and computes the alphas of a range of frames. */
+                class BatchAlphaBody : public cv::ParallelLoopBody
+                {
+                    const IAlphaLocator& mLocator;
+                    const BoundingPolyhedron* mPolys;
+                    const size_t mPolyCount;
+                    const math::vec3 mBackground;
+                    const ia::InputAssemblerDescriptor::TargetColourspace mColourSpace;
+                    const std::vector<cv::Mat>& mFrames;
+                    std::vector<cv::Mat>& mAlphas;
+
+                public:
+                    BatchAlphaBody(const IAlphaLocator& locator, const BoundingPolyhedron* polys,
+                                   size_t polyCount, math::vec3 background,
+                                   ia::InputAssemblerDescriptor::TargetColourspace colourSpace,
+                                   const std::vector<cv::Mat>& frames, std::vector<cv::Mat>& alphas)
+                        : mLocator(locator), mPolys(polys), mPolyCount(polyCount), mBackground(background),
+                          mColourSpace(colourSpace), mFrames(frames), mAlphas(alphas) {}
+
+                    virtual void operator()(const cv::Range& range) const
+                    {
+                        cv::Mat points;
+                        for(int i = range.start; i < range.end; ++i)
+                        {
+                            //The frames are only read, so floating point rgb ones are used in place.
+                            ia::InputAssembler::convertToColourspace(mFrames[i], points, mColourSpace, true);
+
+                            mLocator.findAlphasInRegion(mPolys, mPolyCount, points, mBackground,
+                                                        cv::Rect(0, 0, points.cols, points.rows), mAlphas[i]);
+                        }
+                    }
+                };
+            }
+
+            void AlgorithmPrimatte::prepareOuterFit(const AlgorithmPrimatteDesc& desc, const ia::InputAssembler& input,
+                                                    float startRadius, OuterFitStart& out)
+            {
+                out.startRadius = startRadius;
+
+                START_TIMER(OuterSegmentation);
+                out.segments = desc.segmenter->partition(input.points(), input.background(), startRadius,
+                                                         out.points, out.scratch);
+                END_TIMER(OuterSegmentation);
+
+                START_TIMER(OuterPositioning);
+                out.poly.reset(desc.boundingPolyhedronDesc);
+                out.poly.positionAround(input.background(), out.segments.inner);
+                END_TIMER(OuterPositioning);
+            }
+
             AlgorithmPrimatte::AlgorithmPrimatte(AlgorithmPrimatteDesc desc)
-                : mAnalysed(false)
+                : mAnalysed(false), mOuterStartRadius(0), mInnerFitValid(false), mOuterFitValid(false)
+            {
+                validateDesc(desc);
+
+                //Set desc
+                mDesc = desc;
+            }
+
+            void AlgorithmPrimatte::validateDesc(const AlgorithmPrimatteDesc& desc)
             {
-                //Validate desc
                 if(!desc.segmenter)
                     throw std::runtime_error("Null segmenter");
 
@@ -31,11 +96,70 @@ namespace anima
                    desc.outerScaleParameter <0)
                     throw std::runtime_error("Algorithm parameter out of range");
 
-                //Try constructing a bounding polyhedron to validate its descriptor
-                BoundingPolyhedron(desc.boundingPolyhedronDesc);
+                if(desc.intermediateShells > MAX_INTERMEDIATE_SHELLS)
+                    throw std::runtime_error("Too many intermediate shells");
 
-                //Set desc
+                for(unsigned i = 0; i < desc.intermediateShells; ++i)
+                {
+                    const float position = desc.intermediateShellPositions[i];
+                    const float previous = i == 0 ? 0.f : desc.intermediateShellPositions[i-1];
+                    if(!(position > previous && position < 1.f))
+                        throw std::runtime_error("Intermediate shell positions must be increasing within (0, 1)");
+                }
+
+                BoundingPolyhedron::validate(desc.boundingPolyhedronDesc);
+            }
+
+            bool AlgorithmPrimatte::innerFitMatches(const AlgorithmPrimatteDesc& a, const AlgorithmPrimatteDesc& b)
+            {
+                const BoundingPolyhedronDescriptor& pa = a.boundingPolyhedronDesc, pb = b.boundingPolyhedronDesc;
+                return a.segmenter == b.segmenter &&
+                        pa.fitter == pb.fitter && pa.phiFaces == pb.phiFaces &&
+                        pa.thetaFaces == pb.thetaFaces && pa.scaleMultiplier == pb.scaleMultiplier &&
+                        a.innerShrinkingThreshold == b.innerShrinkingThreshold &&
+                        a.innerShrinkingMinDistance == b.innerShrinkingMinDistance;
+            }
+
+            bool AlgorithmPrimatte::outerFitMatches(const AlgorithmPrimatteDesc& a, const AlgorithmPrimatteDesc& b)
+            {
+                //The expansion threshold only matters through the start radius, which is compared separately.
+                const BoundingPolyhedronDescriptor& pa = a.boundingPolyhedronDesc, pb = b.boundingPolyhedronDesc;
+                return a.segmenter == b.segmenter &&
+                        pa.fitter == pb.fitter && pa.phiFaces == pb.phiFaces &&
+                        pa.thetaFaces == pb.thetaFaces && pa.scaleMultiplier == pb.scaleMultiplier &&
+                        a.outerExpandDelta == b.outerExpandDelta;
+            }
+
+            void AlgorithmPrimatte::setInput(const ia::InputAssembler* input)
+            {
+                IAlgorithm::setInput(input);
+                mInnerFitValid = false;
+                mOuterFitValid = false;
+            }
+
+            bool AlgorithmPrimatte::fitsCutShort() const
+            {
+                return (mInnerFitValid && mInnerFitWorkspace.outOfTime) ||
+                       (mOuterFitValid && mFitWorkspace.outOfTime);
+            }
+
+            const AlgorithmPrimatteDesc& AlgorithmPrimatte::desc() const
+            {
+                return mDesc;
+            }
+
+            void AlgorithmPrimatte::setDesc(const AlgorithmPrimatteDesc& desc)
+            {
+                validateDesc(desc);
                 mDesc = desc;
+
+                if(mAnalysed)
+                {
+                    if(mInput)
+                        analyse();
+                    else
+                        mAnalysed = false;
+                }
             }
 
             void AlgorithmPrimatte::analyse()
@@ -43,57 +167,337 @@ namespace anima
                 if(!mInput)
                     throw std::runtime_error("Using algorithm with null input.");
 
-                //Set up unit polyhedron
-                BoundingPolyhedron unitPoly (mDesc.boundingPolyhedronDesc);
-                mPolys[POLY_INNER] = unitPoly;
-                mPolys[POLY_OUTER] = unitPoly;
+                //The outer fit starts at the larger of the scaled inner radius and the expansion
+                //threshold. Speculating on the threshold, its segmentation and positioning run
+                //alongside the inner fit, which is only joined with to check the start radius.
+                const bool fitInner = !mInnerFitValid || !innerFitMatches(mDesc, mInnerFitDesc);
 
-                //Fit inner polyhedron around the background points
-                mPolys[POLY_INNER].fitter()->shrink(
-                            mPolys[POLY_INNER],
-                            mDesc.segmenter->segment(
-                                mInput->backgroundPoints(),
+                auto fitInnerShell = [this]()
+                {
+                    START_TIMER(InnerSegmentation);
+                    SegmenterSpans segments = mDesc.segmenter->partition(mInput->backgroundPoints(),
+                                                                         mInput->background(),
+                                                                         mDesc.innerShrinkingThreshold,
+                                                                         mInnerPoints, mInnerScratch);
+                    END_TIMER(InnerSegmentation);
+
+                    mInnerFitted.reset(mDesc.boundingPolyhedronDesc);
+                    mInnerFitted.fitter()->shrink(
+                                mInnerFitted,
+                                segments.inner,
                                 mInput->background(),
-                                mDesc.innerShrinkingThreshold).inner,
-                            mInput->background(),
-                            mDesc.innerShrinkingMinDistance);
+                                mDesc.innerShrinkingMinDistance,
+                                mInnerFitWorkspace);
+                    if(mInnerFitWorkspace.outOfTime)
+                        Warning("Inner fit ran out of time after " + ToString(mInnerFitWorkspace.sweeps) + " sweeps");
+                    mInnerFitDesc = mDesc;
+                    mInnerFitValid = true;
+                };
+
+                //Fit inner polyhedron around the background points
+                mSpeculation.startRadius = -1.f;
+                if(fitInner)
+                {
+                    if(mDesc.scheduler)
+                    {
+                        tasks::parallelInvoke(mDesc.scheduler, fitInnerShell, [this]()
+                        {
+                            prepareOuterFit(mDesc, *mInput, mDesc.outerExpansionStartThreshold, mSpeculation);
+                        });
+                    }
+                    else
+                    {
+                        //Without a scheduler the speculation gets a thread of its own.
+                        std::future<void> future = std::async(std::launch::async, prepareOuterFit,
+                                                              std::cref(mDesc), std::cref(*mInput),
+                                                              mDesc.outerExpansionStartThreshold,
+                                                              std::ref(mSpeculation));
+                        fitInnerShell();
+
+                        START_TIMER(JoiningOuterSpeculation);
+                        future.get();
+                        END_TIMER(JoiningOuterSpeculation);
+                    }
+                }
+
+                //Only reallocates if the number of shells changed.
+                mPolys.resize(mDesc.intermediateShells + 2);
+                BoundingPolyhedron& innerPoly = mPolys.front();
+                BoundingPolyhedron& outerPoly = mPolys.back();
 
                 //Scale the inner polyhedron
-                mPolys[POLY_INNER] = mPolys[POLY_INNER]*mDesc.innerPostShrinkingMultiplier;
+                innerPoly.assignScaled(mInnerFitted, mDesc.innerPostShrinkingMultiplier);
 
                 //Ensure that it is greater than the inner polyhedron
-                float innerPolyhedronMaxSize = mPolys[POLY_INNER].findLargestRadius();
+                float innerPolyhedronMaxSize = innerPoly.findLargestRadius();
                 float startRadius = std::max(innerPolyhedronMaxSize, mDesc.outerExpansionStartThreshold);
 
                 //Expand the sphere from the starting radius towards startingRadius+expandDelta
-                mPolys[POLY_OUTER].fitter()->expand(mPolys[POLY_OUTER],
-                                                    mInput->points(),
-                                                    mDesc.segmenter,
-                                                    mInput->background(),
-                                                    startRadius,
-                                                    startRadius+mDesc.outerExpandDelta);
+                if(!mOuterFitValid || !outerFitMatches(mDesc, mOuterFitDesc) || startRadius != mOuterStartRadius)
+                {
+                    //Without a speculation, or if the inner polyhedron outgrew the threshold, prepare it now.
+                    OuterFitStart* start = &mSpeculation;
+                    if(mSpeculation.startRadius != startRadius)
+                    {
+                        prepareOuterFit(mDesc, *mInput, startRadius, mOuterStart);
+                        start = &mOuterStart;
+                    }
+
+                    start->poly.fitter()->expandPositioned(start->poly, start->segments.outer,
+                                                           startRadius, startRadius+mDesc.outerExpandDelta,
+                                                           mFitWorkspace);
+                    if(mFitWorkspace.outOfTime)
+                        Warning("Outer fit ran out of time after " + ToString(mFitWorkspace.sweeps) + " sweeps");
 
+                    mOuterFitted = start->poly;
+                    mOuterFitDesc = mDesc;
+                    mOuterStartRadius = startRadius;
+                    mOuterFitValid = true;
+                }
 
                 //Scale outer if wanted
-                float maxInnerRadius = mPolys[POLY_INNER].findLargestRadius();
-                float scale = mPolys[POLY_OUTER].radius() +
-                        (maxInnerRadius-mPolys[POLY_OUTER].radius())*
+                float maxInnerRadius = innerPoly.findLargestRadius();
+                float scale = mOuterFitted.radius() +
+                        (maxInnerRadius-mOuterFitted.radius())*
                         (1.f-mDesc.outerScaleParameter);
-                mPolys[POLY_OUTER] = mPolys[POLY_OUTER]*(scale/mPolys[POLY_OUTER].radius());
+                outerPoly.assignScaled(mOuterFitted, scale/mOuterFitted.radius());
+
+                //Place the intermediate shells between them.
+                for(unsigned i = 0; i < mDesc.intermediateShells; ++i)
+                    mPolys[i+1].assignBlended(innerPoly, outerPoly, mDesc.intermediateShellPositions[i]);
+
+                //The polyhedra are final, so bake their planes for the alpha computation.
+                for(size_t i = 0; i < mPolys.size(); ++i)
+                    mPolys[i].bakePlanes();
+
+                mBackground = mInput->background();
+                mColourSpace = mInput->colourSpace();
 
                 mAnalysed = true;
             }
 
             cv::Mat AlgorithmPrimatte::computeAlphas() const
+            {
+                cv::Mat alphas;
+                computeAlphas(alphas);
+                return alphas;
+            }
+
+            void AlgorithmPrimatte::computeAlphas(cv::Mat& alphas) const
+            {
+                if(!mAnalysed)
+                    throw std::runtime_error("Trying to compute alphas with algorithm before input analysis.");
+
+                START_TIMER(AlphaLocator);
+                mDesc.alphaLocator->findAlphas(mPolys.data(), mPolys.size(), *mInput, alphas);
+                END_TIMER(AlphaLocator);
+            }
+
+            void AlgorithmPrimatte::computeAlphas(const std::vector<cv::Mat>& frames, std::vector<cv::Mat>& alphas) const
             {
                 if(!mAnalysed)
                     throw std::runtime_error("Trying to compute alphas with algorithm before input analysis.");
-                return mDesc.alphaLocator->findAlphas(mPolys, POLY_COUNT, *mInput);
+
+                START_TIMER(BatchAlphaLocator);
+
+                //Allocate the outputs up front so that the workers only write into them.
+                alphas.resize(frames.size());
+                for(size_t i = 0; i < frames.size(); ++i)
+                {
+                    //Validates the format
+                    ia::InputAssembler::normalisationMultiplier(frames[i].type());
+                    alphas[i].create(frames[i].rows, frames[i].cols, CV_32FC1);
+                }
+
+                BatchAlphaBody body(*mDesc.alphaLocator, mPolys.data(), mPolys.size(), mBackground, mColourSpace, frames, alphas);
+                if(mDesc.scheduler)
+                {
+                    mDesc.scheduler->parallelFor(0, frames.size(), 1, [&body](size_t begin, size_t end)
+                    {
+                        body(cv::Range(begin, end));
+                    });
+                }
+                else
+                    cv::parallel_for_(cv::Range(0, (int)frames.size()), body);
+
+                END_TIMER(BatchAlphaLocator);
+            }
+
+            void AlgorithmPrimatte::saveModel(const std::string& path) const
+            {
+                if(!mAnalysed)
+                    throw std::runtime_error("Trying to save model before input analysis.");
+
+                ModelFileHeader header = ModelFileHeader();
+                memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+                header.version = MODEL_FILE_VERSION;
+                header.headerSize = sizeof(ModelFileHeader);
+                header.colourSpace = mColourSpace;
+                header.background[0] = mBackground.x;
+                header.background[1] = mBackground.y;
+                header.background[2] = mBackground.z;
+                header.innerShrinkingThreshold = mDesc.innerShrinkingThreshold;
+                header.innerShrinkingMinDistance = mDesc.innerShrinkingMinDistance;
+                header.innerPostShrinkingMultiplier = mDesc.innerPostShrinkingMultiplier;
+                header.outerExpansionStartThreshold = mDesc.outerExpansionStartThreshold;
+                header.outerExpandDelta = mDesc.outerExpandDelta;
+                header.outerScaleParameter = mDesc.outerScaleParameter;
+                header.phiFaces = mDesc.boundingPolyhedronDesc.phiFaces;
+                header.thetaFaces = mDesc.boundingPolyhedronDesc.thetaFaces;
+                header.scaleMultiplier = mDesc.boundingPolyhedronDesc.scaleMultiplier;
+                header.polyhedronCount = mPolys.size();
+
+                //Lay out the arrays after the header and polyhedron entries.
+                auto align = [](uint64_t offset) { return (offset + 15) & ~uint64_t(15); };
+                header.polyhedronOffset = align(sizeof(ModelFileHeader));
+                uint64_t offset = align(header.polyhedronOffset + mPolys.size()*sizeof(ModelFilePolyhedron));
+
+                std::vector<ModelFilePolyhedron> entries(mPolys.size());
+                for(size_t i = 0; i < mPolys.size(); ++i)
+                {
+                    const BoundingPolyhedron& poly = mPolys[i];
+                    ModelFilePolyhedron& entry = entries[i];
+                    entry = ModelFilePolyhedron();
+                    entry.phiFaces = poly.phiFaces();
+                    entry.thetaFaces = poly.thetaFaces();
+                    entry.centre[0] = poly.centre().x;
+                    entry.centre[1] = poly.centre().y;
+                    entry.centre[2] = poly.centre().z;
+                    entry.radius = poly.radius();
+                    entry.vertexCount = poly.mVertices.size();
+                    entry.planeCount = poly.planes().size();
+                    entry.vertexOffset = offset;
+                    offset = align(offset + entry.vertexCount*sizeof(math::vec3));
+                    entry.planeOffset = offset;
+                    offset = align(offset + entry.planeCount*sizeof(math::vec4));
+                }
+
+                std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+                if(!file)
+                    throw std::runtime_error("Could not create model file " + path);
+
+                auto writeAt = [&file](uint64_t position, const void* data, size_t size)
+                {
+                    //Pad up to the position
+                    static const char zeros[16] = {0};
+                    while(uint64_t(file.tellp()) < position)
+                        file.write(zeros, std::min<uint64_t>(sizeof(zeros), position - file.tellp()));
+                    file.write((const char*)data, size);
+                };
+
+                writeAt(0, &header, sizeof(header));
+                writeAt(header.polyhedronOffset, entries.data(), entries.size()*sizeof(ModelFilePolyhedron));
+                for(size_t i = 0; i < mPolys.size(); ++i)
+                {
+                    writeAt(entries[i].vertexOffset, mPolys[i].mVertices.data(),
+                            entries[i].vertexCount*sizeof(math::vec3));
+                    writeAt(entries[i].planeOffset, mPolys[i].planes().data(),
+                            entries[i].planeCount*sizeof(math::vec4));
+                }
+
+                if(!file)
+                    throw std::runtime_error("Could not write model file " + path);
+            }
+
+            void AlgorithmPrimatte::loadModel(const std::string& path)
+            {
+                START_TIMER(LoadingModel);
+
+                MappedFile file(path);
+
+                const ModelFileHeader& header = *file.at<ModelFileHeader>(0);
+                if(memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0)
+                    throw std::runtime_error(path + " is not a model file");
+
+                if(header.version != MODEL_FILE_VERSION || header.headerSize != sizeof(ModelFileHeader))
+                    throw std::runtime_error("Unsupported model file version in " + path);
+
+                if(header.polyhedronCount < 2 || header.polyhedronCount > MAX_INTERMEDIATE_SHELLS + 2)
+                    throw std::runtime_error("Unexpected polyhedron count in " + path);
+                const unsigned polyCount = header.polyhedronCount;
+
+                if(header.colourSpace > ia::InputAssemblerDescriptor::ETCS_LAB)
+                    throw std::runtime_error("Unknown colour space in " + path);
+
+                const ModelFilePolyhedron* entries = file.at<ModelFilePolyhedron>(header.polyhedronOffset, polyCount);
+
+                //The header replaces the polyhedron descriptor, so it is validated as one.
+                BoundingPolyhedronDescriptor headerDesc = mDesc.boundingPolyhedronDesc;
+                headerDesc.phiFaces = header.phiFaces;
+                headerDesc.thetaFaces = header.thetaFaces;
+                headerDesc.scaleMultiplier = header.scaleMultiplier;
+                try
+                {
+                    BoundingPolyhedron::validate(headerDesc);
+                }
+                catch(const std::runtime_error& err)
+                {
+                    throw std::runtime_error(std::string(err.what()) + " in " + path);
+                }
+
+                //Load into temporaries so that a failure leaves the algorithm untouched.
+                std::vector<BoundingPolyhedron> polys(polyCount);
+                for(unsigned i = 0; i < polyCount; ++i)
+                {
+                    const ModelFilePolyhedron& entry = entries[i];
+
+                    //The alpha locator shares face lookups, so all must have the faces of the header.
+                    if(entry.phiFaces != header.phiFaces || entry.thetaFaces != header.thetaFaces)
+                        throw std::runtime_error("Mismatched polyhedron resolutions in " + path);
+
+                    polys[i] = BoundingPolyhedron(headerDesc);
+                    polys[i].assignMesh(math::vec3(entry.centre[0], entry.centre[1], entry.centre[2]),
+                                        entry.radius,
+                                        file.at<math::vec3>(entry.vertexOffset, entry.vertexCount),
+                                        entry.vertexCount,
+                                        file.at<math::vec4>(entry.planeOffset, entry.planeCount),
+                                        entry.planeCount);
+
+                    if(entry.planeCount == 0)
+                        polys[i].bakePlanes();
+                }
+
+                mPolys.swap(polys);
+
+                //The cached fits belong to the replaced model.
+                mInnerFitValid = false;
+                mOuterFitValid = false;
+
+                mDesc.innerShrinkingThreshold = header.innerShrinkingThreshold;
+                mDesc.innerShrinkingMinDistance = header.innerShrinkingMinDistance;
+                mDesc.innerPostShrinkingMultiplier = header.innerPostShrinkingMultiplier;
+                mDesc.outerExpansionStartThreshold = header.outerExpansionStartThreshold;
+                mDesc.outerExpandDelta = header.outerExpandDelta;
+                mDesc.outerScaleParameter = header.outerScaleParameter;
+                mDesc.boundingPolyhedronDesc = headerDesc;
+
+                //The shell positions are not stored, but follow from the radii of the blended shells.
+                //Should they not be valid positions, they are spaced evenly instead.
+                mDesc.intermediateShells = polyCount - 2;
+                const float innerRadius = mPolys.front().radius(), outerRadius = mPolys.back().radius();
+                for(unsigned i = 0; i < mDesc.intermediateShells; ++i)
+                    mDesc.intermediateShellPositions[i] = (mPolys[i+1].radius() - innerRadius)/(outerRadius - innerRadius);
+                try
+                {
+                    validateDesc(mDesc);
+                }
+                catch(const std::runtime_error&)
+                {
+                    for(unsigned i = 0; i < mDesc.intermediateShells; ++i)
+                        mDesc.intermediateShellPositions[i] = (i+1)/float(polyCount-1);
+                }
+
+                mBackground = math::vec3(header.background[0], header.background[1], header.background[2]);
+                mColourSpace = (ia::InputAssemblerDescriptor::TargetColourspace)header.colourSpace;
+
+                mAnalysed = true;
+
+                END_TIMER(LoadingModel);
             }
 
             void AlgorithmPrimatte::debugDraw() const
             {
-                for(int i = 0;  i < POLY_COUNT; ++i)
+                for(size_t i = 0;  i < mPolys.size(); ++i)
                     mPolys[i].debugDraw(math::vec3((float)((i+2)%4==0), (float)((i+2)%3==0), 0.f));
             }
         }
@@ -2,6 +2,9 @@
 #include "ialgorithm.h"
 #include "boundingpolyhedron.h"
 #include "inputassembler.h"
+#include "icoloursegmenter.h"
+#include "ifittingalgorithm.h"
+#include <cstring>
 
 /** This class implements an algorithm inspired by primatte.
     Its main purpose is to combine all the other algorithms in the
@@ -16,6 +19,11 @@ namespace anima
         class InputAssembler;
     }
 
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
     namespace alg
     {
         namespace primatte
@@ -25,6 +33,9 @@ namespace anima
             class IColourSegmenter;
             class IAlphaLocator;
 
+            /** The most shells that may be placed between the inner and outer polyhedrons. */
+            const unsigned MAX_INTERMEDIATE_SHELLS = 6;
+
             /** The algorithm descriptor to use when creating the algorithm.
                 You must fill this in entirely and pass it to the constructor. */
             struct AlgorithmPrimatteDesc
@@ -69,37 +80,135 @@ namespace anima
                 //Note that it is relative to the final size of the inner polyhedron.
                 float outerScaleParameter;
 
+                //The number of shells placed between the final inner and outer polyhedrons,
+                //at most MAX_INTERMEDIATE_SHELLS. The k-th of all n shells has an alpha of k/(n-1)
+                //with the ray locator, so they bend the alpha ramp into a piecewise-linear one.
+                unsigned intermediateShells;
+
+                //Where each intermediate shell lies, as a fraction of the way from the inner to
+                //the outer polyhedron. Must be strictly increasing within (0, 1).
+                float intermediateShellPositions[MAX_INTERMEDIATE_SHELLS];
+
+                /* The scheduler the algorithm runs on, or null to run serially.
+                 * The sub-algorithms run on the scheduler they were constructed with. */
+                tasks::TaskScheduler* scheduler;
+
+                AlgorithmPrimatteDesc()
+                {
+                    memset(this, 0, sizeof(*this));
+                }
             };
 
             /** The primatte-inspired algorithm. */
             class AlgorithmPrimatte : public IAlgorithm
             {
-                /* The internal sphere ennumerations.
-                 * Warning: Must be in inner->outer order.
-                 * When improving the algorithm, one may wish to use more spheres. */
-                enum PolyId {POLY_INNER, POLY_OUTER, POLY_COUNT};
-
-                /* The polyhedron objects in inner->outer order. */
-                BoundingPolyhedron mPolys[POLY_COUNT];
+                /* The polyhedron objects in inner->outer order: the inner polyhedron,
+                 * the intermediate shells and the outer polyhedron. All have the same
+                 * resolution, as the alpha locator shares face lookups between them. */
+                std::vector<BoundingPolyhedron> mPolys;
 
                 /* The algorithm descriptor. */
                 AlgorithmPrimatteDesc mDesc;
 
+                /* The background point and colour space of the analysed input,
+                 * kept so that batches can be processed without it. */
+                math::vec3 mBackground;
+                ia::InputAssemblerDescriptor::TargetColourspace mColourSpace;
+
                 bool mAnalysed;
 
+                /* The fitted polyhedra before their post-fit scaling, cached with the
+                 * descriptor they were fitted with so that analyse() only repeats the
+                 * stages whose dependencies changed. The outer fit also depends on its
+                 * start radius, which follows from the scaled inner polyhedron. */
+                BoundingPolyhedron mInnerFitted, mOuterFitted;
+                AlgorithmPrimatteDesc mInnerFitDesc, mOuterFitDesc;
+                float mOuterStartRadius;
+                bool mInnerFitValid, mOuterFitValid;
+
+                /* The start of an outer fit: the polyhedron positioned around the inner points
+                 * of the segmentation at the start radius, and the partitioned points, within
+                 * whose outer half the polyhedron expands. */
+                struct OuterFitStart
+                {
+                    BoundingPolyhedron poly;
+                    std::vector<math::vec3> points;
+                    SegmenterScratch scratch;
+                    SegmenterSpans segments;
+                    float startRadius;
+
+                    OuterFitStart() : startRadius(-1.f) {}
+                };
+
+                /* Storage reused by every analysis, so that analysing inputs of the same
+                 * size again does not allocate. The speculation is prepared at the expansion
+                 * threshold alongside the inner fit, and the other start is only prepared
+                 * if the inner polyhedron outgrows the threshold. */
+                OuterFitStart mSpeculation, mOuterStart;
+                std::vector<math::vec3> mInnerPoints;
+                SegmenterScratch mInnerScratch;
+                FittingWorkspace mInnerFitWorkspace, mFitWorkspace;
+
+                /** Segments the foreground points and positions the outer polyhedron into out, as expand() does. */
+                static void prepareOuterFit(const AlgorithmPrimatteDesc& desc, const ia::InputAssembler& input,
+                                            float startRadius, OuterFitStart& out);
+
+                /** Returns whether the inner fit of b may be reused for a. */
+                static bool innerFitMatches(const AlgorithmPrimatteDesc& a, const AlgorithmPrimatteDesc& b);
+
+                /** Returns whether the outer fit of b may be reused for a, given the same start radius. */
+                static bool outerFitMatches(const AlgorithmPrimatteDesc& a, const AlgorithmPrimatteDesc& b);
+
+                /** Throws std::runtime_error if the descriptor is invalid. */
+                static void validateDesc(const AlgorithmPrimatteDesc& desc);
+
             public:
 
                 /** Initialises the class, throwing an exception upon failure
                  * (most commonly std::runtime_error) */
                 AlgorithmPrimatte(AlgorithmPrimatteDesc desc);
 
-                /** Prepares alpha computation for the given data set by analysing the input. */
+                /** Sets the input, discarding the cached fits. */
+                virtual void setInput(const ia::InputAssembler* input);
+
+                /** Prepares alpha computation for the given data set by analysing the input.
+                  * Fits cached from a previous analysis of the same input are reused when
+                  * the descriptor fields they depend on are unchanged.
+                  * Once warm, analysing inputs of the same size allocates nothing with a
+                  * scheduler. Without one, only the thread of the speculation allocates. */
                 virtual void analyse();
 
+                /** Returns whether the time budget of the fitter stopped the inner or outer fit
+                  * of the current polyhedra early, leaving them looser than a complete fit. */
+                bool fitsCutShort() const;
+
+                /** Returns the descriptor. */
+                const AlgorithmPrimatteDesc& desc() const;
+
+                /** Replaces the descriptor, throwing std::runtime_error if it is invalid.
+                  * If the input was analysed, only the affected stages are run again, so
+                  * changing innerPostShrinkingMultiplier, outerScaleParameter or the intermediate
+                  * shells only rescales and blends the cached fits. Without an input (such as after loading a model), the
+                  * algorithm must be analysed again before computing alphas. */
+                void setDesc(const AlgorithmPrimatteDesc& desc);
+
                 /** Computes the alphas for the given set of points in relation to the
                   * previously supplied inputs. */
                 virtual cv::Mat computeAlphas() const;
 
+                /** Computes the alphas into a mat, which is reused if it is of the right size. */
+                virtual void computeAlphas(cv::Mat& alphas) const;
+
+                /** Computes the alphas for a batch of frames against the analysed polyhedra. */
+                virtual void computeAlphas(const std::vector<cv::Mat>& frames, std::vector<cv::Mat>& alphas) const;
+
+                /** Saves the polyhedra, background, colour space and parameters to a model file. */
+                virtual void saveModel(const std::string& path) const;
+
+                /** Memory-maps a model file and loads it. The sub-algorithms of the descriptor
+                  * are kept, while its parameters are replaced by the stored ones. */
+                virtual void loadModel(const std::string& path);
+
                 /** Uses OpenGL to draw a representation of the internal polyhedrons. */
                 virtual void debugDraw() const;
             };
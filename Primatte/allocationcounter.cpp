@@ -0,0 +1,84 @@
+#include "allocationcounter.h"
+
+#ifdef ANIMA_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<size_t> allocations(0);
+
+    void* countedAllocate(size_t size)
+    {
+        ++allocations;
+        void* memory = malloc(size ? size : 1);
+        if(!memory)
+            throw std::bad_alloc();
+        return memory;
+    }
+}
+
+void* operator new(size_t size)
+{
+    return countedAllocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return countedAllocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    ++allocations;
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    ++allocations;
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    free(memory);
+}
+#endif
+
+namespace anima
+{
+    bool countingAllocations()
+    {
+#ifdef ANIMA_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    size_t allocationCount()
+    {
+#ifdef ANIMA_COUNT_ALLOCATIONS
+        return allocations.load();
+#else
+        return 0;
+#endif
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+/**
+  * Counts the heap allocations made through operator new, so that code meant to run
+  * without allocating (such as repeated analyses and alpha computations of same-sized
+  * inputs, once warmed up) can be checked:
+  * '''
+  * size_t before = anima::allocationCount();
+  * algorithm.analyse();
+  * algorithm.computeAlphas(alphas);
+  * assert(anima::allocationCount() == before);
+  * '''
+  * Counting replaces the global operator new and delete, so it is only compiled in
+  * when ANIMA_COUNT_ALLOCATIONS is defined. Otherwise the count is always 0.
+  * Memory allocated by libraries without operator new (such as cv::Mat data) is not counted.
+  */
+
+namespace anima
+{
+    /** Returns whether allocations are counted in this build. */
+    bool countingAllocations();
+
+    /** Returns the number of allocations made by all threads since the program started. */
+    size_t allocationCount();
+}
@@ -1,6 +1,11 @@
 #include "alphalocator.h"
+#include "taskscheduler.h"
 #include "io.h"
 #include "matrixd.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
 
 using namespace anima::alg;
 
@@ -12,72 +17,580 @@ namespace anima
     {
         namespace primatte
         {
-        cv::Mat AlphaRayLocator::findAlphas(
+        namespace
+        {
+            /* Finds the alpha of a point against count nested shells, which are either polyhedrons
+             * or radial textures of the same resolution: a direction is resolved once, against the
+             * first shell, and its distance is then found to each of them. */
+            template<class Shell>
+            float findNestedAlpha(const math::vec3& point,
+                                  const math::vec3& background,
+                                  const Shell* shells,
+                                  const size_t count)
+            {
+                if(background==point)
+                    return 0;
+
+                const math::vec3 vector = point - background;
+                const float vectorLen = vector.length();
+                const math::vec3 vectorNorm = vector/vectorLen;
+
+                //A single lookup for all the shells, which only differ in their distances.
+                const auto ray = shells[0].resolveRay(vectorNorm);
+
+                //Most points are outside the outer or inside the inner shell, so test those first.
+                const size_t last = count-1;
+                const float distanceToOuter = shells[last].findDistance(ray);
+                if(vectorLen >= distanceToOuter)
+                    return 1;
+
+                float lower = shells[0].findDistance(ray);
+                if(vectorLen < lower)
+                    return 0;
+
+                //Walk outwards to the first shell beyond the point, and interpolate from the one before.
+                size_t i = 1;
+                float upper = distanceToOuter;
+                for(; i < last; ++i)
+                {
+                    upper = shells[i].findDistance(ray);
+                    if(vectorLen < upper)
+                        break;
+                    lower = upper;
+                }
+                if(i == last)
+                    upper = distanceToOuter;
+
+                return ((i-1) + (vectorLen - lower)/(upper - lower))/last;
+            }
+
+            /* Finds the alphas of a region of points against count nested shells. */
+            template<class Shell>
+            void findNestedAlphasInRegion(const Shell* shells,
+                                          const size_t count,
+                                          const cv::Mat& points,
+                                          const math::vec3 background,
+                                          const cv::Rect& region,
+                                          cv::Mat& out)
+            {
+                assert(points.type() == CV_32FC3 && out.type() == CV_32FC1);
+                assert(out.rows == points.rows && out.cols == points.cols);
+
+                for (int i = region.y; i < region.y + region.height; ++i)
+                {
+                    float* data = (float*)(points.data + points.step*i);
+                    float* dataOut = (float*)(out.data + out.step*i);
+                    for(int j = region.x; j < region.x + region.width; ++j)
+                    {
+                        const math::vec3& point = *((math::vec3*)(data + j*3));
+                        *(dataOut+j) = findNestedAlpha(point, background, shells, count);
+                    }
+                }
+            }
+        }
+
+        cv::Mat IAlphaLocator::findAlphas(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const ia::InputAssembler &input) const
+        {
+            cv::Mat out;
+            findAlphas(polyhedrons, polyhedronCount, input, out);
+            return out;
+        }
+
+        void IAlphaLocator::findAlphas(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const ia::InputAssembler &input,
+                cv::Mat& out) const
+        {
+            const cv::Mat& mat = input.mat();
+            const math::vec3 background = input.background();
+
+            evaluateRegions(input, out, [&](const cv::Rect& region)
+            {
+                findAlphasInRegion(polyhedrons, polyhedronCount, mat, background, region, out);
+            });
+        }
+
+        void IAlphaLocator::findAlphasInMask(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Mat& mask,
+                const cv::Rect& bounds,
+                float excludedAlpha,
+                cv::Mat& out) const
+        {
+            assert(mask.rows == points.rows && mask.cols == points.cols);
+
+            evaluateRegionsInMask(mask, bounds, excludedAlpha, out, [&](const cv::Rect& region)
+            {
+                findAlphasInRegion(polyhedrons, polyhedronCount, points, background, region, out);
+            });
+        }
+
+        float AlphaRayLocator::findAlpha(const math::vec3& point,
+                                         const math::vec3& background,
+                                         const SpherePolyhedron& innerPoly,
+                                         const SpherePolyhedron& outerPoly)
+        {
+            //If right in the middle
+            if(background==point)
+                return 0;
+
+            //Prepare vector
+            const math::vec3 vector = point - background;
+            const float vectorLen = vector.length();
+            const math::vec3 vectorNorm = vector/vectorLen;
+            const float distanceToPoint = point.distance(background);
+
+            //Both polyhedrons have the same faces, so the ray is only resolved once.
+            assert(innerPoly.sharesTopology(outerPoly));
+            const SpherePolyhedron::RayContext ray = outerPoly.resolveRay(vectorNorm);
+            const float distanceToOuterPoly = outerPoly.findDistance(ray);
+
+            //If intersects with middle, it's outside. Alpha = 1.
+            if(distanceToPoint >= distanceToOuterPoly)
+                return 1;
+
+            //If inside outer poly, alpha < 1
+            float distanceToInnerPoly = innerPoly.findDistance(ray);
+
+            //If does not intersect with inner, fully inside
+            if(distanceToPoint < distanceToInnerPoly)
+                return 0;
+
+            //interpolate between inner and outer
+            return (vectorLen - distanceToInnerPoly) /
+                    (distanceToOuterPoly - distanceToInnerPoly);
+        }
+
+        float AlphaRayLocator::findAlpha(const math::vec3& point,
+                                         const math::vec3& background,
+                                         const BoundingPolyhedron* polyhedrons,
+                                         const size_t polyhedronCount)
+        {
+            return findNestedAlpha(point, background, polyhedrons, polyhedronCount);
+        }
+
+        void AlphaRayLocator::findAlphasInRegion(
                 const BoundingPolyhedron* polyhedrons,
                 const size_t polyhedronCount,
-                const ia::InputAssembler& input) const
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Rect& region,
+                cv::Mat& out) const
             {
                 assert(polyhedronCount>1);
-                START_TIMER(AlphaLocator);
+                for(size_t i = 1; i < polyhedronCount; ++i)
+                    assert(polyhedrons[i].sharesTopology(polyhedrons[0]));
+
+                findNestedAlphasInRegion(polyhedrons, polyhedronCount, points, background, region, out);
+            }
+
+        HierarchicalAlphaLocator::HierarchicalAlphaLocator(HierarchicalAlphaLocatorDesc desc,
+                                                           tasks::TaskScheduler* scheduler)
+            : IAlphaLocator(scheduler)
+        {
+            if(!desc.exactLocator)
+                throw std::runtime_error("Null exact alpha locator");
+
+            if(desc.tileSize < 2)
+                throw std::runtime_error("Hierarchical alpha locator tile size must be at least 2");
+
+            mDesc = desc;
+            resetStats();
+        }
 
-                const cv::Mat& mat = input.mat();
-                const unsigned r = input.mat().rows, c = input.mat().cols;
-                const math::vec3 background = input.background();
+        void HierarchicalAlphaLocator::findAlphasInRegion(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Rect& region,
+                cv::Mat& out) const
+        {
+            HierarchicalAlphaStats stats = HierarchicalAlphaStats();
+
+            if(region.width <= 0 || region.height <= 0)
+                return;
+
+            const int tileSize = mDesc.tileSize;
+            const int tilesX = (region.width + tileSize - 1)/tileSize;
+            const int tilesY = (region.height + tileSize - 1)/tileSize;
+
+            //The samples lie on the tile corners, the last ones being clamped to the region.
+            const int samplesX = tilesX + 1, samplesY = tilesY + 1;
+            cv::Mat samplePoints(samplesY, samplesX, CV_32FC3);
+            cv::Mat sampleAlphas(samplesY, samplesX, CV_32FC1);
 
-                cv::Mat out;
-                out.create(r, c, CV_32FC1);
+            for(int sy = 0; sy < samplesY; ++sy)
+            {
+                const int y = region.y + std::min(sy*tileSize, region.height-1);
+                const math::vec3* data = (const math::vec3*)(points.data + points.step*y);
+                math::vec3* sampleData = (math::vec3*)(samplePoints.data + samplePoints.step*sy);
+
+                for(int sx = 0; sx < samplesX; ++sx)
+                    sampleData[sx] = data[region.x + std::min(sx*tileSize, region.width-1)];
+            }
 
-                const SpherePolyhedron& outerPoly = polyhedrons[1];
-                const SpherePolyhedron& innerPoly = polyhedrons[0];
+            mDesc.exactLocator->findAlphasInRegion(polyhedrons, polyhedronCount, samplePoints,
+                                                   background, cv::Rect(0, 0, samplesX, samplesY),
+                                                   sampleAlphas);
+            stats.evaluatedPixels += samplesX*samplesY;
 
-                //For each point, send rays
-                for (unsigned i = 0; i < r; ++i)
+            for(int ty = 0; ty < tilesY; ++ty)
+                for(int tx = 0; tx < tilesX; ++tx)
                 {
-                    float* data = (float*)(mat.data + mat.step*i);
-                    float* dataOut = (float*)(out.data + out.step*i);
-                    for(unsigned j = 0; j < c; ++j)
+                    const cv::Rect tile = cv::Rect(region.x + tx*tileSize, region.y + ty*tileSize,
+                                                   tileSize, tileSize) & region;
+
+                    //Check the corners of this tile and of its neighbours.
+                    const float value = sampleAlphas.at<float>(ty, tx);
+                    bool solid = (value == 0.f || value == 1.f);
+
+                    for(int sy = std::max(ty-1, 0); solid && sy <= std::min(ty+2, samplesY-1); ++sy)
+                        for(int sx = std::max(tx-1, 0); solid && sx <= std::min(tx+2, samplesX-1); ++sx)
+                            solid = sampleAlphas.at<float>(sy, sx) == value;
+
+                    if(solid)
+                    {
+                        for(int y = tile.y; y < tile.y + tile.height; ++y)
+                        {
+                            float* dataOut = (float*)(out.data + out.step*y);
+                            std::fill(dataOut + tile.x, dataOut + tile.x + tile.width, value);
+                        }
+                        ++stats.solidTiles;
+                    }
+                    else
+                    {
+                        mDesc.exactLocator->findAlphasInRegion(polyhedrons, polyhedronCount, points,
+                                                               background, tile, out);
+                        stats.evaluatedPixels += tile.area();
+                        ++stats.mixedTiles;
+                    }
+                }
+
+            if(mDesc.verify)
+            {
+                cv::Mat exact(points.rows, points.cols, CV_32FC1);
+                mDesc.exactLocator->findAlphasInRegion(polyhedrons, polyhedronCount, points,
+                                                       background, region, exact);
+
+                for(int y = region.y; y < region.y + region.height; ++y)
+                {
+                    const float* dataExact = (const float*)(exact.data + exact.step*y);
+                    const float* dataOut = (const float*)(out.data + out.step*y);
+                    for(int x = region.x; x < region.x + region.width; ++x)
+                        if(dataExact[x] != dataOut[x])
+                            ++stats.mismatchedPixels;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mStatsMutex);
+                mStats.solidTiles += stats.solidTiles;
+                mStats.mixedTiles += stats.mixedTiles;
+                mStats.evaluatedPixels += stats.evaluatedPixels;
+                mStats.mismatchedPixels += stats.mismatchedPixels;
+            }
+        }
+
+        HierarchicalAlphaStats HierarchicalAlphaLocator::stats() const
+        {
+            std::lock_guard<std::mutex> lock(mStatsMutex);
+            return mStats;
+        }
+
+        void HierarchicalAlphaLocator::informStats() const
+        {
+            HierarchicalAlphaStats s = stats();
+
+            Inform("Hierarchical alpha: " + ToString(s.solidTiles) + " solid and " +
+                   ToString(s.mixedTiles) + " mixed tiles, " +
+                   ToString(s.evaluatedPixels) + " pixels evaluated");
+
+            if(mDesc.verify)
+                Inform("Hierarchical alpha: " + ToString(s.mismatchedPixels) +
+                       " pixels differ from the exact path");
+        }
+
+        void HierarchicalAlphaLocator::resetStats()
+        {
+            std::lock_guard<std::mutex> lock(mStatsMutex);
+            mStats = HierarchicalAlphaStats();
+        }
+
+        TemporalAlphaLocator::TemporalAlphaLocator(TemporalAlphaLocatorDesc desc, tasks::TaskScheduler* scheduler)
+            : IAlphaLocator(scheduler)
+        {
+            if(!desc.locator)
+                throw std::runtime_error("Null temporal alpha locator child locator");
+
+            if(desc.tileSize == 0)
+                throw std::runtime_error("Temporal alpha locator tile size must be positive");
+
+            if(desc.maxDifference < 0)
+                throw std::runtime_error("Negative temporal alpha locator difference");
+
+            mDesc = desc;
+            reset();
+        }
+
+        size_t IAlphaLocator::hashModel(const BoundingPolyhedron* polyhedrons,
+                                        const size_t polyhedronCount,
+                                        const math::vec3& background)
+        {
+            //FNV-1a over the raw bytes.
+            size_t hash = 14695981039346656037ULL;
+            auto add = [&hash](const void* data, size_t size)
+            {
+                const unsigned char* bytes = (const unsigned char*)data;
+                for(size_t i = 0; i < size; ++i)
+                    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+            };
+
+            add(&background, sizeof(background));
+            add(&polyhedronCount, sizeof(polyhedronCount));
+            for(size_t i = 0; i < polyhedronCount; ++i)
+            {
+                const math::vec3 centre = polyhedrons[i].centre();
+                add(&centre, sizeof(centre));
+                add(polyhedrons[i].mVertices.data(), polyhedrons[i].mVertices.size()*sizeof(math::vec3));
+            }
+
+            return hash;
+        }
+
+        void TemporalAlphaLocator::updateModel(size_t modelHash, const cv::Mat& points) const
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            //Everything is dirty if the model or the frame size changed.
+            if(modelHash == mPreviousModelHash &&
+                    mPreviousPoints.rows == points.rows && mPreviousPoints.cols == points.cols)
+                return;
+
+            const int tileSize = mDesc.tileSize;
+            const int tilesX = (points.cols + tileSize - 1)/tileSize;
+            const int tilesY = (points.rows + tileSize - 1)/tileSize;
+
+            mPreviousPoints.create(points.rows, points.cols, CV_32FC3);
+            mPreviousAlphas.create(points.rows, points.cols, CV_32FC1);
+            std::vector<std::atomic<unsigned char> >(tilesX*tilesY).swap(mTileValid);
+            for(size_t i = 0; i < mTileValid.size(); ++i)
+                mTileValid[i].store(0, std::memory_order_relaxed);
+            mPreviousModelHash = modelHash;
+        }
+
+        void TemporalAlphaLocator::findAlphas(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const ia::InputAssembler &input,
+                cv::Mat& out) const
+        {
+            const cv::Mat& mat = input.mat();
+            const math::vec3 background = input.background();
+
+            //Once per frame, before the regions run concurrently.
+            updateModel(hashModel(polyhedrons, polyhedronCount, background), mat);
+
+            evaluateRegions(input, out, [&](const cv::Rect& region)
+            {
+                findTilesInRegion(polyhedrons, polyhedronCount, mat, background, region, out);
+            }, mDesc.tileSize);
+        }
+
+        void TemporalAlphaLocator::findAlphasInRegion(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Rect& region,
+                cv::Mat& out) const
+        {
+            updateModel(hashModel(polyhedrons, polyhedronCount, background), points);
+            findTilesInRegion(polyhedrons, polyhedronCount, points, background, region, out);
+        }
+
+        void TemporalAlphaLocator::findTilesInRegion(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Rect& region,
+                cv::Mat& out) const
+        {
+            TemporalAlphaStats stats = TemporalAlphaStats();
+
+            const int tileSize = mDesc.tileSize;
+            const float maxDifference = mDesc.maxDifference;
+            const int tilesX = (points.cols + tileSize - 1)/tileSize;
+
+            //Tiles are aligned to the frame, so that the same tiles are compared every frame.
+            for(int ty = region.y/tileSize*tileSize; ty < region.y + region.height; ty += tileSize)
+                for(int tx = region.x/tileSize*tileSize; tx < region.x + region.width; tx += tileSize)
+                {
+                    const cv::Rect tile = cv::Rect(tx, ty, tileSize, tileSize) & region;
+                    const size_t rowBytes = tile.width*sizeof(math::vec3);
+
+                    std::atomic<unsigned char>& valid = mTileValid[(ty/tileSize)*tilesX + tx/tileSize];
+
+                    //A tile is only valid once all of it has been computed.
+                    bool changed = !valid.load(std::memory_order_relaxed);
+                    for(int y = tile.y; !changed && y < tile.y + tile.height; ++y)
                     {
-                        math::vec3& point = *((math::vec3*)(data + j*3));
-                        float alpha;
+                        const float* current = (const float*)(points.data + points.step*y) + tile.x*3;
+                        const float* previous = (const float*)(mPreviousPoints.data + mPreviousPoints.step*y) + tile.x*3;
 
-                        //If right in the middle
-                        if(background==point)
-                            alpha = 0;
+                        if(maxDifference == 0.f)
+                            changed = memcmp(current, previous, rowBytes) != 0;
                         else
+                            for(int i = 0; !changed && i < tile.width*3; ++i)
+                                changed = std::abs(current[i] - previous[i]) > maxDifference;
+                    }
+
+                    if(changed)
+                    {
+                        mDesc.locator->findAlphasInRegion(polyhedrons, polyhedronCount, points,
+                                                          background, tile, out);
+
+                        //Remember what the tile was computed from.
+                        for(int y = tile.y; y < tile.y + tile.height; ++y)
                         {
-                            //Prepare vector
-                            const math::vec3 vector = point - background;
-                            const float vectorLen = vector.length();
-                            const math::vec3 vectorNorm = vector/vectorLen;
-                            const float distanceToPoint = point.distance(background);
-
-                            const float distanceToOuterPoly = outerPoly.findDistanceToPolyhedron(vectorNorm);
-
-                            //If inside outer poly, alpha < 1
-                            if(distanceToPoint < distanceToOuterPoly)
-                            {
-                                float distanceToInnerPoly = innerPoly.findDistanceToPolyhedron(vectorNorm);
-
-                                //If does not intersect with inner, fully inside
-                                if(distanceToPoint < distanceToInnerPoly)
-                                    alpha = 0;
-                                else //interpolate between inner and outer
-                                    alpha = (vectorLen - distanceToInnerPoly) /
-                                            (distanceToOuterPoly - distanceToInnerPoly);
-
-                            }
-                            else //If intersects with middle, it's outside. Alpha = 1.
-                                alpha = 1;
+                            memcpy(mPreviousPoints.data + mPreviousPoints.step*y + tile.x*sizeof(math::vec3),
+                                   points.data + points.step*y + tile.x*sizeof(math::vec3), rowBytes);
+                            memcpy(mPreviousAlphas.data + mPreviousAlphas.step*y + tile.x*sizeof(float),
+                                   out.data + out.step*y + tile.x*sizeof(float), tile.width*sizeof(float));
                         }
 
-                        *(dataOut+j) = alpha;
+                        //A region covering the whole tile has it to itself, while partial ones only ever
+                        //clear the flag, so that a tile split between regions is recomputed next time.
+                        valid.store(tile == cv::Rect(tx, ty, std::min(tileSize, points.cols-tx),
+                                                     std::min(tileSize, points.rows-ty)),
+                                    std::memory_order_relaxed);
+                        ++stats.computedTiles;
+                    }
+                    else
+                    {
+                        for(int y = tile.y; y < tile.y + tile.height; ++y)
+                            memcpy(out.data + out.step*y + tile.x*sizeof(float),
+                                   mPreviousAlphas.data + mPreviousAlphas.step*y + tile.x*sizeof(float),
+                                   tile.width*sizeof(float));
+                        ++stats.reusedTiles;
                     }
                 }
 
-                END_TIMER(AlphaLocator);
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStats.reusedTiles += stats.reusedTiles;
+            mStats.computedTiles += stats.computedTiles;
+        }
+
+        void TemporalAlphaLocator::reset()
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPreviousPoints.release();
+            mPreviousAlphas.release();
+            mTileValid.clear();
+            mPreviousModelHash = 0;
+            mStats = TemporalAlphaStats();
+        }
 
-                return out;
-            }
+        TemporalAlphaStats TemporalAlphaLocator::stats() const
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            return mStats;
+        }
+
+        void TemporalAlphaLocator::informStats() const
+        {
+            TemporalAlphaStats s = stats();
+            Inform("Temporal alpha: " + ToString(s.reusedTiles) + " tiles reused, " +
+                   ToString(s.computedTiles) + " computed, hit rate " +
+                   ToString(s.hitRate()*100.f) + "%");
+        }
+
+        TextureAlphaLocator::TextureAlphaLocator(TextureAlphaLocatorDesc desc, tasks::TaskScheduler* scheduler)
+            : IAlphaLocator(scheduler), mTexturesHash(0)
+        {
+            RadialTexture::validate(desc.resolution);
+
+            mDesc = desc;
+        }
+
+        std::shared_ptr<const std::vector<RadialTexture> > TextureAlphaLocator::findTextures(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const math::vec3& background) const
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            const size_t modelHash = hashModel(polyhedrons, polyhedronCount, background);
+            if(mTextures && modelHash == mTexturesHash)
+                return mTextures;
+
+            START_TIMER(BakingAlphaTextures);
+
+            std::shared_ptr<std::vector<RadialTexture> > textures(
+                        new std::vector<RadialTexture>(polyhedronCount, RadialTexture(mDesc.resolution)));
+            for(size_t i = 0; i < polyhedronCount; ++i)
+                (*textures)[i].bake(polyhedrons[i]);
+
+            END_TIMER(BakingAlphaTextures);
+
+            mTextures = textures;
+            mTexturesHash = modelHash;
+            return mTextures;
+        }
+
+        float TextureAlphaLocator::findAlpha(const math::vec3& point,
+                                             const math::vec3& background,
+                                             const RadialTexture* textures,
+                                             const size_t textureCount)
+        {
+            return findNestedAlpha(point, background, textures, textureCount);
+        }
+
+        void TextureAlphaLocator::findAlphas(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const ia::InputAssembler &input,
+                cv::Mat& out) const
+        {
+            assert(polyhedronCount>1);
+
+            const cv::Mat& mat = input.mat();
+            const math::vec3 background = input.background();
+
+            //Once per frame, so that the regions neither lock nor hash the model.
+            const std::shared_ptr<const std::vector<RadialTexture> > textures =
+                    findTextures(polyhedrons, polyhedronCount, background);
+
+            evaluateRegions(input, out, [&](const cv::Rect& region)
+            {
+                findNestedAlphasInRegion(textures->data(), polyhedronCount, mat, background, region, out);
+            });
+        }
+
+        void TextureAlphaLocator::findAlphasInRegion(
+                const BoundingPolyhedron* polyhedrons,
+                const size_t polyhedronCount,
+                const cv::Mat& points,
+                const math::vec3 background,
+                const cv::Rect& region,
+                cv::Mat& out) const
+        {
+            assert(polyhedronCount>1);
+
+            //Held for the whole region, in case another thread bakes a new model meanwhile.
+            const std::shared_ptr<const std::vector<RadialTexture> > textures =
+                    findTextures(polyhedrons, polyhedronCount, background);
+
+            findNestedAlphasInRegion(textures->data(), polyhedronCount, points, background, region, out);
+        }
         }
     }
 }
@@ -1,5 +1,9 @@
 #pragma once
 #include "ialphalocator.h"
+#include "radialtexture.h"
+#include <mutex>
+#include <atomic>
+#include <memory>
 
 namespace anima
 {
@@ -7,23 +11,263 @@ namespace anima
     {
         namespace primatte
         {
-        /** Sends out rays to determine the alpha, interpolating between the two
+        /** Sends out rays to determine the alpha, interpolating between the
           * spheres. It is done so that:
           * If outside outer sphere, alpha = 1
           * If inside inner sphere, alpha = 0
           * If in the middle, interpolate.
+          * With more than two spheres, the k-th of n has an alpha of k/(n-1), and the alpha
+          * is interpolated between the two spheres around the point, giving a piecewise-linear ramp.
           * It expects that the bounding polyhedrons are sorted in
           * increasing order so that any ray sent is guaranteed that the inner
           * intersection is closer than the outer.
+          * All polyhedrons must have the same resolution, so that the face a ray passes
+          * through is only looked up once and shared by all of them.
           * This particular algorithm requires at least two polyhedrons.
         * */
         class AlphaRayLocator : public IAlphaLocator
         {
         public:
-            virtual cv::Mat findAlphas(
+            /** @param scheduler The scheduler to run on, or null to run serially. */
+            explicit AlphaRayLocator(tasks::TaskScheduler* scheduler = nullptr) : IAlphaLocator(scheduler) {}
+
+            /** Finds the alpha of a single point. */
+            static float findAlpha(const math::vec3& point,
+                                   const math::vec3& background,
+                                   const SpherePolyhedron& innerPoly,
+                                   const SpherePolyhedron& outerPoly);
+
+            /** Finds the alpha of a single point against polyhedronCount nested polyhedrons. */
+            static float findAlpha(const math::vec3& point,
+                                   const math::vec3& background,
+                                   const BoundingPolyhedron* polyhedrons,
+                                   const size_t polyhedronCount);
+
+            virtual void findAlphasInRegion(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const cv::Mat& points,
+                    const math::vec3 background,
+                    const cv::Rect& region,
+                    cv::Mat& out) const;
+        };
+
+        /** The descriptor of the hierarchical alpha locator. */
+        struct HierarchicalAlphaLocatorDesc
+        {
+            /* The locator used for exact evaluation. Must not be null. */
+            IAlphaLocator* exactLocator;
+
+            /* The side of the square tiles in pixels. Alpha is sampled on the tile corners. Must be > 1. */
+            unsigned tileSize;
+
+            /* If true, the whole region is also evaluated exactly, and the number of
+             * pixels that differ is reported. This is slow and only meant for tuning. */
+            bool verify;
+        };
+
+        /** Statistics gathered by the hierarchical alpha locator. */
+        struct HierarchicalAlphaStats
+        {
+            size_t solidTiles, mixedTiles, evaluatedPixels, mismatchedPixels;
+        };
+
+        /** Evaluates the alpha coarse-to-fine.
+          * The alpha is first evaluated on the corners of a grid of tiles. A tile whose corners,
+          * together with the corners of its neighbouring tiles, are all exactly 0 or all exactly 1
+          * is filled with that value without any ray casts. The remaining (mixed) tiles are evaluated
+          * by the exact locator.
+          * Most of a keyed plate is solid, so most of the per-pixel work is skipped.
+          * Features smaller than a tile lying entirely inside a solid block can be missed,
+          * which is what the verify option is for. */
+        class HierarchicalAlphaLocator : public IAlphaLocator
+        {
+            HierarchicalAlphaLocatorDesc mDesc;
+
+            /* The statistics of the calls since the last reset. */
+            mutable HierarchicalAlphaStats mStats;
+            mutable std::mutex mStatsMutex;
+
+        public:
+
+            /** Initialises the class, throwing an exception upon failure
+             * (most commonly std::runtime_error)
+             * @param scheduler The scheduler findAlphas() runs on, or null to run serially. */
+            HierarchicalAlphaLocator(HierarchicalAlphaLocatorDesc desc, tasks::TaskScheduler* scheduler = nullptr);
+
+            virtual void findAlphasInRegion(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const cv::Mat& points,
+                    const math::vec3 background,
+                    const cv::Rect& region,
+                    cv::Mat& out) const;
+
+            /** Returns the statistics accumulated since construction or the last reset. */
+            HierarchicalAlphaStats stats() const;
+
+            /** Prints the statistics, including the verification result if enabled. */
+            void informStats() const;
+
+            /** Resets the statistics. */
+            void resetStats();
+        };
+
+        /** The descriptor of the temporal alpha locator. */
+        struct TemporalAlphaLocatorDesc
+        {
+            /* The locator used to evaluate changed tiles. Must not be null. */
+            IAlphaLocator* locator;
+
+            /* The side of the square tiles in pixels. Must be > 0. */
+            unsigned tileSize;
+
+            /* The maximum absolute difference of any channel for a pixel to be considered
+             * unchanged. 0 requires the tile to be bit-identical. */
+            float maxDifference;
+        };
+
+        /** Statistics gathered by the temporal alpha locator. */
+        struct TemporalAlphaStats
+        {
+            size_t reusedTiles, computedTiles;
+
+            /** The fraction of tiles that were copied from the previous frame. */
+            float hitRate() const
+            {
+                return reusedTiles+computedTiles == 0 ? 0.f : reusedTiles/float(reusedTiles+computedTiles);
+            }
+        };
+
+        /** Reuses the alpha of the previous frame for unchanged tiles, for use when processing
+          * a sequence of frames (such as a locked-off shot) one after the other.
+          * Each tile is compared against the points it was last computed from, and its alpha is
+          * copied forward if no pixel changed by more than maxDifference and the polyhedrons and
+          * background are the same as then. Only the changed tiles are passed to the locator.
+          * Tiles are only refreshed when recomputed, so slow drift eventually triggers a recompute.
+          * findAlphas() checks the model once per frame and evaluates the regions concurrently,
+          * while direct calls to findAlphasInRegion() check it on every call.
+          * As it keeps state, a locator instance must only be used for a single sequence,
+          * one frame at a time. */
+        class TemporalAlphaLocator : public IAlphaLocator
+        {
+            TemporalAlphaLocatorDesc mDesc;
+
+            /* The points each tile was last computed from, and the resulting alpha.
+             * Each pixel belongs to a single region of a frame, so regions write them without locking. */
+            mutable cv::Mat mPreviousPoints, mPreviousAlphas;
+
+            /* Whether each tile has been fully computed with the current model.
+             * A tile may be split between concurrent regions, so they are atomic. */
+            mutable std::vector<std::atomic<unsigned char> > mTileValid;
+
+            /* A hash of the polyhedrons and background of the previous frame. */
+            mutable size_t mPreviousModelHash;
+
+            mutable TemporalAlphaStats mStats;
+            mutable std::mutex mMutex;
+
+            /** Forgets the history if the model or the frame size changed. */
+            void updateModel(size_t modelHash, const cv::Mat& points) const;
+
+            /** Evaluates the tiles of a region against the history of the current model. */
+            void findTilesInRegion(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const cv::Mat& points,
+                    const math::vec3 background,
+                    const cv::Rect& region,
+                    cv::Mat& out) const;
+
+        public:
+
+            /** Initialises the class, throwing an exception upon failure
+             * (most commonly std::runtime_error)
+             * @param scheduler The scheduler findAlphas() runs on, or null to run serially. */
+            TemporalAlphaLocator(TemporalAlphaLocatorDesc desc, tasks::TaskScheduler* scheduler = nullptr);
+
+            virtual void findAlphas(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const ia::InputAssembler &input,
+                    cv::Mat& out) const;
+
+            virtual void findAlphasInRegion(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const cv::Mat& points,
+                    const math::vec3 background,
+                    const cv::Rect& region,
+                    cv::Mat& out) const;
+
+            /** Forgets the previous frame, such as when starting a new shot. */
+            void reset();
+
+            /** Returns the statistics accumulated since construction or the last reset. */
+            TemporalAlphaStats stats() const;
+
+            /** Prints the statistics, including the hit rate. */
+            void informStats() const;
+        };
+
+        /** The descriptor of the texture alpha locator. */
+        struct TextureAlphaLocatorDesc
+        {
+            /* The number of cells along each side of the textures.
+             * Must be within [1, MAX_RADIAL_TEXTURE_RESOLUTION]. */
+            unsigned resolution;
+        };
+
+        /** Finds the alpha as AlphaRayLocator does, but against radial textures baked from the
+          * polyhedrons, so that each distance is a bilinear texture fetch rather than a face lookup
+          * and a plane intersection. The textures are baked when the polyhedrons change, so the
+          * cost is amortised over the frames of a model. The result approximates that of
+          * AlphaRayLocator, the more closely the higher the resolution.
+          * findAlphas() looks the textures up once per frame, while direct calls to
+          * findAlphasInRegion() look them up on every call.
+          * This particular algorithm requires at least two polyhedrons. */
+        class TextureAlphaLocator : public IAlphaLocator
+        {
+            TextureAlphaLocatorDesc mDesc;
+
+            /* The textures baked from the polyhedrons of mTexturesHash. They are replaced rather
+             * than rebaked in place, so that regions still using the previous ones are unaffected. */
+            mutable std::shared_ptr<const std::vector<RadialTexture> > mTextures;
+            mutable size_t mTexturesHash;
+            mutable std::mutex mMutex;
+
+            /** Returns the textures of the polyhedrons, baking them if they changed. */
+            std::shared_ptr<const std::vector<RadialTexture> > findTextures(const BoundingPolyhedron* polyhedrons,
+                                                                            const size_t polyhedronCount,
+                                                                            const math::vec3& background) const;
+
+        public:
+
+            /** Initialises the class, throwing an exception upon failure
+             * (most commonly std::runtime_error)
+             * @param scheduler The scheduler findAlphas() runs on, or null to run serially. */
+            TextureAlphaLocator(TextureAlphaLocatorDesc desc, tasks::TaskScheduler* scheduler = nullptr);
+
+            /** Finds the alpha of a single point against textureCount nested textures
+              * of the same resolution, as AlphaRayLocator::findAlpha does for polyhedrons. */
+            static float findAlpha(const math::vec3& point,
+                                   const math::vec3& background,
+                                   const RadialTexture* textures,
+                                   const size_t textureCount);
+
+            virtual void findAlphas(
+                    const BoundingPolyhedron* polyhedrons,
+                    const size_t polyhedronCount,
+                    const ia::InputAssembler &input,
+                    cv::Mat& out) const;
+
+            virtual void findAlphasInRegion(
                     const BoundingPolyhedron* polyhedrons,
                     const size_t polyhedronCount,
-                    const ia::InputAssembler &input) const;
+                    const cv::Mat& points,
+                    const math::vec3 background,
+                    const cv::Rect& region,
+                    cv::Mat& out) const;
         };
         }
     }
@@ -7,10 +7,14 @@
 #include "averagebackgroundcolourlocators.h"
 #include "coloursegmenters.h"
 #include "alphalocator.h"
+#include "compositor.h"
+#include "taskscheduler.h"
+#include "allocationcounter.h"
 #include "io.h"
 
 
 Application::Application() :
+    mScheduler(nullptr),
     mInputAssembler(nullptr),
     mAlgorithm(nullptr),
     mFitter(nullptr),
@@ -26,6 +30,7 @@ Application::~Application()
     delete mFitter;
     delete mAlgorithm;
     delete mInputAssembler;
+    delete mScheduler;
 }
 
 void Application::timerEvent(QTimerEvent*)
@@ -53,6 +58,13 @@ void Application::init()
         mBasicTimer.start(16.66666666, this);
 
 
+        //The workers shared by every stage below. By default there is one per processor.
+        //They may be pinned to processors, or restricted to a NUMA node.
+        anima::tasks::TaskSchedulerDescriptor schedulerDesc;
+        schedulerDesc.pinThreads = false;
+        schedulerDesc.numaNode = -1;
+        mScheduler = new anima::tasks::TaskScheduler(schedulerDesc);
+
         Inform("Processing input");
 
         cv::Mat imageMat = cv::imread("test.jpg");
@@ -67,8 +79,12 @@ void Application::init()
         ////////////////////////////// Input Stage /////////////////////////////////
         ////////////////////////////////////////////////////////////////////////////
 
-        /* Locates the dominant background colour from the input background image mat. */
-        mBackgroundLocator = new anima::ia::ABCL_BarycentreBased();
+        /* Locates the dominant background colour from the input background image mat.
+         * The histogram mode is not skewed by shadows or rigs in the clean plate, unlike
+         * ABCL_BarycentreBased, and only every other pixel of every other row is read.
+         * Sub-algorithms run on the scheduler they are constructed with, if any. */
+        mBackgroundLocator = new anima::ia::ABCL_HistogramBased(32, 2, anima::ia::ABCL_HistogramBased::E_MODE,
+                                                                0.25f, mScheduler);
 
         //This descriptor is used to initialise the input assembler.
         InputAssemblerDescriptor iaDesc;
@@ -85,6 +101,10 @@ void Application::init()
         //The background image.
         iaDesc.backgroundSource = &backgroundMat;
 
+        //Floating point rgb sources could be referenced instead of copied,
+        //but the loaded images are 8-bit.
+        iaDesc.borrowSources = false;
+
         //The 3D grid segment count to use for cleaning up duplicate input
         //points. Lower values require less memory and filter more aggressively.
         iaDesc.ipd.gridSize = 400;
@@ -94,9 +114,25 @@ void Application::init()
         //HSV is unsuitable for blue due to wrap-around!
         iaDesc.targetColourspace = InputAssemblerDescriptor::ETCS_RGB;
 
-        //Remove % of points randomly after cleanup to speed up computation.
+        //Subsample the points after cleanup to speed up computation, either removing
+        //a percentage of them or keeping a fixed number (if the budget is not zero).
+        //The subsampling is stratified over the colour cube so that rare colours
+        //survive, and the same seed always keeps the same points.
         iaDesc.ipd.randomSimplify = false;
         iaDesc.ipd.randomSimplifyPercentage = 30.0;
+        iaDesc.ipd.simplifyBudget = 0;
+        iaDesc.ipd.simplifySeed = 0;
+        iaDesc.ipd.simplifyStrata = 8;
+
+        //Optionally restrict processing to a garbage matte (CV_8UC1, zero = excluded)
+        //and/or a list of rectangles. Excluded pixels are skipped when cleaning up
+        //the points and computing the alpha, and are given excludedAlpha instead.
+        iaDesc.garbageMatte = nullptr;
+        iaDesc.regionsOfInterest = nullptr;
+        iaDesc.excludedAlpha = 0.f;
+
+        //The scheduler to run the input processing on. If null, it runs serially.
+        iaDesc.scheduler = mScheduler;
 
         //Create the assembler object, load, and process the input.
         //An exception will be thrown in case of an error, most likely
@@ -114,18 +150,21 @@ void Application::init()
            to perform, akin to a binary search algorithm iteration.
            2 is a good number, as it's both accurate and doesn't fit TOO closely, which
            can lead to errors due to the sample points being simplified. */
-        mFitter = new StableFitting(2);
+        mFitter = new StableFitting(2, mScheduler);
 
         /* The segmenter algorithm to use. It splits the data points in two based on the parameters.
            The distance segmenter splits the input based on whether a point is inside/outside a sphere. */
-        mSegmenter = new DistanceColourSegmenter();
+        mSegmenter = new DistanceColourSegmenter(mScheduler);
 
         /* The alpha interpolation algorithm to use. It is used to compute the alpha for each pixel. */
-        mAlphaLocator = new AlphaRayLocator();
+        mAlphaLocator = new AlphaRayLocator(mScheduler);
 
         //Fill in the algorithm descriptor.
         AlgorithmPrimatteDesc algDesc;
 
+        //The scheduler the algorithm runs on. If null, it runs serially.
+        algDesc.scheduler = mScheduler;
+
         //The fitter algorithm to use.
         algDesc.boundingPolyhedronDesc.fitter = mFitter;
 
@@ -167,6 +206,10 @@ void Application::init()
         //Note that it is relative to the final size of the inner polyhedron.
         algDesc.outerScaleParameter = 1.f;
 
+        //Shells between the inner and outer polyhedrons bend the alpha ramp. None gives a linear one.
+        //For example, a single shell at 0.25 reaches half alpha a quarter of the way out.
+        algDesc.intermediateShells = 0;
+
         mAlgorithm = new AlgorithmPrimatte(algDesc);
 
         Inform("Analysing input");
@@ -187,6 +230,17 @@ void Application::init()
         //Apply the polyhedrae to the input image, and save the alpha to result.
         cv::Mat result = mAlgorithm->computeAlphas();
 
+        //Built with ANIMA_COUNT_ALLOCATIONS, check that a full analysis and alpha computation
+        //of the same input allocate nothing once the buffers are warm.
+        if(anima::countingAllocations())
+        {
+            const size_t allocations = anima::allocationCount();
+            mAlgorithm->setInput(mInputAssembler);
+            mAlgorithm->analyse();
+            mAlgorithm->computeAlphas(result);
+            Inform("Allocations in a warm analysis: " + ToString(anima::allocationCount() - allocations));
+        }
+
         END_TIMER(WholeProgramTimer);
 
         //Note: This is not part of the algorithm. It's just to preview the result.
@@ -196,27 +250,24 @@ void Application::init()
         cv::imshow("Alpha", result);
 
         //Apply the alpha to the original image in order to preview it.
-        cv::Mat af = imageMat.clone();
+        //The compositor cancels out the original background colour from the guessed alpha
+        //and blends the result over the given colour.
+        anima::oa::CompositorDescriptor compositorDesc;
+        compositorDesc.operation = anima::oa::CompositorDescriptor::ECO_OVER_COLOUR;
+        compositorDesc.cancelBackground = true;
+
+        //The background colour in the image. Only valid as-is for the RGB colour space.
+        compositorDesc.screenColour = mInputAssembler->background();
 
         //The background colour to blend with in BGR format.
-        cv::Vec3f backgroundBlendColour(0,0,1);
-        cv::Vec3f backgroundInImage(mInputAssembler->background().x,
-                                    mInputAssembler->background().y,
-                                    mInputAssembler->background().z);
-
-        for(int r = 0; r < af.rows; ++r)
-            for(int c = 0; c < af.cols; ++c)
-            {
-                cv::Vec3b& original = af.at<cv::Vec3b>(r,c);
-                float alpha = result.at<float>(r,c);
-                cv::Vec3f originalf = original;
-                originalf *= 1/255.f;
-
-                //Cancel out original background colour from guessed alpha
-                cv::Vec3f foreground = (originalf - backgroundInImage*(1 - alpha))*(alpha);
-
-                original = (foreground*alpha + backgroundBlendColour*(1.f-alpha))*255;
-            }
+        compositorDesc.overColour = math::vec3(0,0,1);
+
+        compositorDesc.scheduler = mScheduler;
+
+        anima::oa::Compositor compositor(compositorDesc);
+
+        cv::Mat af(imageMat.rows, imageMat.cols, CV_8UC3);
+        compositor.composite(imageMat, result, af);
 
         cv::namedWindow( "AF", cv::WINDOW_AUTOSIZE );
         cv::imshow( "AF", af );
@@ -21,6 +21,10 @@ namespace anima
         class InputAssembler;
         class IAverageBackgroundColourLocator;
     }
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
 }
 
 /** The main application class. It is to be replaced in the future by a proper
@@ -48,6 +52,9 @@ public:
     /** Used by qglviewer to provide a help string during preview. */
     virtual QString helpString() const;
 
+    /* The task scheduler shared by every stage. */
+    anima::tasks::TaskScheduler* mScheduler;
+
     /* The input data structure. */
     anima::ia::InputAssembler* mInputAssembler;
 
@@ -1,5 +1,9 @@
 #include "averagebackgroundcolourlocators.h"
+#include "taskscheduler.h"
 #include "io.h"
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
 
 namespace anima
 {
@@ -25,5 +29,201 @@ namespace anima
             background/=r*c;
             return background;
         }
+
+        //The least lattice rows per band, and the most bands, each of which has its own histogram.
+        static const unsigned HISTOGRAM_BAND_ROWS = 16;
+        static const unsigned HISTOGRAM_MAX_BANDS = 16;
+
+        namespace
+        {
+            /* Maps colours to the cells of the histogram, clamping those outside [0, 1]. */
+            struct HistogramCell
+            {
+                int bins;
+
+                int axis(float v) const
+                {
+                    const int i = int(v*bins);
+                    return i < 0 ? 0 : (i >= bins ? bins-1 : i);
+                }
+
+                unsigned operator()(const math::vec3& p) const
+                {
+                    return axis(p.x) + bins*(axis(p.y) + bins*axis(p.z));
+                }
+            };
+
+            /* The lattice rows [begin, end) of a band. */
+            struct Band
+            {
+                unsigned begin, end;
+            };
+
+            /* Calls f(point) for every stride-th pixel of the lattice rows of the band. */
+            template<class F>
+            void ForEachSample(const cv::Mat& mat, unsigned stride, const Band& band, const F& f)
+            {
+                for(unsigned i = band.begin; i < band.end; ++i)
+                {
+                    const float* data = (const float*)(mat.data + mat.step*(i*stride));
+                    for(int j = 0; j < mat.cols; j += stride)
+                        f(*((const math::vec3*)(data + j*3)));
+                }
+            }
+
+            /* Replaces each cell by the sum of the three cells around it along one axis. */
+            void BoxSumAxis(std::vector<unsigned>& counts, std::vector<unsigned>& temp, int bins, int axisStep)
+            {
+                const int bins3 = bins*bins*bins;
+                for(int c = 0; c < bins3; ++c)
+                {
+                    const int coordinate = (c/axisStep) % bins;
+                    unsigned sum = counts[c];
+                    if(coordinate > 0)
+                        sum += counts[c-axisStep];
+                    if(coordinate < bins-1)
+                        sum += counts[c+axisStep];
+                    temp[c] = sum;
+                }
+                counts.swap(temp);
+            }
+        }
+
+        ABCL_HistogramBased::ABCL_HistogramBased(unsigned bins, unsigned stride, Estimate estimate, float trimFraction,
+                                                 tasks::TaskScheduler* scheduler) :
+            IAverageBackgroundColourLocator(scheduler), mBins(bins), mStride(stride), mEstimate(estimate), mTrimFraction(trimFraction)
+        {
+            if(bins < 2 || bins > 64)
+                throw std::runtime_error("Histogram bins must be within [2, 64].");
+            if(stride == 0)
+                throw std::runtime_error("Histogram stride must not be 0.");
+            if(!(trimFraction >= 0.f && trimFraction < 1.f))
+                throw std::runtime_error("Histogram trim fraction must be within [0, 1).");
+        }
+
+        math::vec3 ABCL_HistogramBased::findColour(const cv::Mat& mat) const
+        {
+            START_TIMER(LocatingBackgroundHistogram);
+
+            assert(mat.type() == CV_32FC3);
+            const int bins = mBins;
+            const unsigned bins3 = mBins*mBins*mBins;
+            const HistogramCell cellOf = {bins};
+
+            //Split the lattice rows into bands, which are processed concurrently with a scheduler.
+            const unsigned latticeRows = (mat.rows + mStride - 1)/mStride;
+            unsigned bandCount = 1;
+            if(mScheduler)
+                bandCount = std::max(1u, std::min(latticeRows/HISTOGRAM_BAND_ROWS, HISTOGRAM_MAX_BANDS));
+
+            std::vector<Band> bands(bandCount);
+            for(unsigned b = 0; b < bandCount; ++b)
+            {
+                bands[b].begin = latticeRows*b/bandCount;
+                bands[b].end = latticeRows*(b+1)/bandCount;
+            }
+
+            //Count the samples per cell, each band into its own histogram.
+            std::vector<std::vector<unsigned> > histograms(bandCount, std::vector<unsigned>(bins3, 0));
+            tasks::parallelFor(mScheduler, 0, bandCount, 1, [&](size_t begin, size_t end)
+            {
+                for(size_t b = begin; b < end; ++b)
+                {
+                    unsigned* counts = &histograms[b][0];
+                    ForEachSample(mat, mStride, bands[b], [&](const math::vec3& p)
+                    {
+                        ++counts[cellOf(p)];
+                    });
+                }
+            });
+
+            std::vector<unsigned>& counts = histograms[0];
+            for(unsigned b = 1; b < bandCount; ++b)
+                for(unsigned c = 0; c < bins3; ++c)
+                    counts[c] += histograms[b][c];
+
+            //The densest cell is chosen with its neighbours, so that a peak split
+            //between cells is not lost to a narrower one.
+            std::vector<unsigned> density(counts), temp(bins3);
+            BoxSumAxis(density, temp, bins, 1);
+            BoxSumAxis(density, temp, bins, bins);
+            BoxSumAxis(density, temp, bins, bins*bins);
+            const int peak = int(std::max_element(density.begin(), density.end()) - density.begin());
+            const int px = peak % bins, py = (peak/bins) % bins, pz = peak/(bins*bins);
+
+            //The samples are then averaged within a squared cell distance of the peak.
+            auto distanceSq = [&](unsigned c)
+            {
+                const int dx = int(c % bins) - px, dy = int((c/bins) % bins) - py, dz = int(c/(bins*bins)) - pz;
+                return unsigned(dx*dx + dy*dy + dz*dz);
+            };
+
+            unsigned maxDistanceSq = 3;
+            if(mEstimate == E_TRIMMED_MEAN)
+            {
+                //Count the samples per distance, and keep the nearest until enough are kept.
+                std::vector<size_t> perDistance(3*(bins-1)*(bins-1) + 1, 0);
+                size_t total = 0;
+                for(unsigned c = 0; c < bins3; ++c)
+                {
+                    perDistance[distanceSq(c)] += counts[c];
+                    total += counts[c];
+                }
+
+                const double wanted = (1.0 - mTrimFraction)*total;
+                size_t kept = 0;
+                for(maxDistanceSq = 0; maxDistanceSq < perDistance.size(); ++maxDistanceSq)
+                {
+                    kept += perDistance[maxDistanceSq];
+                    if(kept > 0 && kept >= wanted)
+                        break;
+                }
+            }
+
+            std::vector<unsigned char> averaged(bins3);
+            for(unsigned c = 0; c < bins3; ++c)
+                averaged[c] = distanceSq(c) <= maxDistanceSq;
+
+            //Sum the averaged samples per band, combined in band order so that the result is deterministic.
+            struct Sum
+            {
+                double x, y, z;
+                size_t count;
+            };
+            std::vector<Sum> sums(bandCount, Sum());
+            tasks::parallelFor(mScheduler, 0, bandCount, 1, [&](size_t begin, size_t end)
+            {
+                for(size_t b = begin; b < end; ++b)
+                {
+                    Sum sum = Sum();
+                    ForEachSample(mat, mStride, bands[b], [&](const math::vec3& p)
+                    {
+                        if(averaged[cellOf(p)])
+                        {
+                            sum.x += p.x;
+                            sum.y += p.y;
+                            sum.z += p.z;
+                            ++sum.count;
+                        }
+                    });
+                    sums[b] = sum;
+                }
+            });
+
+            Sum total = Sum();
+            for(unsigned b = 0; b < bandCount; ++b)
+            {
+                total.x += sums[b].x;
+                total.y += sums[b].y;
+                total.z += sums[b].z;
+                total.count += sums[b].count;
+            }
+
+            END_TIMER(LocatingBackgroundHistogram);
+
+            if(total.count == 0)
+                return math::vec3();
+            return math::vec3(total.x/total.count, total.y/total.count, total.z/total.count);
+        }
     }
 }
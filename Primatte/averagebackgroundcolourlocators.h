@@ -9,8 +9,45 @@ namespace anima
         class ABCL_BarycentreBased : public IAverageBackgroundColourLocator
         {
         public:
+            /** @param scheduler The scheduler to run on, or null to run serially. */
+            explicit ABCL_BarycentreBased(tasks::TaskScheduler* scheduler = nullptr)
+                : IAverageBackgroundColourLocator(scheduler) {}
+
             virtual math::vec3 findColour(const cv::Mat& mat) const;
 
         };
+
+    /** Chooses the average background colour from a coarse 3D histogram of the colours,
+        so that shadows, rigs and spill in the clean plate do not skew it.
+        The histogram is built in parallel bands over a lattice of every stride-th pixel
+        of every stride-th row. The colour is then the mean of the samples either around
+        the most populated cell, or closest to it once the farthest are trimmed. */
+        class ABCL_HistogramBased : public IAverageBackgroundColourLocator
+        {
+        public:
+            enum Estimate
+            {
+                //The mean of the samples in the densest cell and its direct neighbours.
+                E_MODE,
+                //The mean of the samples nearest the densest cell, leaving out trimFraction of them.
+                E_TRIMMED_MEAN
+            };
+
+        private:
+            unsigned mBins, mStride;
+            Estimate mEstimate;
+            float mTrimFraction;
+
+        public:
+            /** Throws std::runtime_error if bins is not within [2, 64], stride is 0,
+                or trimFraction is not within [0, 1). Colours are expected within [0, 1],
+                those outside are counted in the border cells.
+                The bands run concurrently on the scheduler, if not null. */
+            ABCL_HistogramBased(unsigned bins = 32, unsigned stride = 2,
+                                Estimate estimate = E_MODE, float trimFraction = 0.25f,
+                                tasks::TaskScheduler* scheduler = nullptr);
+
+            virtual math::vec3 findColour(const cv::Mat& mat) const;
+        };
     }
 }
@@ -3,6 +3,7 @@
 #include "stdlib.h"
 #include <algorithm>
 #include <stdexcept>
+#include <cassert>
 #include "ifittingalgorithm.h"
 
 namespace anima
@@ -13,6 +14,15 @@ namespace anima
         {
             BoundingPolyhedron::BoundingPolyhedron(BoundingPolyhedronDescriptor desc)
                 : SpherePolyhedron(desc.phiFaces, desc.thetaFaces)
+            {
+                validate(desc);
+
+                mDesc = desc;
+
+                mInitialised = true;
+            }
+
+            void BoundingPolyhedron::validate(const BoundingPolyhedronDescriptor& desc)
             {
                 if(desc.fitter==nullptr)
                     throw std::runtime_error("Null fitter");
@@ -20,13 +30,22 @@ namespace anima
                 if(desc.scaleMultiplier < 0)
                     throw std::runtime_error("Negative bounding polyhedron scale multiplier");
 
+                if(desc.phiFaces <= 3 || desc.thetaFaces <= 2)
+                    throw std::runtime_error("Bounding polyhedron resolution out of range");
+            }
+
+            void BoundingPolyhedron::reset(BoundingPolyhedronDescriptor desc)
+            {
+                validate(desc);
+
+                rebuild(desc.phiFaces, desc.thetaFaces);
                 mDesc = desc;
 
                 mInitialised = true;
             }
 
             //Adapted from http://stackoverflow.com/a/24818473
-            std::pair<math::vec3, float> calculateBoundSphere(const std::vector<math::vec3>& vertices)
+            std::pair<math::vec3, float> calculateBoundSphere(PointSpan vertices)
             {
                 math::vec3 center = vertices[0];
                 float radius = 0.0001f;
@@ -64,7 +83,7 @@ namespace anima
             }
 
 
-            void BoundingPolyhedron::positionAround(const math::vec3 desiredCentre, const std::vector<math::vec3>& points)
+            void BoundingPolyhedron::positionAround(const math::vec3 desiredCentre, PointSpan points)
             {
                 if(!mInitialised)
                     throw::std::runtime_error("Using uninitialised bounding polyhedron");
@@ -84,9 +103,34 @@ namespace anima
                 for(auto it = out.mVertices.begin(); it!=out.mVertices.end(); ++it)
                     *it = (*it-mCentre)*scale+mCentre;
                 out.mRadius *= scale;
+                out.mPlanes.clear();
                 return out;
             }
 
+            void BoundingPolyhedron::assignScaled(const BoundingPolyhedron& source, const float scale)
+            {
+                //Copy assignment keeps the vertex storage when it is large enough.
+                *this = source;
+                for(auto it = mVertices.begin(); it!=mVertices.end(); ++it)
+                    *it = (*it-mCentre)*scale+mCentre;
+                mRadius *= scale;
+                mPlanes.clear();
+            }
+
+            void BoundingPolyhedron::assignBlended(const BoundingPolyhedron& from, const BoundingPolyhedron& to, const float t)
+            {
+                assert(from.mVertices.size() == to.mVertices.size());
+
+                *this = from;
+                mCentre = from.mCentre + (to.mCentre - from.mCentre)*t;
+                mRadius = from.mRadius + (to.mRadius - from.mRadius)*t;
+
+                //Each vertex moves along its direction from the centre, so the topology still holds.
+                for(size_t i = 0; i < mVertices.size(); ++i)
+                    mVertices[i] = mCentre + (from.mVertices[i] - from.mCentre)*(1.f-t) + (to.mVertices[i] - to.mCentre)*t;
+                mPlanes.clear();
+            }
+
         }
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include "matrixd.h"
 #include "spherepolyhedron.h"
+#include "pointspan.h"
 
 /** A polyhedron object that's capable of wrapping itself around a set of points. */
 namespace anima
@@ -44,17 +45,34 @@ namespace anima
                 /** Constructs the object from the descriptor. */
                 BoundingPolyhedron(BoundingPolyhedronDescriptor desc);
 
+                /** Throws std::runtime_error if the descriptor is invalid. */
+                static void validate(const BoundingPolyhedronDescriptor& desc);
+
+                /** Reinitialises the object from the descriptor as the constructor does,
+                  * reusing its storage when the resolution is unchanged. */
+                void reset(BoundingPolyhedronDescriptor desc);
+
                 /** Positions the polyhedral sphere around the points,
                   * only using linear transformations.
                   * @param points The points around which to position the
                                   polyhedron.
                   */
-                void positionAround(const math::vec3 desiredCentre, const std::vector<math::vec3>& points);
+                void positionAround(const math::vec3 desiredCentre, PointSpan points);
 
                 IFittingAlgorithm* fitter() { return mDesc.fitter; }
 
+                /** Returns the descriptor the polyhedron was initialised from. */
+                const BoundingPolyhedronDescriptor& descriptor() const { return mDesc; }
+
                 /** Returns a copy of the polyhedron scaled around the centre */
                 BoundingPolyhedron operator * (const float scale);
+
+                /** Makes this a copy of source scaled around its centre, reusing the storage. */
+                void assignScaled(const BoundingPolyhedron& source, const float scale);
+
+                /** Makes this the polyhedron a fraction t of the way from one to the other, reusing
+                  * the storage. Both must have the same resolution, and t = 0 gives from. */
+                void assignBlended(const BoundingPolyhedron& from, const BoundingPolyhedron& to, const float t);
             };
         }
     }
@@ -1,27 +1,166 @@
 #include "coloursegmenters.h"
+#include "taskscheduler.h"
 #include "io.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace anima
 {
     namespace alg
     {
         namespace primatte
         {
-             SegmenterResult DistanceColourSegmenter::segment(const std::vector<math::vec3> &points,
-                                                                 const math::vec3 reference,
-                                                                 float approximateRadius) const
+            //The points per chunk classified and moved as a task.
+            static const size_t SEGMENT_GRAIN = 4096;
+
+            void IColourSegmenter::segment(const std::vector<math::vec3> &points,
+                                           const math::vec3 background,
+                                           float approximateRadius,
+                                           SegmenterResult& out) const
+            {
+                //Cleared rather than replaced, so that the storage of a reused result is kept.
+                out.inner.clear();
+                out.outer.clear();
+
+                //Classify, in parallel with a scheduler, then gather in order.
+                std::vector<unsigned char>& isInner = out.scratch;
+                isInner.resize(points.size());
+                tasks::parallelFor(mScheduler, 0, points.size(), SEGMENT_GRAIN, [&](size_t begin, size_t end)
+                {
+                    classify(points.data() + begin, end - begin, background, approximateRadius, isInner.data() + begin);
+                });
+
+                size_t innerCount = 0;
+                for(size_t i = 0; i < isInner.size(); ++i)
+                    innerCount += isInner[i];
+
+                out.inner.reserve(innerCount);
+                out.outer.reserve(points.size() - innerCount);
+                for(size_t i = 0; i < points.size(); ++i)
+                    (isInner[i] ? out.inner : out.outer).push_back(points[i]);
+            }
+
+            SegmenterSpans IColourSegmenter::partition(PointSpan points,
+                                                       const math::vec3 background,
+                                                       float approximateRadius,
+                                                       std::vector<math::vec3>& out,
+                                                       SegmenterScratch& scratch) const
+            {
+                const size_t count = points.size();
+                const size_t chunkCount = (count + SEGMENT_GRAIN - 1)/SEGMENT_GRAIN;
+
+                scratch.isInner.resize(count);
+                scratch.chunkOffsets.resize(chunkCount);
+                out.resize(count);
+
+                //Classify each chunk and count its inner points.
+                tasks::parallelFor(mScheduler, 0, chunkCount, 1, [&](size_t begin, size_t end)
+                {
+                    for(size_t chunk = begin; chunk < end; ++chunk)
+                    {
+                        const size_t first = chunk*SEGMENT_GRAIN;
+                        const size_t last = std::min(first + SEGMENT_GRAIN, count);
+                        unsigned char* isInner = scratch.isInner.data();
+
+                        classify(points.data + first, last - first, background, approximateRadius, isInner + first);
+
+                        size_t innerCount = 0;
+                        for(size_t i = first; i < last; ++i)
+                            innerCount += isInner[i];
+                        scratch.chunkOffsets[chunk] = innerCount;
+                    }
+                });
+
+                //Turn the counts into the offset of each chunk within the inner half.
+                size_t innerTotal = 0;
+                for(size_t chunk = 0; chunk < chunkCount; ++chunk)
+                {
+                    const size_t innerCount = scratch.chunkOffsets[chunk];
+                    scratch.chunkOffsets[chunk] = innerTotal;
+                    innerTotal += innerCount;
+                }
+
+                //Move each chunk into place. The outer points of a chunk follow the inner total,
+                //offset by the outer points of the chunks before it.
+                tasks::parallelFor(mScheduler, 0, chunkCount, 1, [&](size_t begin, size_t end)
+                {
+                    for(size_t chunk = begin; chunk < end; ++chunk)
+                    {
+                        const size_t first = chunk*SEGMENT_GRAIN;
+                        const size_t last = std::min(first + SEGMENT_GRAIN, count);
+                        const unsigned char* isInner = scratch.isInner.data();
+
+                        math::vec3* inner = out.data() + scratch.chunkOffsets[chunk];
+                        math::vec3* outer = out.data() + innerTotal + (first - scratch.chunkOffsets[chunk]);
+                        for(size_t i = first; i < last; ++i)
+                            *(isInner[i] ? inner++ : outer++) = points[i];
+                    }
+                });
+
+                SegmenterSpans spans;
+                spans.inner = PointSpan(out.data(), innerTotal);
+                spans.outer = PointSpan(out.data() + innerTotal, count - innerTotal);
+                return spans;
+            }
+
+            SegmenterSpans IColourSegmenter::partitionInPlace(std::vector<math::vec3>& points,
+                                                              const math::vec3 background,
+                                                              float approximateRadius,
+                                                              SegmenterScratch& scratch) const
+            {
+                //Partition into the scratch copy, then swap it in.
+                SegmenterSpans spans = partition(points, background, approximateRadius, scratch.points, scratch);
+                points.swap(scratch.points);
+                return spans;
+            }
+
+            void DistanceColourSegmenter::classify(const math::vec3* points, size_t count,
+                                                   const math::vec3 reference, float approximateRadius,
+                                                   unsigned char* isInner) const
             {
-                SegmenterResult out;
+                const float radiusSquared = approximateRadius*approximateRadius;
 
-                float radiusSquared = approximateRadius*approximateRadius;
+                size_t i = 0;
+#if defined(__SSE2__) && !defined(MATRIX_D_DOUBLE)
+                static_assert(sizeof(math::vec3) == 3*sizeof(float), "Points must be packed floats");
 
-                for(auto it = points.begin(); it!=points.end(); ++it)
+                const __m128 refX = _mm_set1_ps(reference.x);
+                const __m128 refY = _mm_set1_ps(reference.y);
+                const __m128 refZ = _mm_set1_ps(reference.z);
+                const __m128 radius = _mm_set1_ps(radiusSquared);
+
+                for(; i + 4 <= count; i += 4)
                 {
-                    if(reference.distanceSquared(*it) <= radiusSquared)
-                        out.inner.push_back(*it);
-                    else
-                        out.outer.push_back(*it);
+                    //Load four interleaved points and transpose them into x, y and z.
+                    const float* data = &points[i].x;
+                    const __m128 a = _mm_loadu_ps(data);     //x0 y0 z0 x1
+                    const __m128 b = _mm_loadu_ps(data + 4); //y1 z1 x2 y2
+                    const __m128 c = _mm_loadu_ps(data + 8); //z2 x3 y3 z3
+
+                    const __m128 x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,3,0));
+                    const __m128 y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)),
+                                                    _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+                    const __m128 z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)),
+                                                    _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+
+                    //Summed in the same order as distanceSquared, so the results match the scalar ones.
+                    const __m128 dx = _mm_sub_ps(x, refX);
+                    const __m128 dy = _mm_sub_ps(y, refY);
+                    const __m128 dz = _mm_sub_ps(z, refZ);
+                    const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+                    const int mask = _mm_movemask_ps(_mm_cmple_ps(distance, radius));
+                    isInner[i]   = mask & 1;
+                    isInner[i+1] = (mask >> 1) & 1;
+                    isInner[i+2] = (mask >> 2) & 1;
+                    isInner[i+3] = (mask >> 3) & 1;
                 }
-                return out;
+#endif
+                for(; i < count; ++i)
+                    isInner[i] = reference.distanceSquared(points[i]) <= radiusSquared;
             }
 
 
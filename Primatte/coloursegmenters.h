@@ -10,13 +10,18 @@ namespace anima
         namespace primatte
         {
             /** This class segments colours according to distance,
-              * cutting off the points that are too far away. */
+              * cutting off the points that are too far away.
+              * Four points are classified at a time with SSE when available. */
             class DistanceColourSegmenter : public IColourSegmenter
             {
             public:
-                virtual SegmenterResult segment(const std::vector<math::vec3>& points,
-                                                   const math::vec3 reference,
-                                                   float approximateRadius) const;
+                /** @param scheduler The scheduler to run on, or null to run serially. */
+                explicit DistanceColourSegmenter(tasks::TaskScheduler* scheduler = nullptr)
+                    : IColourSegmenter(scheduler) {}
+
+                virtual void classify(const math::vec3* points, size_t count,
+                                      const math::vec3 reference, float approximateRadius,
+                                      unsigned char* isInner) const;
             };
 
 //            class DistanceColourSegmenter : public IColourSegmenter
@@ -0,0 +1,327 @@
+#include "compositor.h"
+#include "inputassembler.h"
+#include "io.h"
+#include "taskscheduler.h"
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace anima
+{
+    namespace oa
+    {
+        namespace
+        {
+            /* The rows per task when running on a task scheduler. */
+            const size_t COMPOSITE_GRAIN_ROWS = 8;
+
+            /* Loads a 3-component row into normalised floats. */
+            void loadRow(const cv::Mat& mat, int row, float* out, float multiplier)
+            {
+                const int count = mat.cols*3;
+                const unsigned char* data = mat.data + mat.step*row;
+
+                switch(mat.depth())
+                {
+                case CV_8U:
+                {
+                    int i = 0;
+#ifdef __SSE2__
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128 mul = _mm_set1_ps(multiplier);
+                    for(; i + 16 <= count; i += 16)
+                    {
+                        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+                        __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+                        __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+                        _mm_storeu_ps(out + i,      _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), mul));
+                        _mm_storeu_ps(out + i + 4,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), mul));
+                        _mm_storeu_ps(out + i + 8,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), mul));
+                        _mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), mul));
+                    }
+#endif
+                    for(; i < count; ++i)
+                        out[i] = data[i]*multiplier;
+                }
+                    break;
+                case CV_16U:
+                {
+                    const unsigned short* data16 = (const unsigned short*)data;
+                    for(int i = 0; i < count; ++i)
+                        out[i] = data16[i]*multiplier;
+                }
+                    break;
+                case CV_32F:
+                    std::copy((const float*)data, (const float*)data + count, out);
+                    break;
+                default:
+                    throw std::runtime_error("Unknown format in compositor at line " + ToString(__LINE__));
+                }
+            }
+
+            /* The per-row parameters of the blend. */
+            struct BlendParameters
+            {
+                CompositorDescriptor::Operation operation;
+                bool cancelBackground;
+                float screen[3], over[3];
+                float epsilon;
+            };
+
+            /* The scalar reference blend for a single channel. */
+            inline float blendChannel(const BlendParameters& p, float source, float alpha,
+                                      float screen, float under)
+            {
+                float premultiplied = p.cancelBackground ? source - (1.f-alpha)*screen : source*alpha;
+
+                float result;
+                switch(p.operation)
+                {
+                case CompositorDescriptor::ECO_UNPREMULTIPLIED:
+                    result = alpha > p.epsilon ? premultiplied/alpha : 0.f;
+                    break;
+                case CompositorDescriptor::ECO_OVER_COLOUR:
+                case CompositorDescriptor::ECO_OVER_PLATE:
+                    result = premultiplied + (1.f-alpha)*under;
+                    break;
+                default:
+                    result = premultiplied;
+                }
+
+                return std::max(result, 0.f);
+            }
+
+            /* Blends a row of pixels. plate may be null unless the operation is ECO_OVER_PLATE. */
+            void blendRow(const BlendParameters& p, const float* source, const float* alpha,
+                          const float* plate, float* out, int cols)
+            {
+                int j = 0;
+
+#ifdef __SSE2__
+                //Four pixels are 12 floats, so three registers. The alpha and the colours
+                //are swizzled to line up with the interleaved channels.
+                const __m128 screen[3] = {_mm_setr_ps(p.screen[0], p.screen[1], p.screen[2], p.screen[0]),
+                                          _mm_setr_ps(p.screen[1], p.screen[2], p.screen[0], p.screen[1]),
+                                          _mm_setr_ps(p.screen[2], p.screen[0], p.screen[1], p.screen[2])};
+                const __m128 over[3] = {_mm_setr_ps(p.over[0], p.over[1], p.over[2], p.over[0]),
+                                        _mm_setr_ps(p.over[1], p.over[2], p.over[0], p.over[1]),
+                                        _mm_setr_ps(p.over[2], p.over[0], p.over[1], p.over[2])};
+                const __m128 one = _mm_set1_ps(1.f);
+                const __m128 zero = _mm_setzero_ps();
+                const __m128 epsilon = _mm_set1_ps(p.epsilon);
+
+                for(; j + 4 <= cols; j += 4)
+                {
+                    const __m128 a = _mm_loadu_ps(alpha + j);
+                    const __m128 alphas[3] = {_mm_shuffle_ps(a, a, _MM_SHUFFLE(1,0,0,0)),
+                                              _mm_shuffle_ps(a, a, _MM_SHUFFLE(2,2,1,1)),
+                                              _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,3,3,2))};
+
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        const int offset = j*3 + k*4;
+                        const __m128 s = _mm_loadu_ps(source + offset);
+                        const __m128 oneMinusAlpha = _mm_sub_ps(one, alphas[k]);
+
+                        __m128 r = p.cancelBackground ? _mm_sub_ps(s, _mm_mul_ps(oneMinusAlpha, screen[k]))
+                                                      : _mm_mul_ps(s, alphas[k]);
+
+                        switch(p.operation)
+                        {
+                        case CompositorDescriptor::ECO_UNPREMULTIPLIED:
+                            r = _mm_and_ps(_mm_cmpgt_ps(alphas[k], epsilon), _mm_div_ps(r, alphas[k]));
+                            break;
+                        case CompositorDescriptor::ECO_OVER_COLOUR:
+                            r = _mm_add_ps(r, _mm_mul_ps(oneMinusAlpha, over[k]));
+                            break;
+                        case CompositorDescriptor::ECO_OVER_PLATE:
+                            r = _mm_add_ps(r, _mm_mul_ps(oneMinusAlpha, _mm_loadu_ps(plate + offset)));
+                            break;
+                        default:
+                            break;
+                        }
+
+                        _mm_storeu_ps(out + offset, _mm_max_ps(r, zero));
+                    }
+                }
+#endif
+
+                for(; j < cols; ++j)
+                    for(int k = 0; k < 3; ++k)
+                        out[j*3+k] = blendChannel(p, source[j*3+k], alpha[j], p.screen[k],
+                                                  plate ? plate[j*3+k] : p.over[k]);
+            }
+
+            /* Writes the blended floats (and optionally the alpha) into an output row. */
+            void storeRow(const float* blended, const float* alpha, cv::Mat& out, int row)
+            {
+                const int cols = out.cols;
+                const int channels = out.channels();
+                unsigned char* data = out.data + out.step*row;
+
+                if(out.depth() == CV_32F)
+                {
+                    float* dataf = (float*)data;
+                    if(channels == 3)
+                        std::copy(blended, blended + cols*3, dataf);
+                    else
+                        for(int j = 0; j < cols; ++j)
+                        {
+                            dataf[j*4]   = blended[j*3];
+                            dataf[j*4+1] = blended[j*3+1];
+                            dataf[j*4+2] = blended[j*3+2];
+                            dataf[j*4+3] = alpha[j];
+                        }
+                    return;
+                }
+
+                //8-bit output
+                if(channels == 3)
+                {
+                    const int count = cols*3;
+                    int i = 0;
+#ifdef __SSE2__
+                    const __m128 mul = _mm_set1_ps(255.f);
+                    for(; i + 16 <= count; i += 16)
+                    {
+                        __m128i i0 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(blended + i), mul));
+                        __m128i i1 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(blended + i + 4), mul));
+                        __m128i i2 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(blended + i + 8), mul));
+                        __m128i i3 = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(blended + i + 12), mul));
+                        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(i0, i1), _mm_packs_epi32(i2, i3));
+                        _mm_storeu_si128((__m128i*)(data + i), packed);
+                    }
+#endif
+                    for(; i < count; ++i)
+                        data[i] = cv::saturate_cast<unsigned char>(blended[i]*255.f);
+                }
+                else
+                    for(int j = 0; j < cols; ++j)
+                    {
+                        data[j*4]   = cv::saturate_cast<unsigned char>(blended[j*3]*255.f);
+                        data[j*4+1] = cv::saturate_cast<unsigned char>(blended[j*3+1]*255.f);
+                        data[j*4+2] = cv::saturate_cast<unsigned char>(blended[j*3+2]*255.f);
+                        data[j*4+3] = cv::saturate_cast<unsigned char>(alpha[j]*255.f);
+                    }
+            }
+
+            /* Composites a range of rows. */
+            class CompositeBody : public cv::ParallelLoopBody
+            {
+                const BlendParameters& mParameters;
+                const cv::Mat& mSource;
+                const cv::Mat& mAlpha;
+                const cv::Mat* mPlate;
+                cv::Mat& mOut;
+
+            public:
+                CompositeBody(const BlendParameters& parameters, const cv::Mat& source,
+                              const cv::Mat& alpha, const cv::Mat* plate, cv::Mat& out)
+                    : mParameters(parameters), mSource(source), mAlpha(alpha), mPlate(plate), mOut(out) {}
+
+                virtual void operator()(const cv::Range& range) const
+                {
+                    const int cols = mSource.cols;
+                    const bool directOutput = mOut.type() == CV_32FC3;
+
+                    //Scratch rows, shared by every row in the range.
+                    std::vector<float> source(cols*3), plate(mPlate ? cols*3 : 0),
+                            blended(directOutput ? 0 : cols*3);
+
+                    const float sourceMultiplier = ia::InputAssembler::normalisationMultiplier(mSource.type());
+                    const float plateMultiplier = mPlate ? ia::InputAssembler::normalisationMultiplier(mPlate->type()) : 0.f;
+
+                    for(int r = range.start; r < range.end; ++r)
+                    {
+                        const float* alpha = (const float*)(mAlpha.data + mAlpha.step*r);
+
+                        loadRow(mSource, r, source.data(), sourceMultiplier);
+                        if(mPlate)
+                            loadRow(*mPlate, r, plate.data(), plateMultiplier);
+
+                        //If the output is already 3-component float, blend straight into it.
+                        float* out = directOutput ? (float*)(mOut.data + mOut.step*r) : blended.data();
+
+                        blendRow(mParameters, source.data(), alpha,
+                                 mPlate ? plate.data() : nullptr, out, cols);
+
+                        if(!directOutput)
+                            storeRow(out, alpha, mOut, r);
+                    }
+                }
+            };
+        }
+
+        Compositor::Compositor(const CompositorDescriptor& desc)
+        {
+            if(desc.operation == CompositorDescriptor::ECO_OVER_PLATE)
+            {
+                if(desc.plate == nullptr)
+                    throw std::runtime_error("Null plate for over-plate compositing");
+
+                //Validates the plate format
+                ia::InputAssembler::normalisationMultiplier(desc.plate->type());
+            }
+
+            if(desc.unpremultiplyEpsilon < 0)
+                throw std::runtime_error("Negative unpremultiply epsilon");
+
+            mDesc = desc;
+        }
+
+        void Compositor::composite(const cv::Mat& source, const cv::Mat& alpha, cv::Mat& out) const
+        {
+            START_TIMER(Compositing);
+
+            //Validates the source format
+            ia::InputAssembler::normalisationMultiplier(source.type());
+
+            if(alpha.type() != CV_32FC1 || alpha.size() != source.size())
+                throw std::runtime_error("Alpha must be a CV_32FC1 mat of the source size");
+
+            const cv::Mat* plate = nullptr;
+            if(mDesc.operation == CompositorDescriptor::ECO_OVER_PLATE)
+            {
+                plate = mDesc.plate;
+                if(plate->size() != source.size())
+                    throw std::runtime_error("The plate must be the same size as the source");
+            }
+
+            if(out.empty())
+                out.create(source.rows, source.cols, CV_32FC3);
+            else if(out.size() != source.size())
+                throw std::runtime_error("Compositor output is not the size of the source");
+            else if(out.type() != CV_8UC3 && out.type() != CV_32FC3 &&
+                    out.type() != CV_8UC4 && out.type() != CV_32FC4)
+                throw std::runtime_error("Unsupported compositor output format");
+
+            BlendParameters parameters;
+            parameters.operation = mDesc.operation;
+            parameters.cancelBackground = mDesc.cancelBackground;
+            parameters.epsilon = mDesc.unpremultiplyEpsilon;
+            parameters.screen[0] = mDesc.screenColour.x;
+            parameters.screen[1] = mDesc.screenColour.y;
+            parameters.screen[2] = mDesc.screenColour.z;
+            parameters.over[0] = mDesc.overColour.x;
+            parameters.over[1] = mDesc.overColour.y;
+            parameters.over[2] = mDesc.overColour.z;
+
+            CompositeBody body(parameters, source, alpha, plate, out);
+            if(mDesc.scheduler)
+            {
+                mDesc.scheduler->parallelFor(0, source.rows, COMPOSITE_GRAIN_ROWS, [&body](size_t begin, size_t end)
+                {
+                    body(cv::Range(begin, end));
+                });
+            }
+            else
+                cv::parallel_for_(cv::Range(0, source.rows), body);
+
+            END_TIMER(Compositing);
+        }
+    }
+}
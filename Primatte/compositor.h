@@ -0,0 +1,90 @@
+#pragma once
+#include <opencv2/core/core.hpp>
+#include "matrixd.h"
+
+/**
+  * The output stage: given a source image and an alpha from IAlgorithm::computeAlphas(),
+  * this class cancels out the screen colour and produces the final pixels, writing them
+  * into a caller supplied buffer in one pass.
+  * Rows are processed in parallel, and the blending itself uses SSE when available.
+  */
+
+namespace anima
+{
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
+    namespace oa
+    {
+        /** The descriptor used to create the compositor. */
+        struct CompositorDescriptor
+        {
+            enum Operation
+            {
+                /* Outputs the foreground multiplied by alpha. */
+                ECO_PREMULTIPLIED,
+
+                /* Outputs the foreground divided back by alpha (straight colour). */
+                ECO_UNPREMULTIPLIED,
+
+                /* Composites the foreground over overColour. */
+                ECO_OVER_COLOUR,
+
+                /* Composites the foreground over the plate image. */
+                ECO_OVER_PLATE
+            };
+
+            /** The operation to perform. */
+            Operation operation;
+
+            /** If true, the screen colour is removed from semi-transparent pixels,
+                such that source = foreground*alpha + screenColour*(1-alpha).
+                Otherwise the source is treated as the unpremultiplied foreground. */
+            bool cancelBackground;
+
+            /** The normalised screen colour in the channel order of the source image.
+                Note that InputAssembler::background() is only in this space for ETCS_RGB. */
+            math::vec3 screenColour;
+
+            /** The normalised colour used by ECO_OVER_COLOUR, in the source channel order. */
+            math::vec3 overColour;
+
+            /** The image used by ECO_OVER_PLATE. Must be the same size as the source.
+                8-bit, 16-bit and floating point 3-component formats are supported. */
+            const cv::Mat* plate;
+
+            /** Below this alpha, ECO_UNPREMULTIPLIED outputs black instead of dividing. */
+            float unpremultiplyEpsilon;
+
+            /** The scheduler to run the rows on. If null, cv::parallel_for_ is used. */
+            tasks::TaskScheduler* scheduler;
+
+            CompositorDescriptor()
+                : operation(ECO_PREMULTIPLIED), cancelBackground(true),
+                  screenColour(0.f), overColour(0.f), plate(nullptr),
+                  unpremultiplyEpsilon(1.f/1024.f), scheduler(nullptr) {}
+        };
+
+        /** The compositor class. */
+        class Compositor
+        {
+            CompositorDescriptor mDesc;
+
+        public:
+
+            /** Initialises the compositor, throwing an exception upon failure
+             * (most commonly std::runtime_error) */
+            Compositor(const CompositorDescriptor& desc);
+
+            /** Composites the source into out.
+              * @param source The original image. CV_8UC3, CV_16UC3 and CV_32FC3 supported.
+              * @param alpha The CV_32FC1 alpha of the same size, such as from computeAlphas().
+              * @param out The destination. If empty, it is allocated as CV_32FC3. Otherwise it
+              *            must be the same size and either CV_8UC3, CV_32FC3, CV_8UC4 or CV_32FC4,
+              *            where the fourth channel receives the alpha. */
+            void composite(const cv::Mat& source, const cv::Mat& alpha, cv::Mat& out) const;
+        };
+    }
+}
@@ -1,6 +1,10 @@
 #include "fittingalgorithms.h"
 #include "io.h"
 #include "icoloursegmenter.h"
+#include "taskscheduler.h"
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
 
 namespace anima
 {
@@ -8,40 +12,138 @@ namespace anima
     {
         namespace primatte
         {
-            unsigned StableFitting::countPointsInside(const std::vector<math::vec3>& points, BoundingPolyhedron& poly)
+            //The least points counted per task.
+            static const size_t COUNT_GRAIN = 2048;
+
+            //The number of recently violating points tested first, serially, by a violation query.
+            static const size_t VIOLATION_CACHE_SIZE = 64;
+
+            StableFitting::StableFitting(int numberOfIterations, tasks::TaskScheduler* scheduler)
+                : IFittingAlgorithm(scheduler)
+            {
+                StableFittingDescriptor desc = {numberOfIterations, 0, 1, 1, false, 0, 0};
+                mDesc = desc;
+            }
+
+            StableFitting::StableFitting(StableFittingDescriptor desc, tasks::TaskScheduler* scheduler)
+                : IFittingAlgorithm(scheduler)
+            {
+                validate(desc);
+
+                mDesc = desc;
+            }
+
+            void StableFitting::validate(const StableFittingDescriptor& desc)
+            {
+                if(desc.iterations <= 0)
+                    throw std::runtime_error("Stable fitting needs at least one iteration");
+
+                if(desc.decimation == 0)
+                    throw std::runtime_error("Stable fitting decimation must be positive");
+
+                if(desc.coarseLevels > 0 && desc.refinementIterations <= 0)
+                    throw std::runtime_error("Stable fitting needs at least one refinement iteration");
+
+                if(!(desc.tolerance >= 0))
+                    throw std::runtime_error("Negative stable fitting tolerance");
+            }
+
+            void StableFitting::resolveRays(PointSpan points, size_t stride, const BoundingPolyhedron& poly, FittingWorkspace& workspace) const
             {
-                int pointsInside = 0;
-                for(auto itPoint = points.begin(); itPoint != points.end(); ++itPoint)
+                const size_t count = (points.size() + stride - 1)/stride;
+
+                //Only allocates if the points outgrew the storage.
+                workspace.rays.resize(count);
+                workspace.rayLengths.resize(count);
+
+                tasks::parallelFor(mScheduler, 0, count, COUNT_GRAIN, [&](size_t begin, size_t end)
                 {
-                    //If intersects
-                    math::vec3 vector = *itPoint - poly.centre();
-                    float vectorLen = vector.length();
-                    math::vec3 vectorNorm = vector/vectorLen;
+                    for(size_t i = begin; i < end; ++i)
+                    {
+                        math::vec3 vector = points[i*stride] - poly.centre();
+                        float vectorLen = vector.length();
+                        math::vec3 vectorNorm = vector/vectorLen;
 
-                    if(poly.findDistanceToPolyhedron(vectorNorm) >= vectorLen)
-                        ++pointsInside;
-                }
-                return pointsInside;
+                        workspace.rays[i] = poly.resolveRay(vectorNorm);
+                        workspace.rayLengths[i] = vectorLen;
+                    }
+                });
             }
 
-            void StableFitting::shrink(BoundingPolyhedron& poly,
-                                      const std::vector<math::vec3>& points,
-                                      math::vec3 backgroundPoint,
-                                      float minimumDistance) const
+            void StableFitting::guardRays(FittingWorkspace& workspace, const BoundingPolyhedron& poly, bool inside) const
             {
-                START_TIMER(Shrinking);
+                //Only allocates if the points outgrew the storage.
+                std::vector<unsigned>& guarded = workspace.guardedRays;
+                guarded.clear();
+                for(size_t i = 0; i < workspace.rays.size(); ++i)
+                    if((poly.findDistance(workspace.rays[i]) >= workspace.rayLengths[i]) == inside)
+                        guarded.push_back(i);
+            }
 
-                poly.positionAround(backgroundPoint, points);
+            bool StableFitting::findViolation(FittingWorkspace& workspace, const BoundingPolyhedron& poly, bool inside) const
+            {
+                std::vector<unsigned>& guarded = workspace.guardedRays;
+                const SpherePolyhedron::RayContext* rays = workspace.rays.data();
+                const float* rayLengths = workspace.rayLengths.data();
+                auto violates = [&](unsigned ray)
+                {
+                    return (poly.findDistance(rays[ray]) >= rayLengths[ray]) != inside;
+                };
+
+                //The points that stopped the last moves come first, as they are the likeliest to stop this one.
+                size_t found = guarded.size();
+                const size_t cached = std::min(guarded.size(), VIOLATION_CACHE_SIZE);
+                for(size_t i = 0; i < cached && found == guarded.size(); ++i)
+                    if(violates(guarded[i]))
+                        found = i;
+
+                //The rest in parallel ranges, which all stop once any finds a violation.
+                if(found == guarded.size())
+                {
+                    std::atomic<size_t> first(guarded.size());
+                    tasks::parallelFor(mScheduler, cached, guarded.size(), COUNT_GRAIN, [&](size_t begin, size_t end)
+                    {
+                        for(size_t i = begin; i < end && first.load(std::memory_order_relaxed) == guarded.size(); ++i)
+                            if(violates(guarded[i]))
+                            {
+                                size_t expected = guarded.size();
+                                first.compare_exchange_strong(expected, i);
+                                return;
+                            }
+                    });
+                    found = first;
+                }
 
-                float step = poly.radius()/2.f;
+                if(found == guarded.size())
+                    return false;
+
+                //Move to front.
+                std::rotate(guarded.begin(), guarded.begin() + found, guarded.begin() + found + 1);
+                return true;
+            }
+
+            std::chrono::steady_clock::time_point StableFitting::findDeadline() const
+            {
+                if(mDesc.timeBudgetMs == 0)
+                    return std::chrono::steady_clock::time_point::max();
 
+                return std::chrono::steady_clock::now() + std::chrono::milliseconds(mDesc.timeBudgetMs);
+            }
+
+            float StableFitting::shrinkResolved(BoundingPolyhedron& poly, FittingWorkspace& workspace,
+                                                float step, int iterations, float minimumDistance,
+                                                std::chrono::steady_clock::time_point deadline) const
+            {
                 float minDistanceSquared = minimumDistance*minimumDistance;
 
-                int originalPointsInside = countPointsInside(points, poly);
+                //The points inside must stay so.
+                guardRays(workspace, poly, true);
 
-                for(int iIteration = 0; iIteration < mNoOfIterations; ++iIteration)
+                float lastStep = step;
+                for(int iIteration = 0; iIteration < iterations && step >= mDesc.tolerance; ++iIteration)
                 {
                     float stepSquared = step*step;
+                    bool moved = false;
 
                     for(auto vertex = poly.mVertices.rbegin(); vertex!=poly.mVertices.rend(); ++vertex)
                     {
@@ -50,57 +152,187 @@ namespace anima
                         if(distanceCentreToVertex < minDistanceSquared || distanceCentreToVertex < stepSquared)
                             continue;
 
+                        //Every move is either kept or undone, so the shell is valid whenever time runs out.
+                        if(std::chrono::steady_clock::now() >= deadline)
+                        {
+                            workspace.outOfTime = true;
+                            return lastStep;
+                        }
+
                         math::vec3 moveNormal = (poly.centre() - *vertex).normalize();
                         const math::vec3 vec = moveNormal*step;
 
                         //Move
                         *vertex += vec;
 
-                        int newPointsInside = countPointsInside(points, poly);
-
                         //Move back if movement violates rule
-                        if(newPointsInside<originalPointsInside)
+                        if(findViolation(workspace, poly, true))
                             *vertex -= vec;
+                        else
+                            moved = true;
                     }
 
+                    ++workspace.sweeps;
+                    lastStep = step;
                     step *= 0.5f;
+
+                    if(!moved && mDesc.stopWhenSettled)
+                        break;
+                }
+
+                return lastStep;
+            }
+
+            void StableFitting::encloseResolved(BoundingPolyhedron& poly, const FittingWorkspace& workspace) const
+            {
+                //Scaling the vertices of a face scales the distances through it alike, and moving
+                //vertices outwards never leaves a point outside, so a single pass is enough.
+                for(size_t i = 0; i < workspace.rays.size(); ++i)
+                {
+                    const SpherePolyhedron::RayContext& ray = workspace.rays[i];
+                    const float distance = poly.findDistance(ray);
+                    if(distance >= workspace.rayLengths[i])
+                        continue;
+
+                    //With a margin for the rounding of the intersections.
+                    const float scale = workspace.rayLengths[i]/distance*1.0001f;
+                    const unsigned faceVertices[3] = {ray.face.v1, ray.face.v2, ray.face.v3};
+                    for(int v = 0; v < 3; ++v)
+                    {
+                        math::vec3& vertex = poly.mVertices[faceVertices[v]];
+                        vertex = (vertex - poly.centre())*scale + poly.centre();
+                    }
+                }
+                poly.clearPlanes();
+            }
+
+            void StableFitting::upsample(const BoundingPolyhedron& from, BoundingPolyhedron& to)
+            {
+                for(auto vertex = to.mVertices.begin(); vertex!=to.mVertices.end(); ++vertex)
+                {
+                    const math::vec3 direction = (*vertex - to.centre()).normalize();
+                    *vertex = to.centre() + direction*from.findDistanceToPolyhedron(direction);
                 }
+                to.clearPlanes();
+            }
+
+            void StableFitting::shrink(BoundingPolyhedron& poly,
+                                      PointSpan points,
+                                      math::vec3 backgroundPoint,
+                                      float minimumDistance,
+                                      FittingWorkspace& workspace) const
+            {
+                START_TIMER(Shrinking);
+
+                const auto deadline = findDeadline();
+                workspace.sweeps = 0;
+                workspace.outOfTime = false;
+
+                poly.positionAround(backgroundPoint, points);
+
+                float step = poly.radius()/2.f;
+                int iterations = mDesc.iterations;
+
+                //Coarse-to-fine: the coarsest level is shrunk from the bounding sphere against the fewest
+                //points, and each finer level is placed on the previous one and only refined, against
+                //more points. Most vertices are then already in place when all the points are tested.
+                const BoundingPolyhedron* previous = nullptr;
+                BoundingPolyhedronDescriptor levelDesc = poly.descriptor();
+                size_t stride = 1;
+                for(unsigned level = 0; level < mDesc.coarseLevels; ++level)
+                    stride *= mDesc.decimation;
+
+                for(unsigned level = mDesc.coarseLevels; level > 0; --level)
+                {
+                    BoundingPolyhedron& levelPoly = level%2 ? workspace.poly : workspace.coarsePoly;
+                    levelDesc.phiFaces = std::max(4, poly.descriptor().phiFaces >> level);
+                    levelDesc.thetaFaces = std::max(3, poly.descriptor().thetaFaces >> level);
+                    levelPoly.reset(levelDesc);
+                    levelPoly.positionAround(backgroundPoint, points);
+
+                    //The centre stays put, so the points are only resolved once per level.
+                    resolveRays(points, stride, levelPoly, workspace);
+                    if(previous)
+                    {
+                        upsample(*previous, levelPoly);
+                        encloseResolved(levelPoly, workspace);
+                    }
+
+                    step = shrinkResolved(levelPoly, workspace, step, iterations, minimumDistance, deadline);
+                    iterations = mDesc.refinementIterations;
+                    stride /= mDesc.decimation;
+                    previous = &levelPoly;
+                }
+
+                //The centre stays put, so the points are only resolved once.
+                resolveRays(points, 1, poly, workspace);
+                if(previous)
+                {
+                    upsample(*previous, poly);
+                    encloseResolved(poly, workspace);
+                }
+
+                shrinkResolved(poly, workspace, step, iterations, minimumDistance, deadline);
 
                 END_TIMER(Shrinking);
             }
 
             void StableFitting::expand(BoundingPolyhedron& poly,
-                                      const std::vector<math::vec3>& points, IColourSegmenter* segmenter,
+                                      PointSpan points, IColourSegmenter* segmenter,
                                       math::vec3 backgroundPoint, float startRadius, float endRadius) const
             {
+                std::vector<math::vec3> partitioned;
+                SegmenterScratch scratch;
+                SegmenterSpans innerouter = segmenter->partition(points, backgroundPoint, startRadius, partitioned, scratch);
+
+                //Position the polygon around the inner points.
+                poly.positionAround(backgroundPoint, innerouter.inner);
+
+                FittingWorkspace workspace;
+                expandPositioned(poly, innerouter.outer, startRadius, endRadius, workspace);
+            }
 
+            void StableFitting::expandPositioned(BoundingPolyhedron& poly, PointSpan outerPoints,
+                                                 float startRadius, float endRadius, FittingWorkspace& workspace) const
+            {
                 START_TIMER(Expanding);
 
-                auto innerouter = segmenter->segment(points, backgroundPoint, startRadius);
+                const auto deadline = findDeadline();
+                workspace.sweeps = 0;
+                workspace.outOfTime = false;
 
                 //Indicates whether a vertex was unable to move at least once due to outer points.
-                std::vector<bool> didVertexEncounterResistance;
-                didVertexEncounterResistance.resize(poly.mVertices.size(), false);
-
-                //Position the polygon around the inner points.
-                poly.positionAround(backgroundPoint, innerouter.inner);
+                std::vector<unsigned char>& didVertexEncounterResistance = workspace.vertexFlags;
+                didVertexEncounterResistance.assign(poly.mVertices.size(), false);
 
                 //Make a copy that is to be scaled.
                 //We need a copy to deal with the case where no resistance is met.
-                BoundingPolyhedron newPoly = poly;
+                BoundingPolyhedron& newPoly = workspace.poly;
+                newPoly = poly;
 
                 //The starting step is set to be half way between the start and end distance.
                 float step = (endRadius-startRadius)/2.f;
 
-                //Count number of points outside for later reference.
-                int originalPointsOutside = innerouter.outer.size()-countPointsInside(innerouter.outer, newPoly);
+                //The centre stays put, so the points are only resolved once.
+                resolveRays(outerPoints, 1, newPoly, workspace);
+
+                //The points outside must stay so.
+                guardRays(workspace, newPoly, false);
 
                 //Iterate...
-                for(int iIteration = 0; iIteration < mNoOfIterations; ++iIteration)
+                for(int iIteration = 0; iIteration < mDesc.iterations && step >= mDesc.tolerance; ++iIteration)
                 {
+                    bool moved = false;
+
                     //Try moving each vertex outwards
                     for(size_t iVertex = 0; iVertex < newPoly.mVertices.size(); ++iVertex)
                     {
+                        if(std::chrono::steady_clock::now() >= deadline)
+                        {
+                            workspace.outOfTime = true;
+                            break;
+                        }
+
                         //Find movement vector
                         math::vec3 moveNormal = (newPoly.mVertices[iVertex]-newPoly.centre()).normalize();
                         const math::vec3 vec = moveNormal*step;
@@ -108,19 +340,34 @@ namespace anima
                         //Move
                         newPoly.mVertices[iVertex] += vec;
 
-                        //Find the number of points now outside after movement.
-                        int newPointsOutside = innerouter.outer.size()-countPointsInside(innerouter.outer, newPoly);
-
-                        //If there are now less points outside, we have gone through something. Move back and mark resistance.
-                        if(newPointsOutside < originalPointsOutside)
+                        //If a point is no longer outside, we have gone through something. Move back and mark resistance.
+                        if(findViolation(workspace, newPoly, false))
                         {
                             newPoly.mVertices[iVertex] -= vec;
                             didVertexEncounterResistance[iVertex] = true;
                         }
+                        else
+                            moved = true;
                     }
 
+                    if(workspace.outOfTime)
+                        break;
+
                     //halve the step and try again.
+                    ++workspace.sweeps;
                     step *= 0.5f;
+
+                    if(!moved && mDesc.stopWhenSettled)
+                        break;
+                }
+
+                //Out of time, some vertices may not have been tried at the last step, so moving them
+                //any further could pass through outer points. Only the moves tested so far are kept.
+                if(workspace.outOfTime)
+                {
+                    poly.mVertices = newPoly.mVertices;
+                    END_TIMER(Expanding);
+                    return;
                 }
 
                 //The idea here is that if a vertex did not encounter any resistance while moving,
@@ -145,6 +392,199 @@ namespace anima
 
                 END_TIMER(Expanding);
             }
+
+            QuantileFitting::QuantileFitting(QuantileFittingDescriptor desc, tasks::TaskScheduler* scheduler)
+                : IFittingAlgorithm(scheduler)
+            {
+                validate(desc);
+
+                mDesc = desc;
+            }
+
+            void QuantileFitting::validate(const QuantileFittingDescriptor& desc)
+            {
+                if(!(desc.outlierFraction >= 0 && desc.outlierFraction < 1))
+                    throw std::runtime_error("Quantile fitting outlier fraction out of range");
+
+                if(desc.buckets < 2)
+                    throw std::runtime_error("Quantile fitting needs at least two buckets");
+            }
+
+            unsigned QuantileFitting::allowedOutliers(unsigned points) const
+            {
+                return std::max(mDesc.outlierCount, unsigned(mDesc.outlierFraction*points));
+            }
+
+            void QuantileFitting::shrink(BoundingPolyhedron& poly,
+                                         PointSpan points,
+                                         math::vec3 backgroundPoint,
+                                         float minimumDistance,
+                                         FittingWorkspace& workspace) const
+            {
+                START_TIMER(QuantileShrinking);
+
+                poly.positionAround(backgroundPoint, points);
+
+                const unsigned buckets = mDesc.buckets;
+                const size_t vertexCount = poly.mVertices.size();
+                const float radius = poly.radius();
+                const float bucketsPerDistance = buckets/radius;
+
+                //The histograms, and the furthest distance needed by each vertex.
+                std::vector<unsigned>& histograms = workspace.vertexBuckets;
+                std::vector<float>& furthest = workspace.vertexDistances;
+                histograms.assign(vertexCount*buckets, 0);
+                furthest.assign(vertexCount, 0.f);
+
+                for(size_t i = 0; i < points.size(); ++i)
+                {
+                    const math::vec3 vector = points[i] - poly.centre();
+                    const float vectorLen = vector.length();
+                    if(vectorLen == 0)
+                        continue;
+
+                    //All the vertices are at the radius, so the point is inside if those of its face are
+                    //at least as much further as the point is further than the face.
+                    //With a margin for the rounding of the intersections.
+                    const SpherePolyhedron::RayContext ray = poly.resolveRay(vector/vectorLen);
+                    const float needed = vectorLen*radius/poly.findDistance(ray)*1.0001f;
+                    const unsigned bucket = std::min(unsigned(needed*bucketsPerDistance), buckets-1);
+
+                    const unsigned faceVertices[3] = {ray.face.v1, ray.face.v2, ray.face.v3};
+                    for(int v = 0; v < 3; ++v)
+                    {
+                        ++histograms[faceVertices[v]*buckets + bucket];
+                        furthest[faceVertices[v]] = std::max(furthest[faceVertices[v]], needed);
+                    }
+                }
+
+                for(size_t iVertex = 0; iVertex < vertexCount; ++iVertex)
+                {
+                    const unsigned* histogram = &histograms[iVertex*buckets];
+
+                    unsigned vertexPoints = 0;
+                    for(unsigned b = 0; b < buckets; ++b)
+                        vertexPoints += histogram[b];
+                    const unsigned allowed = allowedOutliers(vertexPoints);
+
+                    //Walk down from the furthest points, leaving out the allowed number.
+                    float distance = 0.f;
+                    unsigned outside = 0;
+                    for(unsigned b = buckets; b-- > 0;)
+                    {
+                        if(outside + histogram[b] > allowed)
+                        {
+                            //The last bucket also holds the points beyond the radius.
+                            distance = b == buckets-1 ? furthest[iVertex] :
+                                                        std::min((b+1)/bucketsPerDistance, furthest[iVertex]);
+                            break;
+                        }
+                        outside += histogram[b];
+                    }
+
+                    distance = std::max(distance, minimumDistance);
+                    math::vec3& vertex = poly.mVertices[iVertex];
+                    vertex = poly.centre() + (vertex - poly.centre()).normalize()*distance;
+                }
+                poly.clearPlanes();
+
+                END_TIMER(QuantileShrinking);
+            }
+
+            void QuantileFitting::expand(BoundingPolyhedron& poly,
+                                         PointSpan points, IColourSegmenter* segmenter,
+                                         math::vec3 backgroundPoint, float startRadius, float endRadius) const
+            {
+                std::vector<math::vec3> partitioned;
+                SegmenterScratch scratch;
+                SegmenterSpans innerouter = segmenter->partition(points, backgroundPoint, startRadius, partitioned, scratch);
+
+                //Position the polygon around the inner points.
+                poly.positionAround(backgroundPoint, innerouter.inner);
+
+                FittingWorkspace workspace;
+                expandPositioned(poly, innerouter.outer, startRadius, endRadius, workspace);
+            }
+
+            void QuantileFitting::expandPositioned(BoundingPolyhedron& poly, PointSpan outerPoints,
+                                                   float startRadius, float endRadius, FittingWorkspace& workspace) const
+            {
+                START_TIMER(QuantileExpanding);
+
+                const unsigned buckets = mDesc.buckets;
+                const size_t vertexCount = poly.mVertices.size();
+                const float movement = endRadius - startRadius;
+                const float range = poly.findLargestRadius() + movement;
+                const float bucketsPerDistance = buckets/range;
+
+                //The histograms, and the nearest obstacle of each vertex.
+                std::vector<unsigned>& histograms = workspace.vertexBuckets;
+                std::vector<float>& nearest = workspace.vertexDistances;
+                histograms.assign(vertexCount*buckets, 0);
+                nearest.assign(vertexCount, range);
+
+                for(size_t i = 0; i < outerPoints.size(); ++i)
+                {
+                    const math::vec3 vector = outerPoints[i] - poly.centre();
+                    const float vectorLen = vector.length();
+                    if(vectorLen == 0)
+                        continue;
+
+                    //Only the points outside are in the way.
+                    const SpherePolyhedron::RayContext ray = poly.resolveRay(vector/vectorLen);
+                    if(poly.findDistance(ray) >= vectorLen)
+                        continue;
+
+                    //A face is no further than its furthest vertex, so the point stays outside
+                    //as long as the vertices of its face are nearer than it. If one already is
+                    //further, the others must stay put instead.
+                    const unsigned faceVertices[3] = {ray.face.v1, ray.face.v2, ray.face.v3};
+                    float current[3];
+                    for(int v = 0; v < 3; ++v)
+                        current[v] = poly.mVertices[faceVertices[v]].distance(poly.centre());
+                    const bool blocked = std::max(current[0], std::max(current[1], current[2])) >= vectorLen;
+
+                    for(int v = 0; v < 3; ++v)
+                    {
+                        const float obstacle = blocked ? current[v] : vectorLen*0.9999f;
+                        const unsigned bucket = std::min(unsigned(obstacle*bucketsPerDistance), buckets-1);
+                        ++histograms[faceVertices[v]*buckets + bucket];
+                        nearest[faceVertices[v]] = std::min(nearest[faceVertices[v]], obstacle);
+                    }
+                }
+
+                for(size_t iVertex = 0; iVertex < vertexCount; ++iVertex)
+                {
+                    const unsigned* histogram = &histograms[iVertex*buckets];
+                    math::vec3& vertex = poly.mVertices[iVertex];
+                    const float current = vertex.distance(poly.centre());
+
+                    unsigned vertexPoints = 0;
+                    for(unsigned b = 0; b < buckets; ++b)
+                        vertexPoints += histogram[b];
+                    const unsigned allowed = allowedOutliers(vertexPoints);
+
+                    //Walk up from the nearest points, passing through the allowed number.
+                    //Without resistance the vertex moves all the way.
+                    float distance = current + movement;
+                    unsigned passed = 0;
+                    for(unsigned b = 0; b < buckets; ++b)
+                    {
+                        if(passed + histogram[b] > allowed)
+                        {
+                            distance = std::max(b/bucketsPerDistance, nearest[iVertex]);
+                            break;
+                        }
+                        passed += histogram[b];
+                    }
+
+                    distance = std::min(std::max(distance, current), current + movement);
+                    vertex = poly.centre() + (vertex - poly.centre()).normalize()*distance;
+                }
+                poly.clearPlanes();
+
+                END_TIMER(QuantileExpanding);
+            }
         }
     }
 }
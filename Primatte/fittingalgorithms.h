@@ -1,5 +1,6 @@
 #pragma once
 #include "ifittingalgorithm.h"
+#include <chrono>
 
 /*
   * Various polyhedron fitting algorithms implementing the IFittingAlgorithm interface.
@@ -10,32 +11,148 @@ namespace anima
     {
         namespace primatte
         {
+            /** The descriptor of StableFitting. */
+            struct StableFittingDescriptor
+            {
+                /* The number of times the step is halved, at the coarsest level when fitting
+                 * coarse-to-fine. Must be > 0. */
+                int iterations;
+
+                /* The number of coarser levels to shrink before the resolution of the polyhedron.
+                 * Each level halves the resolution of the next (down to 4x3 faces) and keeps one in
+                 * decimation of its points. 0 shrinks the polyhedron directly. */
+                unsigned coarseLevels;
+
+                /* Each coarser level keeps one in this many of the points of the next. Must be > 0. */
+                unsigned decimation;
+
+                /* The number of times the step is halved at each finer level, starting from the
+                 * last step of the coarser level. Must be > 0 if there are coarse levels. */
+                int refinementIterations;
+
+                /* If true, the halving stops after a sweep in which no vertex moved. */
+                bool stopWhenSettled;
+
+                /* The halving stops once the step, the distance a vertex moves, falls under this.
+                 * 0 disables it. Must not be negative. */
+                float tolerance;
+
+                /* The most milliseconds a fit may take, after which the vertices stop moving and
+                 * the shell fitted so far is kept. When expanding, the vertices that met no outer
+                 * points are then left where they are rather than moved by the furthest expansion.
+                 * It is checked between vertex moves, so it can be exceeded by one move and by the
+                 * fixed costs of the fit. 0 disables it. */
+                unsigned timeBudgetMs;
+            };
+
             /** Use exact fitting by trying to move points inside/outside while possible.
                 Points are guaranteed to not go through the polyhedron.
-                An alternative to try out might be to allow for a certain number of points to be ignored,
-                reducing outlier effect. */
+                QuantileFitting allows for a certain number of points to be ignored, reducing outlier effect. */
             class StableFitting : public IFittingAlgorithm
             {
-                //Number of iterations to perform.
-                int mNoOfIterations;
+                StableFittingDescriptor mDesc;
 
-                /** Counts the number of points from the points vector that are inside the bounding polyhedron. */
-                static unsigned countPointsInside(const std::vector<math::vec3>& points, BoundingPolyhedron& poly);
+                /** Resolves one in stride of the points into the rays of the workspace, from the centre
+                    of the polyhedron. With a scheduler the points are resolved in parallel ranges. */
+                void resolveRays(PointSpan points, size_t stride, const BoundingPolyhedron& poly, FittingWorkspace& workspace) const;
+
+                /** Collects the resolved points that are inside (or outside) the bounding polyhedron,
+                    which a fit must keep so. */
+                void guardRays(FittingWorkspace& workspace, const BoundingPolyhedron& poly, bool inside) const;
+
+                /** Returns whether any guarded point is no longer inside (or outside) the bounding polyhedron,
+                    stopping at the first one found. The points that were found are moved to the front,
+                    so that they are tested first next time. The rest are tested in parallel ranges
+                    with a scheduler. */
+                bool findViolation(FittingWorkspace& workspace, const BoundingPolyhedron& poly, bool inside) const;
+
+                /** Returns when a fit starting now must stop, as given by the time budget. */
+                std::chrono::steady_clock::time_point findDeadline() const;
+
+                /** Shrinks the polyhedron around the resolved points, starting from the given step,
+                    until the iterations run out, it settles, or the deadline passes.
+                    Returns the last step taken. */
+                float shrinkResolved(BoundingPolyhedron& poly, FittingWorkspace& workspace,
+                                     float step, int iterations, float minimumDistance,
+                                     std::chrono::steady_clock::time_point deadline) const;
+
+                /** Moves the vertices of the faces with resolved points outside outwards until every point is inside. */
+                void encloseResolved(BoundingPolyhedron& poly, const FittingWorkspace& workspace) const;
+
+                /** Places the vertices of a polyhedron, positioned at the same centre, on a coarser one. */
+                static void upsample(const BoundingPolyhedron& from, BoundingPolyhedron& to);
 
             public:
 
-                StableFitting(int numberOfIterations) : mNoOfIterations(numberOfIterations){}
+                /** Fits directly at the resolution of the polyhedron. */
+                StableFitting(int numberOfIterations, tasks::TaskScheduler* scheduler = nullptr);
+
+                /** Initialises the class, throwing an exception upon failure
+                 * (most commonly std::runtime_error)
+                 * @param scheduler The scheduler to run on, or null to run serially. */
+                StableFitting(StableFittingDescriptor desc, tasks::TaskScheduler* scheduler = nullptr);
+
+                /** Throws std::runtime_error if the descriptor is invalid. */
+                static void validate(const StableFittingDescriptor& desc);
+
+                virtual void shrink(BoundingPolyhedron& poly, PointSpan points, math::vec3 backgroundPoint,  float minimumDistance, FittingWorkspace& workspace) const;
+                virtual void expand(BoundingPolyhedron& poly, PointSpan points, IColourSegmenter* segmenter, math::vec3 backgroundPoint, float startingRadius, float maximumRadius) const;
+                virtual void expandPositioned(BoundingPolyhedron& poly, PointSpan outerPoints, float startingRadius, float maximumRadius, FittingWorkspace& workspace) const;
+            }; //End of class
+
+            /** The descriptor of QuantileFitting. */
+            struct QuantileFittingDescriptor
+            {
+                /* The fraction of the points around each vertex that may be left outside the shell
+                 * when shrinking, or passed through when expanding. Must be within [0, 1). */
+                float outlierFraction;
+
+                /* The number of points around each vertex that may be left outside or passed through.
+                 * Whichever of the fraction and the count allows more points applies. */
+                unsigned outlierCount;
+
+                /* The number of histogram buckets of each vertex. The vertices are placed on the
+                 * bucket edges, so more buckets fit more tightly. Must be > 1. */
+                unsigned buckets;
+            };
+
+            /** Fits in linear time while tolerating outliers.
+                Every point is resolved once, and the distance each vertex of its face must have for
+                the point to be inside is added to a histogram per vertex. Each vertex is then placed
+                on the quantile of its histogram that leaves at most the allowed number of its points
+                outside, so a few noisy points only hold back the vertices around them.
+                Without outliers allowed the shell encloses every point, as with StableFitting, but
+                the vertices are placed independently: each only as far as the points of its own faces
+                need, rather than as far as moving it keeps the points inside. */
+            class QuantileFitting : public IFittingAlgorithm
+            {
+                QuantileFittingDescriptor mDesc;
+
+                /** Returns the number of points of a vertex that may be outside. */
+                unsigned allowedOutliers(unsigned points) const;
+
+            public:
+
+                /** Initialises the class, throwing an exception upon failure
+                 * (most commonly std::runtime_error)
+                 * @param scheduler The scheduler to run on, or null to run serially. */
+                QuantileFitting(QuantileFittingDescriptor desc, tasks::TaskScheduler* scheduler = nullptr);
+
+                /** Throws std::runtime_error if the descriptor is invalid. */
+                static void validate(const QuantileFittingDescriptor& desc);
 
-                virtual void shrink(BoundingPolyhedron& poly, const std::vector<math::vec3>& points, math::vec3 backgroundPoint,  float minimumDistance) const;
-                virtual void expand(BoundingPolyhedron& poly, const std::vector<math::vec3>& points, IColourSegmenter* segmenter, math::vec3 backgroundPoint, float startingRadius, float maximumRadius) const;
+                virtual void shrink(BoundingPolyhedron& poly, PointSpan points, math::vec3 backgroundPoint,  float minimumDistance, FittingWorkspace& workspace) const;
+                virtual void expand(BoundingPolyhedron& poly, PointSpan points, IColourSegmenter* segmenter, math::vec3 backgroundPoint, float startingRadius, float maximumRadius) const;
+                virtual void expandPositioned(BoundingPolyhedron& poly, PointSpan outerPoints, float startingRadius, float maximumRadius, FittingWorkspace& workspace) const;
             }; //End of class
 
             /** Does nothing */
             class NoFitting : public IFittingAlgorithm
             {
             public:
-                virtual void shrink(BoundingPolyhedron&, const std::vector<math::vec3>&, math::vec3,  float) const {}
-                virtual void expand(BoundingPolyhedron&, const std::vector<math::vec3>&, IColourSegmenter*, math::vec3, float, float) const {}
+                virtual void shrink(BoundingPolyhedron&, PointSpan, math::vec3,  float, FittingWorkspace&) const {}
+                virtual void expand(BoundingPolyhedron&, PointSpan, IColourSegmenter*, math::vec3, float, float) const {}
+                virtual void expandPositioned(BoundingPolyhedron&, PointSpan, float, float, FittingWorkspace&) const {}
             }; //End of class
         }
     }
@@ -0,0 +1,467 @@
+#include "framering.h"
+#include "io.h"
+#include <stdexcept>
+#include <chrono>
+#include <climits>
+#include <cerrno>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace anima
+{
+    namespace service
+    {
+        namespace
+        {
+            const uint32_t FRAME_RING_MAGIC = 0x524d5246;
+            const uint32_t FRAME_RING_VERSION = 1;
+
+            /* Keeps the slot headers and the images on their own cache lines. */
+            const size_t FRAME_RING_ALIGNMENT = 64;
+
+            size_t alignUp(size_t size)
+            {
+                return (size + FRAME_RING_ALIGNMENT - 1) & ~(FRAME_RING_ALIGNMENT - 1);
+            }
+
+            /* Sleeps while the word holds the expected value, for at most timeoutMs if not negative.
+             * Not private, as the word is shared between processes. */
+            void futexWait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs)
+            {
+                timespec timeout;
+                timeout.tv_sec = timeoutMs/1000;
+                timeout.tv_nsec = (timeoutMs%1000)*1000000L;
+
+                syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT, expected,
+                        timeoutMs < 0 ? nullptr : &timeout, nullptr, 0);
+            }
+
+            void futexWakeAll(std::atomic<uint32_t>& word)
+            {
+                syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+            }
+        }
+
+        struct FrameRing::Header
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint32_t slotCount;
+            uint32_t maxRows, maxCols;
+            int32_t frameType;
+
+            /* The offset of the first slot and the size of each. */
+            uint64_t slotsOffset, slotStride;
+
+            /* The offsets of the frame and the alpha within a slot. */
+            uint64_t frameOffset, alphaOffset;
+
+            /* The order in which slots were submitted, so they are processed first in first out. */
+            std::atomic<uint64_t> nextSequence;
+
+            /* Futex words, bumped whenever a slot becomes ready, or free or done. */
+            std::atomic<uint32_t> consumerSignal;
+            std::atomic<uint32_t> producerSignal;
+        };
+
+        struct FrameRing::SlotHeader
+        {
+            std::atomic<uint32_t> state;
+
+            /* The size of the frame written by the producer. */
+            uint32_t rows, cols;
+
+            /* Set by the consumer, 0 if the alpha was computed. */
+            uint32_t status;
+
+            uint64_t sequence;
+        };
+
+        bool FrameRing::isValidLayout(const Header& header, size_t size)
+        {
+            if(header.slotCount == 0 || header.maxRows == 0 || header.maxCols == 0 ||
+               header.maxRows > INT_MAX || header.maxCols > INT_MAX)
+                return false;
+
+            if(header.frameType != CV_8UC3 && header.frameType != CV_16UC3 && header.frameType != CV_32FC3)
+                return false;
+
+            //Everything is aligned as created, which also keeps the slot headers aligned.
+            if((header.slotsOffset | header.slotStride | header.frameOffset | header.alphaOffset) % FRAME_RING_ALIGNMENT)
+                return false;
+
+            //Each part follows the previous one and holds the largest frame.
+            //The sizes are compared by division, so that no product can overflow.
+            const uint64_t pixels = uint64_t(header.maxRows)*header.maxCols;
+            return header.slotsOffset >= sizeof(Header) && header.slotsOffset <= size &&
+                    header.frameOffset >= sizeof(SlotHeader) && header.alphaOffset >= header.frameOffset &&
+                    pixels <= (header.alphaOffset - header.frameOffset)/CV_ELEM_SIZE(header.frameType) &&
+                    header.slotStride >= header.alphaOffset &&
+                    pixels <= (header.slotStride - header.alphaOffset)/sizeof(float) &&
+                    header.slotStride <= (size - header.slotsOffset)/header.slotCount;
+        }
+
+        FrameRing::FrameRing(const FrameRingDescriptor& desc)
+            : mName(desc.name), mOwner(false), mMemory(nullptr), mSize(0), mHeader(nullptr)
+        {
+            if(desc.name.empty() || desc.name[0] != '/')
+                throw std::runtime_error("Frame ring names must start with a slash");
+
+            if(desc.create)
+            {
+                if(desc.slotCount == 0 || desc.maxRows == 0 || desc.maxCols == 0)
+                    throw std::runtime_error("Empty frame ring");
+
+                if(desc.frameType != CV_8UC3 && desc.frameType != CV_16UC3 && desc.frameType != CV_32FC3)
+                    throw std::runtime_error("Unsupported frame ring format");
+
+                const size_t pixels = size_t(desc.maxRows)*desc.maxCols;
+                const size_t frameOffset = alignUp(sizeof(SlotHeader));
+                const size_t alphaOffset = frameOffset + alignUp(pixels*CV_ELEM_SIZE(desc.frameType));
+                const size_t slotStride = alphaOffset + alignUp(pixels*sizeof(float));
+                const size_t slotsOffset = alignUp(sizeof(Header));
+
+                mSize = slotsOffset + slotStride*desc.slotCount;
+
+                //Any of the sizes above overflows for huge rings, in which case the layout does not fit.
+                Header layout;
+                layout.slotCount = desc.slotCount;
+                layout.maxRows = desc.maxRows;
+                layout.maxCols = desc.maxCols;
+                layout.frameType = desc.frameType;
+                layout.slotsOffset = slotsOffset;
+                layout.slotStride = slotStride;
+                layout.frameOffset = frameOffset;
+                layout.alphaOffset = alphaOffset;
+                if(!isValidLayout(layout, mSize))
+                    throw std::runtime_error("Frame ring too large");
+
+                //Replace any object left by a process that did not exit cleanly.
+                shm_unlink(desc.name.c_str());
+
+                int fd = shm_open(desc.name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                if(fd < 0)
+                    throw std::runtime_error("Could not create frame ring " + desc.name);
+
+                if(ftruncate(fd, mSize) != 0)
+                {
+                    close(fd);
+                    shm_unlink(desc.name.c_str());
+                    throw std::runtime_error("Could not resize frame ring " + desc.name);
+                }
+
+                mMemory = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+
+                if(mMemory == MAP_FAILED)
+                {
+                    mMemory = nullptr;
+                    shm_unlink(desc.name.c_str());
+                    throw std::runtime_error("Could not map frame ring " + desc.name);
+                }
+
+                mOwner = true;
+
+                //The memory is zero filled, so every slot starts as ESS_FREE.
+                mHeader = new(mMemory) Header();
+                mHeader->slotCount = desc.slotCount;
+                mHeader->maxRows = desc.maxRows;
+                mHeader->maxCols = desc.maxCols;
+                mHeader->frameType = desc.frameType;
+                mHeader->slotsOffset = slotsOffset;
+                mHeader->slotStride = slotStride;
+                mHeader->frameOffset = frameOffset;
+                mHeader->alphaOffset = alphaOffset;
+                mHeader->nextSequence = 0;
+                mHeader->consumerSignal = 0;
+                mHeader->producerSignal = 0;
+                mHeader->version = FRAME_RING_VERSION;
+
+                //Published last, so attaching processes see a complete header.
+                std::atomic_thread_fence(std::memory_order_release);
+                mHeader->magic = FRAME_RING_MAGIC;
+            }
+            else
+            {
+                int fd = shm_open(desc.name.c_str(), O_RDWR, 0);
+                if(fd < 0)
+                    throw std::runtime_error("Could not open frame ring " + desc.name);
+
+                struct stat info;
+                if(fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(Header))
+                {
+                    close(fd);
+                    throw std::runtime_error("Could not read frame ring " + desc.name);
+                }
+
+                mSize = info.st_size;
+                mMemory = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+
+                if(mMemory == MAP_FAILED)
+                {
+                    mMemory = nullptr;
+                    throw std::runtime_error("Could not map frame ring " + desc.name);
+                }
+
+                mHeader = (Header*)mMemory;
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if(mHeader->magic != FRAME_RING_MAGIC || mHeader->version != FRAME_RING_VERSION ||
+                   !isValidLayout(*mHeader, mSize))
+                {
+                    munmap(mMemory, mSize);
+                    throw std::runtime_error("Incompatible or corrupt frame ring " + desc.name);
+                }
+            }
+        }
+
+        FrameRing::~FrameRing()
+        {
+            if(mOwner)
+            {
+                wakeAll();
+                shm_unlink(mName.c_str());
+            }
+
+            munmap(mMemory, mSize);
+        }
+
+        unsigned FrameRing::slotCount() const
+        {
+            return mHeader->slotCount;
+        }
+
+        unsigned FrameRing::maxRows() const
+        {
+            return mHeader->maxRows;
+        }
+
+        unsigned FrameRing::maxCols() const
+        {
+            return mHeader->maxCols;
+        }
+
+        int FrameRing::frameType() const
+        {
+            return mHeader->frameType;
+        }
+
+        FrameRing::SlotHeader* FrameRing::slot(int index) const
+        {
+            if(index < 0 || unsigned(index) >= mHeader->slotCount)
+                throw std::runtime_error("Frame ring slot out of range");
+
+            return (SlotHeader*)((char*)mMemory + mHeader->slotsOffset + mHeader->slotStride*index);
+        }
+
+        int FrameRing::tryTransition(FrameSlotState from, FrameSlotState to)
+        {
+            for(;;)
+            {
+                //Take the oldest slot in the state, so that frames are handled in submission order.
+                int found = -1;
+                uint64_t oldest = 0;
+                for(unsigned i = 0; i < mHeader->slotCount; ++i)
+                {
+                    SlotHeader* s = slot(i);
+                    if(s->state.load(std::memory_order_relaxed) == uint32_t(from) &&
+                       (found < 0 || s->sequence < oldest))
+                    {
+                        found = i;
+                        oldest = s->sequence;
+                    }
+                }
+
+                if(found < 0)
+                    return -1;
+
+                //Another process on the same side may have taken it meanwhile.
+                uint32_t expected = from;
+                if(slot(found)->state.compare_exchange_strong(expected, to, std::memory_order_acquire))
+                    return found;
+            }
+        }
+
+        void FrameRing::transition(int index, FrameSlotState from, FrameSlotState to)
+        {
+            uint32_t expected = from;
+            if(!slot(index)->state.compare_exchange_strong(expected, to, std::memory_order_release))
+                throw std::runtime_error("Frame ring slot " + ToString(index) + " is not owned by the caller");
+
+            std::atomic<uint32_t>& signal = to == ESS_READY ? mHeader->consumerSignal : mHeader->producerSignal;
+            signal.fetch_add(1, std::memory_order_release);
+            futexWakeAll(signal);
+        }
+
+        int FrameRing::acquire(FrameSlotState from, FrameSlotState to, std::atomic<uint32_t>& signal, int timeoutMs)
+        {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+            for(;;)
+            {
+                //Read before scanning, so a transition after the scan makes the wait return at once.
+                uint32_t seen = signal.load(std::memory_order_acquire);
+
+                int index = tryTransition(from, to);
+                if(index >= 0)
+                    return index;
+
+                int remaining = -1;
+                if(timeoutMs >= 0)
+                {
+                    remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                deadline - std::chrono::steady_clock::now()).count();
+                    if(remaining <= 0)
+                        return -1;
+                }
+
+                futexWait(signal, seen, remaining);
+            }
+        }
+
+        int FrameRing::acquireFree(int timeoutMs)
+        {
+            return acquire(ESS_FREE, ESS_WRITING, mHeader->producerSignal, timeoutMs);
+        }
+
+        cv::Mat FrameRing::frame(int index, unsigned rows, unsigned cols)
+        {
+            SlotHeader* s = slot(index);
+
+            if(s->state.load(std::memory_order_relaxed) != ESS_WRITING)
+                throw std::runtime_error("Frame ring slot " + ToString(index) + " is not being written");
+
+            if(rows == 0 || cols == 0 || rows > mHeader->maxRows || cols > mHeader->maxCols)
+                throw std::runtime_error("Frame does not fit the frame ring");
+
+            s->rows = rows;
+            s->cols = cols;
+            return frame(index);
+        }
+
+        void FrameRing::submit(int index)
+        {
+            SlotHeader* s = slot(index);
+            if(s->rows == 0 || s->cols == 0)
+                throw std::runtime_error("Submitting a frame ring slot without a frame");
+
+            s->sequence = mHeader->nextSequence.fetch_add(1);
+            transition(index, ESS_WRITING, ESS_READY);
+        }
+
+        bool FrameRing::waitDone(int index, int timeoutMs)
+        {
+            SlotHeader* s = slot(index);
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+            for(;;)
+            {
+                uint32_t seen = mHeader->producerSignal.load(std::memory_order_acquire);
+
+                if(s->state.load(std::memory_order_acquire) == ESS_DONE)
+                    return true;
+
+                int remaining = -1;
+                if(timeoutMs >= 0)
+                {
+                    remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                deadline - std::chrono::steady_clock::now()).count();
+                    if(remaining <= 0)
+                        return false;
+                }
+
+                futexWait(mHeader->producerSignal, seen, remaining);
+            }
+        }
+
+        void FrameRing::release(int index)
+        {
+            slot(index)->rows = 0;
+            slot(index)->cols = 0;
+            transition(index, ESS_DONE, ESS_FREE);
+        }
+
+        int FrameRing::acquireReady(int timeoutMs)
+        {
+            int index = acquire(ESS_READY, ESS_PROCESSING, mHeader->consumerSignal, timeoutMs);
+            if(index >= 0)
+                slot(index)->status = 0;
+            return index;
+        }
+
+        void FrameRing::complete(int index, bool succeeded)
+        {
+            slot(index)->status = succeeded ? 0 : 1;
+            transition(index, ESS_PROCESSING, ESS_DONE);
+        }
+
+        bool FrameRing::succeeded(int index) const
+        {
+            return slot(index)->status == 0;
+        }
+
+        cv::Mat FrameRing::frame(int index) const
+        {
+            SlotHeader* s = slot(index);
+
+            //Written by the other process, so checked before being used.
+            if(s->rows > mHeader->maxRows || s->cols > mHeader->maxCols)
+                throw std::runtime_error("Frame ring slot " + ToString(index) + " holds an oversized frame");
+
+            return cv::Mat(s->rows, s->cols, mHeader->frameType, (char*)s + mHeader->frameOffset);
+        }
+
+        cv::Mat FrameRing::alpha(int index) const
+        {
+            SlotHeader* s = slot(index);
+
+            if(s->rows > mHeader->maxRows || s->cols > mHeader->maxCols)
+                throw std::runtime_error("Frame ring slot " + ToString(index) + " holds an oversized frame");
+
+            return cv::Mat(s->rows, s->cols, CV_32FC1, (char*)s + mHeader->alphaOffset);
+        }
+
+        void FrameRing::wakeAll()
+        {
+            mHeader->consumerSignal.fetch_add(1);
+            mHeader->producerSignal.fetch_add(1);
+            futexWakeAll(mHeader->consumerSignal);
+            futexWakeAll(mHeader->producerSignal);
+        }
+
+        void serveFrameRing(FrameRing& ring, const alg::IAlgorithm& algorithm, const std::atomic<bool>& running)
+        {
+            std::vector<cv::Mat> frames(1), alphas(1);
+
+            while(running)
+            {
+                //Wake up regularly to notice a stop request.
+                int index = ring.acquireReady(100);
+                if(index < 0)
+                    continue;
+
+                bool succeeded = true;
+                try
+                {
+                    //Both views point into the slot, so nothing is copied.
+                    frames[0] = ring.frame(index);
+                    alphas[0] = ring.alpha(index);
+                    algorithm.computeAlphas(frames, alphas);
+                }
+                catch(std::exception& err)
+                {
+                    Warning(std::string("Frame ring: ") + err.what());
+                    succeeded = false;
+                }
+
+                ring.complete(index, succeeded);
+            }
+        }
+    }
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include "ialgorithm.h"
+
+/**
+  * A ring of frame slots in POSIX shared memory, used to exchange frames with another local
+  * process without copying them. The producer writes a source frame straight into a slot,
+  * the matting engine computes the alpha straight into the same slot's reply area, and the
+  * producer reads it from there.
+  *
+  * Each slot is owned by one side at a time, as given by its state:
+  *   ESS_FREE -(producer acquires)-> ESS_WRITING -(submit)-> ESS_READY
+  *   ESS_READY -(consumer acquires)-> ESS_PROCESSING -(complete)-> ESS_DONE
+  *   ESS_DONE -(producer releases)-> ESS_FREE
+  * Transitions are atomic, and waiting sides sleep on a futex in the shared header.
+  */
+
+namespace anima
+{
+    namespace service
+    {
+        /** The descriptor of a frame ring. */
+        struct FrameRingDescriptor
+        {
+            /* The name of the shared memory object, starting with a slash. */
+            std::string name;
+
+            /* If true, the object is created (replacing any existing one) using the sizes below,
+             * and unlinked when the ring is destroyed. Otherwise an existing one is attached to,
+             * and the sizes are read from it. */
+            bool create;
+
+            /* The number of slots. */
+            unsigned slotCount;
+
+            /* The largest frame that fits in a slot. */
+            unsigned maxRows, maxCols;
+
+            /* The OpenCV type of the frames. CV_8UC3, CV_16UC3 and CV_32FC3 are supported.
+             * CV_32FC3 frames can be used by the engine without any conversion in RGB. */
+            int frameType;
+
+            FrameRingDescriptor() : create(false), slotCount(4), maxRows(0), maxCols(0), frameType(CV_32FC3) {}
+        };
+
+        /** The slot states. */
+        enum FrameSlotState
+        {
+            ESS_FREE,
+            ESS_WRITING,
+            ESS_READY,
+            ESS_PROCESSING,
+            ESS_DONE
+        };
+
+        /** The frame ring. */
+        class FrameRing
+        {
+            struct Header;
+            struct SlotHeader;
+
+            std::string mName;
+            bool mOwner;
+            void* mMemory;
+            size_t mSize;
+            Header* mHeader;
+
+            FrameRing(const FrameRing&);
+            FrameRing& operator=(const FrameRing&);
+
+            SlotHeader* slot(int index) const;
+
+            /** Returns whether the format and layout of a header are valid, and its slots fit in size bytes. */
+            static bool isValidLayout(const Header& header, size_t size);
+
+            /** Finds a slot in the given state and moves it to the new one. Returns -1 if none. */
+            int tryTransition(FrameSlotState from, FrameSlotState to);
+
+            /** Moves an owned slot to a new state and wakes the other side. */
+            void transition(int index, FrameSlotState from, FrameSlotState to);
+
+            /** Waits for a slot in the given state, moving it to the new one. */
+            int acquire(FrameSlotState from, FrameSlotState to, std::atomic<uint32_t>& signal, int timeoutMs);
+
+        public:
+
+            /** Creates or attaches to the ring, throwing std::runtime_error upon failure. */
+            FrameRing(const FrameRingDescriptor& desc);
+            ~FrameRing();
+
+            unsigned slotCount() const;
+            unsigned maxRows() const;
+            unsigned maxCols() const;
+            int frameType() const;
+
+            //Producer side
+
+            /** Waits for a free slot and takes ownership of it.
+              * Returns the slot index, or -1 upon timeout. A negative timeout waits forever. */
+            int acquireFree(int timeoutMs = -1);
+
+            /** Returns a view of the frame of an owned slot with the given size, to be written in place. */
+            cv::Mat frame(int index, unsigned rows, unsigned cols);
+
+            /** Hands a written slot to the consumer. */
+            void submit(int index);
+
+            /** Waits for a submitted slot to be completed. Returns false upon timeout. */
+            bool waitDone(int index, int timeoutMs = -1);
+
+            /** Returns the slot to the free pool after its alpha was used. */
+            void release(int index);
+
+            //Consumer side
+
+            /** Waits for a submitted slot and takes ownership of it.
+              * Returns the slot index, or -1 upon timeout. A negative timeout waits forever. */
+            int acquireReady(int timeoutMs = -1);
+
+            /** Hands a processed slot back to the producer, recording whether its alpha was computed. */
+            void complete(int index, bool succeeded = true);
+
+            //Both sides
+
+            /** Returns a view of the frame of a slot, sized as written by the producer. */
+            cv::Mat frame(int index) const;
+
+            /** Returns a view of the CV_32FC1 alpha reply of a slot, sized as its frame. */
+            cv::Mat alpha(int index) const;
+
+            /** Returns whether the alpha of a completed slot was computed. */
+            bool succeeded(int index) const;
+
+            /** Wakes every waiting process, such as before shutting down. */
+            void wakeAll();
+        };
+
+        /** Computes the alphas of the frames submitted to the ring with a fitted algorithm,
+          * until running is cleared. Frames are read and alphas written in place in the slots. */
+        void serveFrameRing(FrameRing& ring, const alg::IAlgorithm& algorithm, const std::atomic<bool>& running);
+    }
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <string>
 #include <opencv2/core/core.hpp>
 #include "inputassembler.h"
 
@@ -16,6 +17,8 @@ namespace anima
             const ia::InputAssembler* mInput;
         public:
 
+            IAlgorithm() : mInput(nullptr) {}
+
             /** Trivial virtual destructor */
             virtual ~IAlgorithm() {}
 
@@ -33,6 +36,26 @@ namespace anima
             /** Computes the alpha for the internal input.*/
             virtual cv::Mat computeAlphas() const = 0;
 
+            /** Computes the alpha for the internal input into alphas. A CV_32FC1 mat
+              * of the input size is reused, so that repeated calls do not allocate. */
+            virtual void computeAlphas(cv::Mat& alphas) const = 0;
+
+            /** Computes the alphas of a batch of frames against the analysed model, without
+              * assembling an input for each. The frames are only converted into the colour
+              * space of the analysed input, and are processed concurrently.
+              * The processing mask of the analysed input is not applied.
+              * @param frames 3-component images or views in any format supported by the input assembler.
+              * @param alphas Receives a CV_32FC1 alpha per frame. Mats of the right size are reused. */
+            virtual void computeAlphas(const std::vector<cv::Mat>& frames, std::vector<cv::Mat>& alphas) const = 0;
+
+            /** Saves the analysed model, so that it can be loaded instead of analysing again.
+              * Throws std::runtime_error upon failure. */
+            virtual void saveModel(const std::string& path) const = 0;
+
+            /** Loads a previously saved model, after which alphas may be computed without analysing.
+              * Throws std::runtime_error upon failure. */
+            virtual void loadModel(const std::string& path) = 0;
+
             /** Draws a 3D representation of the algorithm. */
             virtual void debugDraw() const = 0;
         };
@@ -3,6 +3,7 @@
 #include <vector>
 #include <opencv2/core/core.hpp>
 #include "inputassembler.h"
+#include "taskscheduler.h"
 
 /**
   * Given n polyhedrons, a background centre point and a list of points,
@@ -18,21 +19,183 @@ namespace anima
         {
             class IAlphaLocator
             {
+            protected:
+                /* The scheduler to run on, or null to run serially. */
+                tasks::TaskScheduler* const mScheduler;
+
+                /** Hashes the polyhedron vertices and the background, for locators that keep
+                  * state derived from the model. */
+                static size_t hashModel(const BoundingPolyhedron* polyhedrons,
+                                        const size_t polyhedronCount,
+                                        const math::vec3& background);
+
+                /* The side of the blocks in which masks are processed. */
+                static const int MASK_BLOCK_SIZE = 32;
+
+                /** Splits the input into the regions findAlphas() evaluates and calls evaluate(region)
+                  * on each of them, in parallel with a scheduler. Pixels excluded by the processing mask
+                  * of the input are set to its excluded alpha.
+                  * Locators that derive per-frame state from the model override findAlphas() to
+                  * prepare it once, and evaluate the regions with it through this. The function is
+                  * called directly rather than through a std::function, so it may capture freely
+                  * without allocating.
+                  * @param out Receives a CV_32FC1 mat of the input size, reused as by findAlphas().
+                  * @param tileSize Without a mask, the regions are bands of whole rows of tiles of this size. */
+                template<class F>
+                void evaluateRegions(const ia::InputAssembler& input, cv::Mat& out,
+                                     const F& evaluate, unsigned tileSize = 1) const;
+
+                /** Calls evaluate on the regions of the pixels with a non-zero mask value,
+                  * setting the rest to excludedAlpha, as findAlphasInMask() does. */
+                template<class F>
+                void evaluateRegionsInMask(const cv::Mat& mask, const cv::Rect& bounds, float excludedAlpha,
+                                           cv::Mat& out, const F& evaluate) const;
+
             public:
+                /** @param scheduler The scheduler to run on, or null to run serially. */
+                explicit IAlphaLocator(tasks::TaskScheduler* scheduler = nullptr) : mScheduler(scheduler) {}
 
                 virtual ~IAlphaLocator(){}
 
                 /** Calculates the alpha for a set of points.
+                  * Pixels excluded by the processing mask of the input are set to its excluded alpha.
                   * @param polyhedrons The polyhedrons usd by primatte
                                        ordered from inner to outer.
                   * @param polyhedronCount The number of polyhedrons.
                   * @param input The initialised input structure.
                   */
-                virtual cv::Mat findAlphas(
+                cv::Mat findAlphas(
+                        const BoundingPolyhedron* polyhedrons,
+                        const size_t polyhedronCount,
+                        const ia::InputAssembler &input) const;
+
+                /** Calculates the alpha for a set of points into out, as findAlphas() does.
+                  * @param out Receives a CV_32FC1 mat of the input size. Its data is reused
+                  *            if it already is one, so that repeated calls do not allocate.
+                  */
+                virtual void findAlphas(
+                        const BoundingPolyhedron* polyhedrons,
+                        const size_t polyhedronCount,
+                        const ia::InputAssembler &input,
+                        cv::Mat& out) const;
+
+                /** Calculates the alpha for the pixels with a non-zero mask value,
+                  * setting the rest to excludedAlpha. The mask is processed in blocks so
+                  * that the excluded areas cost next to nothing.
+                  * @param mask A CV_8UC1 mat of the size of points.
+                  * @param bounds The bounding rectangle of the non-zero mask pixels.
+                  * Other parameters as in findAlphasInRegion.
+                  */
+                void findAlphasInMask(
+                        const BoundingPolyhedron* polyhedrons,
+                        const size_t polyhedronCount,
+                        const cv::Mat& points,
+                        const math::vec3 background,
+                        const cv::Mat& mask,
+                        const cv::Rect& bounds,
+                        float excludedAlpha,
+                        cv::Mat& out) const;
+
+                /** Calculates the alpha for a rectangular region of points.
+                  * @param polyhedrons The polyhedrons usd by primatte
+                                       ordered from inner to outer.
+                  * @param polyhedronCount The number of polyhedrons.
+                  * @param points A CV_32FC3 mat of points in the internal colour space.
+                  * @param background The background point in the same colour space.
+                  * @param region The region of points for which to calculate the alpha.
+                  * @param out An allocated CV_32FC1 mat of the size of points.
+                               Only the region is written to.
+                  */
+                virtual void findAlphasInRegion(
                         const BoundingPolyhedron* polyhedrons,
                         const size_t polyhedronCount,
-                        const ia::InputAssembler &input) const = 0;
+                        const cv::Mat& points,
+                        const math::vec3 background,
+                        const cv::Rect& region,
+                        cv::Mat& out) const = 0;
             };
+
+            template<class F>
+            void IAlphaLocator::evaluateRegions(const ia::InputAssembler& input, cv::Mat& out,
+                                                const F& evaluate, unsigned tileSize) const
+            {
+                const cv::Mat& mat = input.mat();
+
+                //Only allocates if out is not already of this size and type.
+                out.create(mat.rows, mat.cols, CV_32FC1);
+
+                if(input.mask().empty())
+                {
+                    //Bands of whole blocks and tiles, so that tiled locators see the same tiles.
+                    const size_t bandRows = (MASK_BLOCK_SIZE + tileSize - 1)/tileSize*tileSize;
+                    tasks::parallelFor(mScheduler, 0, mat.rows, bandRows, [&](size_t begin, size_t end)
+                    {
+                        evaluate(cv::Rect(0, begin, mat.cols, end - begin));
+                    });
+                }
+                else
+                    evaluateRegionsInMask(input.mask(), input.maskBounds(), input.excludedAlpha(), out, evaluate);
+            }
+
+            template<class F>
+            void IAlphaLocator::evaluateRegionsInMask(const cv::Mat& mask, const cv::Rect& bounds, float excludedAlpha,
+                                                      cv::Mat& out, const F& evaluate) const
+            {
+                assert(mask.type() == CV_8UC1 && mask.rows == out.rows && mask.cols == out.cols);
+
+                out.setTo(cv::Scalar(excludedAlpha));
+
+                //Rows of blocks are processed in parallel with a scheduler.
+                const int blockRows = (bounds.height + MASK_BLOCK_SIZE - 1)/MASK_BLOCK_SIZE;
+                tasks::parallelFor(mScheduler, 0, blockRows, 1, [&](size_t begin, size_t end)
+                {
+                    const int rowsEnd = bounds.y + int(end)*MASK_BLOCK_SIZE;
+                    for(int by = bounds.y + int(begin)*MASK_BLOCK_SIZE; by < rowsEnd; by += MASK_BLOCK_SIZE)
+                        for(int bx = bounds.x; bx < bounds.x + bounds.width; bx += MASK_BLOCK_SIZE)
+                        {
+                            const cv::Rect block = cv::Rect(bx, by, MASK_BLOCK_SIZE, MASK_BLOCK_SIZE) & bounds;
+
+                            int included = 0;
+                            for(int y = block.y; y < block.y + block.height; ++y)
+                            {
+                                const unsigned char* maskData = mask.data + mask.step*y;
+                                for(int x = block.x; x < block.x + block.width; ++x)
+                                    included += maskData[x] != 0;
+                            }
+
+                            //Fully excluded blocks were already filled.
+                            if(included == 0)
+                                continue;
+
+                            if(included == block.area())
+                            {
+                                evaluate(block);
+                                continue;
+                            }
+
+                            //Partially covered blocks are evaluated in runs of included pixels.
+                            for(int y = block.y; y < block.y + block.height; ++y)
+                            {
+                                const unsigned char* maskData = mask.data + mask.step*y;
+                                int x = block.x;
+                                while(x < block.x + block.width)
+                                {
+                                    if(!maskData[x])
+                                    {
+                                        ++x;
+                                        continue;
+                                    }
+
+                                    const int runStart = x;
+                                    while(x < block.x + block.width && maskData[x])
+                                        ++x;
+
+                                    evaluate(cv::Rect(runStart, y, x - runStart, 1));
+                                }
+                            }
+                        }
+                });
+            }
         }
     }
 }
@@ -7,12 +7,25 @@
 
 namespace anima
 {
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
     namespace ia
     {
         class IAverageBackgroundColourLocator
         {
+        protected:
+            /* The scheduler to run on, or null to run serially. */
+            tasks::TaskScheduler* const mScheduler;
+
         public:
+            /** @param scheduler The scheduler to run on, or null to run serially. */
+            explicit IAverageBackgroundColourLocator(tasks::TaskScheduler* scheduler = nullptr) : mScheduler(scheduler) {}
+
             virtual ~IAverageBackgroundColourLocator(){}
+
             virtual math::vec3 findColour(const cv::Mat& mat) const = 0;
         };
     }
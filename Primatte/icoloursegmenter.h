@@ -1,14 +1,23 @@
 #pragma once
 #include "matrixd.h"
+#include "pointspan.h"
 #include <vector>
 /**
   * Given a vector of points, this class must return a subset of those points.
   * based on their distance from a background point.
   * It essentially choose the points against which the polyhedrons must be fitted.
+  * Segmenters classify each point, from which the interface either copies the two subsets
+  * into separate vectors, or partitions the points into a single array, inner points first,
+  * which is cheaper for the large point sets segmented by the algorithm.
   */
 
 namespace anima
 {
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
     namespace alg
     {
         namespace primatte
@@ -22,23 +31,100 @@ namespace anima
             std::vector<math::vec3> inner;
 
             //The union of these two constitutes the input points to the segmenter.
+
+            //Per-point scratch for segmenters, kept with the result so that reusing
+            //a result for segments of the same size does not allocate.
+            std::vector<unsigned char> scratch;
+        };
+
+        /** The halves of a partitioned point array: the inner points, followed by the outer ones. */
+        struct SegmenterSpans
+        {
+            PointSpan inner;
+            PointSpan outer;
+        };
+
+        /** Storage reused by partitioning, so that repeated partitions of the same size do not allocate.
+          * A scratch must only be used by one partitioning at a time. */
+        struct SegmenterScratch
+        {
+            /* The classification of each point. */
+            std::vector<unsigned char> isInner;
+
+            /* The number of inner points of each chunk, then their offsets. */
+            std::vector<size_t> chunkOffsets;
+
+            /* The partitioned copy swapped in when partitioning in place. */
+            std::vector<math::vec3> points;
         };
 
 
         class IColourSegmenter
         {
+        protected:
+            /* The scheduler to run on, or null to run serially. */
+            tasks::TaskScheduler* const mScheduler;
+
         public:
+            /** @param scheduler The scheduler to run on, or null to run serially. */
+            explicit IColourSegmenter(tasks::TaskScheduler* scheduler = nullptr) : mScheduler(scheduler) {}
 
             virtual ~IColourSegmenter(){}
 
-            /** Computes the subset.
+            /** Marks each point as inner (1) or outer (0).
+              * With a scheduler it is called concurrently on disjoint chunks of the points.
+              * @param points The points to classify.
+              * @param count The number of points.
+              * @param background The point around which to find the subset.
+              * @param approximateRadius Loosely-defined cut-off point.
+              * @param isInner Receives a flag per point.
+              */
+            virtual void classify(const math::vec3* points, size_t count,
+                                  const math::vec3 background, float approximateRadius,
+                                  unsigned char* isInner) const = 0;
+
+            /** Computes the subset into out, replacing its contents but reusing its storage.
+              * By default the points are classified, in parallel with a scheduler, and then
+              * gathered in order.
               * @param points The points the subset of which is to be found.
               * @param background The point around which to find the subset.
               * @param approximateRadius Loosely-defined cut-off point.
+              * @param out The result, which must not alias the points.
               */
-            virtual SegmenterResult segment(const std::vector<math::vec3>& points,
-                                               const math::vec3 background,
-                                               float approximateRadius) const = 0;
+            virtual void segment(const std::vector<math::vec3>& points,
+                                 const math::vec3 background,
+                                 float approximateRadius,
+                                 SegmenterResult& out) const;
+
+            /** Computes and returns the subset. */
+            SegmenterResult segment(const std::vector<math::vec3>& points,
+                                    const math::vec3 background,
+                                    float approximateRadius) const
+            {
+                SegmenterResult out;
+                segment(points, background, approximateRadius, out);
+                return out;
+            }
+
+            /** Partitions the points into out, the inner points first, keeping their order within
+              * each half so that the halves match the vectors of segment(). The points are copied
+              * once, and with a scheduler chunks of them are classified and moved in parallel.
+              * @param out Receives the partitioned points, reusing its storage. Must not alias the points.
+              * @param scratch The storage used while partitioning.
+              * @return The halves, which view out.
+              */
+            SegmenterSpans partition(PointSpan points,
+                                     const math::vec3 background,
+                                     float approximateRadius,
+                                     std::vector<math::vec3>& out,
+                                     SegmenterScratch& scratch) const;
+
+            /** Partitions the points in place, as partition() does.
+              * @return The halves, which view points. */
+            SegmenterSpans partitionInPlace(std::vector<math::vec3>& points,
+                                            const math::vec3 background,
+                                            float approximateRadius,
+                                            SegmenterScratch& scratch) const;
         };
         }
     }
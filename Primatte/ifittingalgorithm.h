@@ -11,24 +11,73 @@
   */
 namespace anima
 {
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
     namespace alg
     {
         namespace primatte
         {
             class IColourSegmenter;
 
+            /** Scratch storage for fitting, kept by the caller between fits so that
+              * refitting at the same resolution does not allocate.
+              * A workspace must only be used by one fit at a time. */
+            struct FittingWorkspace
+            {
+                /* A working copy of the polyhedron being fitted. */
+                BoundingPolyhedron poly;
+
+                /* The polyhedron of the previous level when fitting coarse-to-fine. */
+                BoundingPolyhedron coarsePoly;
+
+                /* A flag per vertex. */
+                std::vector<unsigned char> vertexFlags;
+
+                /* The points resolved into rays from the centre of the polyhedron being fitted,
+                 * and their distances from it. The vertices only move along their directions from
+                 * the centre, so each point passes through the same face throughout a fit. */
+                std::vector<SpherePolyhedron::RayContext> rays;
+                std::vector<float> rayLengths;
+
+                /* The indices of the rays a fit must keep inside or outside, the most recently
+                 * violating first. */
+                std::vector<unsigned> guardedRays;
+
+                /* A histogram per vertex, and a distance per vertex. */
+                std::vector<unsigned> vertexBuckets;
+                std::vector<float> vertexDistances;
+
+                /* The number of sweeps over the vertices made by the last fit, and whether it
+                 * ran out of time, for fitters that stop early. */
+                unsigned sweeps;
+                bool outOfTime;
+
+                FittingWorkspace() : sweeps(0), outOfTime(false) {}
+            };
+
             class IFittingAlgorithm
             {
+            protected:
+                /* The scheduler to run on, or null to run serially. */
+                tasks::TaskScheduler* const mScheduler;
+
             public:
+                /** @param scheduler The scheduler to run on, or null to run serially. */
+                explicit IFittingAlgorithm(tasks::TaskScheduler* scheduler = nullptr) : mScheduler(scheduler) {}
+
                 virtual ~IFittingAlgorithm(){}
 
                 /** Fits the polyhedron around the points.
                   * @param poly The polyhedron to be shrunk.
                   * @param points The points around which to shrink.
                   * @param minimumDistance The minimum distance of a vertex to the centre.
+                  * @param workspace The scratch storage to use.
                   */
-                virtual void shrink(BoundingPolyhedron& poly, const std::vector<math::vec3>& points, math::vec3 backgroundPoint,
-                                    float minimumDistance) const = 0;
+                virtual void shrink(BoundingPolyhedron& poly, PointSpan points, math::vec3 backgroundPoint,
+                                    float minimumDistance, FittingWorkspace& workspace) const = 0;
 
                 /** Fits the polyhedron around the points.
                   * @param poly The polyhedron to be expanded.
@@ -36,8 +85,19 @@ namespace anima
                   * @param segmenter The segmenter to use when determining inner/outer points before expansion.
                   * @param maximumDistance The maximum distance of a vertex from the centre.
                   */
-                virtual void expand(BoundingPolyhedron& poly, const std::vector<math::vec3>& points, IColourSegmenter* segmenter,
+                virtual void expand(BoundingPolyhedron& poly, PointSpan points, IColourSegmenter* segmenter,
                                      math::vec3 backgroundPoint, float startingRadius, float maximumRadius) const = 0;
+
+                /** The expansion step of expand(), for a polyhedron already positioned around the
+                  * inner points of the segmentation at startingRadius. expand() is equivalent to
+                  * segmenting, positioning and calling this, which allows the first two to run ahead.
+                  * @param poly The positioned polyhedron to be expanded.
+                  * @param outerPoints The outer points of the segmentation, inside which to expand.
+                  * @param workspace The scratch storage to use.
+                  */
+                virtual void expandPositioned(BoundingPolyhedron& poly, PointSpan outerPoints,
+                                              float startingRadius, float maximumRadius,
+                                              FittingWorkspace& workspace) const = 0;
             };
         }
     }
@@ -4,35 +4,24 @@
 #include <stdexcept>
 #include <opencv2/opencv.hpp>
 #include "iaveragebackgroundcolourlocator.h"
+#include "taskscheduler.h"
+#include <atomic>
+#include <cstdint>
 
 namespace anima
 {
     namespace ia
     {
-        std::vector<math::vec3> RemoveDuplicatesWithGrid(const cv::Mat& mat, unsigned gridSize)
+        namespace
         {
-            START_TIMER(CleaningWithGrid);
-
-            assert(mat.type() == CV_32FC3);
-            const unsigned r = mat.rows, c = mat.cols;
-
-            std::vector<math::vec3> points;
-            points.reserve(r*c/50);
-
-            const unsigned gridCubed = gridSize*gridSize*gridSize;
-            const unsigned gridSizeMinusOne = gridSize-1;
-
-            bool* grid = new(std::nothrow) bool[gridCubed]();
-
-            if(!grid)
-                throw std::runtime_error("Unable to allocate 3D grid for input processing");
-
-            for (unsigned i = 0; i < r; ++i)
+            /* Maps points to the cells of the duplicate removal grid. */
+            struct GridCell
             {
-                float* data = (float*)(mat.data + mat.step*i);
-                for(unsigned j = 0; j < c; ++j)
+                unsigned gridSize;
+
+                unsigned operator()(const math::vec3& p) const
                 {
-                    math::vec3& p = *((math::vec3*)(data + j*3));
+                    const unsigned gridSizeMinusOne = gridSize-1;
                     math::vec3i pi(p.x*gridSize,p.y*gridSize,p.z*gridSize);
                     if(unsigned(pi.x) >= gridSize)
                         pi.x = gridSizeMinusOne;
@@ -40,38 +29,224 @@ namespace anima
                         pi.y = gridSizeMinusOne;
                     if(unsigned(pi.z) >= gridSize)
                         pi.z = gridSizeMinusOne;
+                    return pi.x + gridSize*(pi.y + gridSize*pi.z);
+                }
+            };
+
+            /* Calls f(point) for the pixels of rows [rowBegin, rowEnd) of the bounds that are not masked out. */
+            template<class F>
+            void ForEachPixel(const cv::Mat& mat, const cv::Mat& mask, const cv::Rect& bounds,
+                              unsigned rowBegin, unsigned rowEnd, const F& f)
+            {
+                for (unsigned i = rowBegin; i < rowEnd; ++i)
+                {
+                    const float* data = (const float*)(mat.data + mat.step*(bounds.y+i)) + bounds.x*3;
+                    const unsigned char* maskData = mask.empty() ? nullptr : mask.data + mask.step*(bounds.y+i) + bounds.x;
+                    for(int j = 0; j < bounds.width; ++j)
+                    {
+                        if(maskData && !maskData[j])
+                            continue;
+
+                        f(*((const math::vec3*)(data + j*3)));
+                    }
+                }
+            }
+        }
+
+        //The least rows per band when removing duplicates in parallel.
+        static const unsigned DEDUP_BAND_ROWS = 8;
 
-                    bool& b = grid[pi.x + gridSize*(pi.y + gridSize*pi.z)];
+        //Bands are numbered from 1 in the grid bytes, the last value marking kept cells.
+        static const unsigned DEDUP_MAX_BANDS = 254;
+        static const unsigned char DEDUP_CELL_KEPT = 255;
+
+        /** Keeps a single point per grid cell, the first one in row order. If the mask is not
+            empty, only the pixels inside the bounds with a non-zero mask value are considered.
+            With a scheduler the rows are processed in parallel bands, keeping the same points. */
+        std::vector<math::vec3> RemoveDuplicatesWithGrid(const cv::Mat& mat, unsigned gridSize,
+                                                         const cv::Mat& mask, const cv::Rect& bounds,
+                                                         tasks::TaskScheduler* scheduler)
+        {
+            START_TIMER(CleaningWithGrid);
+
+            assert(mat.type() == CV_32FC3);
+            const unsigned r = bounds.height;
+
+            const unsigned gridCubed = gridSize*gridSize*gridSize;
+            const GridCell cellOf = {gridSize};
+
+            std::vector<math::vec3> points;
+
+            if(!scheduler || r < 2*DEDUP_BAND_ROWS)
+            {
+                points.reserve(r*bounds.width/50);
+
+                bool* grid = new(std::nothrow) bool[gridCubed]();
+
+                if(!grid)
+                    throw std::runtime_error("Unable to allocate 3D grid for input processing");
+
+                ForEachPixel(mat, mask, bounds, 0, r, [&](const math::vec3& p)
+                {
+                    bool& b = grid[cellOf(p)];
                     if (!b)
                     {
                         b = true;
                         points.push_back(p);
                     }
-                }
+                });
+
+                delete[] grid;
             }
+            else
+            {
+                const unsigned bandCount = std::min(DEDUP_MAX_BANDS, r/DEDUP_BAND_ROWS);
+                const unsigned bandRows = (r + bandCount - 1)/bandCount;
+
+                std::atomic<unsigned char>* grid = new(std::nothrow) std::atomic<unsigned char>[gridCubed]();
 
-            delete[] grid;
+                if(!grid)
+                    throw std::runtime_error("Unable to allocate 3D grid for input processing");
+
+                //First, each cell records the lowest band that has a pixel in it.
+                scheduler->parallelFor(0, bandCount, 1, [&](size_t begin, size_t end)
+                {
+                    for(size_t b = begin; b < end; ++b)
+                    {
+                        const unsigned char band = b + 1;
+                        const unsigned rowEnd = std::min(r, unsigned(b+1)*bandRows);
+                        ForEachPixel(mat, mask, bounds, b*bandRows, rowEnd, [&](const math::vec3& p)
+                        {
+                            std::atomic<unsigned char>& cell = grid[cellOf(p)];
+                            unsigned char current = cell.load(std::memory_order_relaxed);
+                            while((current == 0 || current > band) &&
+                                  !cell.compare_exchange_weak(current, band, std::memory_order_relaxed)) {}
+                        });
+                    }
+                });
+
+                //Then that band keeps its first pixel in the cell, as the serial scan would.
+                std::vector<std::vector<math::vec3> > bandPoints(bandCount);
+                scheduler->parallelFor(0, bandCount, 1, [&](size_t begin, size_t end)
+                {
+                    for(size_t b = begin; b < end; ++b)
+                    {
+                        const unsigned char band = b + 1;
+                        const unsigned rowEnd = std::min(r, unsigned(b+1)*bandRows);
+                        ForEachPixel(mat, mask, bounds, b*bandRows, rowEnd, [&](const math::vec3& p)
+                        {
+                            std::atomic<unsigned char>& cell = grid[cellOf(p)];
+                            if(cell.load(std::memory_order_relaxed) == band)
+                            {
+                                cell.store(DEDUP_CELL_KEPT, std::memory_order_relaxed);
+                                bandPoints[b].push_back(p);
+                            }
+                        });
+                    }
+                });
+
+                delete[] grid;
+
+                size_t total = 0;
+                for(unsigned b = 0; b < bandCount; ++b)
+                    total += bandPoints[b].size();
+
+                points.reserve(total);
+                for(unsigned b = 0; b < bandCount; ++b)
+                    points.insert(points.end(), bandPoints[b].begin(), bandPoints[b].end());
+            }
 
             END_TIMER(CleaningWithGrid);
 
             return points;
         }
 
-        void RandomSimplify(std::vector<math::vec3>* points, float percentageToRemove)
+        //The strata along each axis when subsampling without a given number.
+        static const unsigned DEFAULT_SIMPLIFY_STRATA = 8;
+
+        /** Returns a well mixed, platform independent hash of the seed and value. */
+        static unsigned MixHash(unsigned seed, unsigned value)
         {
-            START_TIMER(RandomSimplifying);
-            size_t initialSize = points->size();
+            unsigned h = seed ^ (value*0x9e3779b9u);
+            h ^= h >> 16;
+            h *= 0x85ebca6bu;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35u;
+            h ^= h >> 16;
+            return h;
+        }
+
+        /** Keeps count of every total values presented to it, evenly spread, starting from
+            a phase in [0, total). Exactly count are kept once all total are presented. */
+        struct SystematicSampler
+        {
+            uint64_t count, total, accumulator;
+
+            bool next()
+            {
+                accumulator += count;
+                if(accumulator < total)
+                    return false;
+
+                accumulator -= total;
+                return true;
+            }
+        };
+
+        /** Keeps budget of the points, preserving their order.
+            The points are stratified by the cells of a coarse grid of the colour cube, and the
+            first point of each stratum is kept before any other, so that sparse colours survive.
+            A first pass counts the strata; the budget left over is then spread over the other
+            points by systematic sampling across the whole input, so that every part of the image
+            is sampled at the same rate. If there are more strata than the budget, their first
+            points are sampled the same way instead. The phases come from the seed, so the result
+            is deterministic. */
+        void StratifiedSubsample(std::vector<math::vec3>* points, size_t budget, unsigned seed, unsigned strata)
+        {
+            START_TIMER(Subsampling);
+            const size_t initialSize = points->size();
+
+            if(budget < initialSize)
+            {
+                const GridCell stratumOf = {strata};
+                std::vector<bool> seen(strata*strata*strata, false);
 
-            std::random_device rd;
-            std::mt19937 random(rd());
-            std::shuffle(points->begin(), points->end(), random);
+                size_t firsts = 0;
+                for(size_t i = 0; i < initialSize; ++i)
+                {
+                    const unsigned stratum = stratumOf((*points)[i]);
+                    firsts += !seen[stratum];
+                    seen[stratum] = true;
+                }
+
+                const size_t others = initialSize - firsts;
+                const size_t firstBudget = std::min(budget, firsts);
 
-            points->erase(points->begin()+(int)(points->size()*(1.f-percentageToRemove/100.f)), points->end());
+                SystematicSampler firstSampler = {firstBudget, firsts, MixHash(seed, 0) % firsts};
+                SystematicSampler otherSampler = {budget - firstBudget, others, others ? MixHash(seed, 1) % others : 0};
+
+                seen.assign(seen.size(), false);
+
+                size_t kept = 0;
+                for(size_t i = 0; i < initialSize; ++i)
+                {
+                    const math::vec3 p = (*points)[i];
+                    const unsigned stratum = stratumOf(p);
+
+                    const bool keep = seen[stratum] ? otherSampler.next() : firstSampler.next();
+                    seen[stratum] = true;
+
+                    if(keep)
+                        (*points)[kept++] = p;
+                }
+
+                points->resize(kept);
+            }
 
             Inform("" + ToString(points->size()/float(initialSize)*100) + "% of points remain (" +
                    ToString(points->size()) + "/" + ToString(initialSize)+")");
 
-            END_TIMER(RandomSimplifying);
+            END_TIMER(Subsampling);
         }
 
         float InputAssembler::normalisationMultiplier(int cvCode)
@@ -90,6 +265,51 @@ namespace anima
             assert(0);
         }
 
+        void InputAssembler::convertToColourspace(const cv::Mat& source, cv::Mat& out,
+                                                  InputAssemblerDescriptor::TargetColourspace colourSpace,
+                                                  bool borrow)
+        {
+            //Floating point rgb needs no conversion, so a header over the source will do.
+            if(borrow && source.type() == CV_32FC3 && colourSpace == InputAssemblerDescriptor::ETCS_RGB)
+            {
+                out = source;
+                return;
+            }
+
+            source.convertTo(out, CV_32FC3, normalisationMultiplier(source.type()));
+
+            switch(colourSpace)
+            {
+            case InputAssemblerDescriptor::ETCS_RGB:
+                break;
+            case InputAssemblerDescriptor::ETCS_HSV:
+                cv::cvtColor(out, out, CV_RGB2HSV);
+
+                //Normalise hue:
+                for (int i = 0; i < out.rows; ++i)
+                {
+                    float* data = (float*)(out.data + out.step*i);
+                    for(int j = 0; j < out.cols; ++j)
+                        *(data + j*3)/=360.f;
+                }
+                break;
+            case InputAssemblerDescriptor::ETCS_LAB:
+                cv::cvtColor(out, out, CV_RGB2Lab);
+
+                //Get into proper range
+                for (int i = 0; i < out.rows; ++i)
+                {
+                    float* data = (float*)(out.data + out.step*i);
+                    for(int j = 0; j < out.cols; ++j)
+                    {
+                        math::vec3& p = *((math::vec3*)(data + j*3));
+                        p = math::vec3(p.x, (p.y+127.f), (p.z+127.f))/254.f;
+                    }
+                }
+                break;
+            }
+        }
+
         InputAssembler::InputAssembler(InputAssemblerDescriptor& desc)
         {
             START_TIMER(ProcessingInput);
@@ -112,78 +332,104 @@ namespace anima
             if(desc.backgroundSource->cols*desc.backgroundSource->rows==0)
                 throw std::runtime_error("Empty background source.");
 
+            buildMask(desc);
 
-            desc.foregroundSource->convertTo(mForegroundF, CV_32FC3,
-                                             normalisationMultiplier(desc.foregroundSource->type()));
-            desc.backgroundSource->convertTo(mBackgroundF, CV_32FC3,
-                                             normalisationMultiplier(desc.backgroundSource->type()));
 
             //Convert everything to the appropriate colour space:
             mColourSpace = desc.targetColourspace;
 
-            switch(desc.targetColourspace)
+            convertToColourspace(*desc.foregroundSource, mForegroundF, mColourSpace, desc.borrowSources);
+            convertToColourspace(*desc.backgroundSource, mBackgroundF, mColourSpace, desc.borrowSources);
+
+            //Convert mat to vector, and clean:
+            mPoints = RemoveDuplicatesWithGrid(mForegroundF, desc.ipd.gridSize, mMask, mMaskBounds, desc.scheduler);
+            mBackgroundPoints = RemoveDuplicatesWithGrid(mBackgroundF, desc.ipd.gridSize, cv::Mat(),
+                                                         cv::Rect(0, 0, mBackgroundF.cols, mBackgroundF.rows),
+                                                         desc.scheduler);
+
+            //Find dominant background colour:
+            mBackground = desc.backgroundLocator->findColour(mBackgroundF);
+
+            //Subsample if needed:
+            if(desc.ipd.randomSimplify)
             {
-            case InputAssemblerDescriptor::ETCS_RGB:
-                break;
-            case InputAssemblerDescriptor::ETCS_HSV:
-                cv::cvtColor(mForegroundF, mForegroundF, CV_RGB2HSV);
-                cv::cvtColor(mBackgroundF, mBackgroundF, CV_RGB2HSV);
+                const unsigned strata = desc.ipd.simplifyStrata ? desc.ipd.simplifyStrata : DEFAULT_SIMPLIFY_STRATA;
+                const float keptFraction = 1.f - desc.ipd.randomSimplifyPercentage/100.f;
+                const size_t budget = desc.ipd.simplifyBudget;
 
-                //Normalise hue:
-                for (int i = 0; i < mForegroundF.rows; ++i)
-                {
-                    float* data = (float*)(mForegroundF.data + mForegroundF.step*i);
-                    for(int j = 0; j < mForegroundF.cols; ++j)
-                        *(data + j*3)/=360.f;
-                }
-                for (int i = 0; i < mBackgroundF.rows; ++i)
-                {
-                    float* data = (float*)(mBackgroundF.data + mBackgroundF.step*i);
-                    for(int j = 0; j < mBackgroundF.cols; ++j)
-                        *(data + j*3)/=360.f;
-                }
-                break;
-            case InputAssemblerDescriptor::ETCS_LAB:
-                cv::cvtColor(mForegroundF, mForegroundF, CV_RGB2Lab);
-                cv::cvtColor(mBackgroundF, mBackgroundF, CV_RGB2Lab);
+                StratifiedSubsample(&mPoints, budget ? budget : size_t(mPoints.size()*keptFraction),
+                                    desc.ipd.simplifySeed, strata);
 
-                //Get into proper range
-                for (int i = 0; i < mForegroundF.rows; ++i)
+                //Seeded differently, so that the two sets are not sampled in lockstep.
+                StratifiedSubsample(&mBackgroundPoints, budget ? budget : size_t(mBackgroundPoints.size()*keptFraction),
+                                    desc.ipd.simplifySeed + 1, strata);
+            }
+
+            END_TIMER(ProcessingInput);
+        }
+
+        void InputAssembler::buildMask(const InputAssemblerDescriptor& desc)
+        {
+            const int rows = desc.foregroundSource->rows, cols = desc.foregroundSource->cols;
+
+            mExcludedAlpha = desc.excludedAlpha;
+            mMaskBounds = cv::Rect(0, 0, cols, rows);
+
+            if(!desc.garbageMatte && !desc.regionsOfInterest)
+                return;
+
+            if(desc.garbageMatte)
+            {
+                if(desc.garbageMatte->type() != CV_8UC1)
+                    throw std::runtime_error("The garbage matte must be CV_8UC1.");
+
+                if(desc.garbageMatte->rows != rows || desc.garbageMatte->cols != cols)
+                    throw std::runtime_error("The garbage matte must be the size of the foreground.");
+
+                mMask = desc.garbageMatte->clone();
+            }
+            else
+                mMask = cv::Mat(rows, cols, CV_8UC1, cv::Scalar(255));
+
+            //Clear everything outside the regions of interest.
+            if(desc.regionsOfInterest)
+            {
+                cv::Mat roiMask(rows, cols, CV_8UC1, cv::Scalar(0));
+                for(auto it = desc.regionsOfInterest->begin(); it != desc.regionsOfInterest->end(); ++it)
                 {
-                    float* data = (float*)(mForegroundF.data + mForegroundF.step*i);
-                    for(int j = 0; j < mForegroundF.cols; ++j)
-                    {
-                        math::vec3& p = *((math::vec3*)(data + j*3));
-                        p = math::vec3(p.x, (p.y+127.f), (p.z+127.f))/254.f;
-                    }
+                    cv::Rect rect = *it & mMaskBounds;
+                    for(int i = rect.y; i < rect.y + rect.height; ++i)
+                        memset(roiMask.data + roiMask.step*i + rect.x, 255, rect.width);
                 }
-                for (int i = 0; i < mBackgroundF.rows; ++i)
+
+                for(int i = 0; i < rows; ++i)
                 {
-                    float* data = (float*)(mBackgroundF.data + mBackgroundF.step*i);
-                    for(int j = 0; j < mBackgroundF.cols; ++j)
-                    {
-                        math::vec3& p = *((math::vec3*)(data + j*3));
-                        p = math::vec3(p.x, (p.y+127.f), (p.z+127.f))/254.f;
-                    }
+                    unsigned char* data = mMask.data + mMask.step*i;
+                    const unsigned char* roiData = roiMask.data + roiMask.step*i;
+                    for(int j = 0; j < cols; ++j)
+                        data[j] = roiData[j] ? data[j] : 0;
                 }
-                break;
             }
 
-            //Convert mat to vector, and clean:
-            mPoints = RemoveDuplicatesWithGrid(mForegroundF, desc.ipd.gridSize);
-            mBackgroundPoints = RemoveDuplicatesWithGrid(mBackgroundF, desc.ipd.gridSize);
-
-            //Find dominant background colour:
-            mBackground = desc.backgroundLocator->findColour(mBackgroundF);
-
-            //Simplify randomly if needed:
-            if(desc.ipd.randomSimplify)
+            //Find the bounds of the included pixels.
+            int minX = cols, minY = rows, maxX = -1, maxY = -1;
+            for(int i = 0; i < rows; ++i)
             {
-                RandomSimplify(&mPoints, desc.ipd.randomSimplifyPercentage);
-                RandomSimplify(&mBackgroundPoints, desc.ipd.randomSimplifyPercentage);
+                const unsigned char* data = mMask.data + mMask.step*i;
+                for(int j = 0; j < cols; ++j)
+                    if(data[j])
+                    {
+                        minX = std::min(minX, j);
+                        maxX = std::max(maxX, j);
+                        minY = std::min(minY, i);
+                        maxY = i;
+                    }
             }
 
-            END_TIMER(ProcessingInput);
+            mMaskBounds = maxX < 0 ? cv::Rect() : cv::Rect(minX, minY, maxX-minX+1, maxY-minY+1);
+
+            Inform("Processing mask covers " + ToString(cv::countNonZero(mMask)) + "/" +
+                   ToString(rows*cols) + " pixels");
         }
 
         cv::Point3f InputAssembler::debugGetPointColour(math::vec3 p) const
@@ -231,6 +477,26 @@ namespace anima
             return mForegroundF;
         }
 
+        const cv::Mat& InputAssembler::mask() const
+        {
+            return mMask;
+        }
+
+        cv::Rect InputAssembler::maskBounds() const
+        {
+            return mMaskBounds;
+        }
+
+        float InputAssembler::excludedAlpha() const
+        {
+            return mExcludedAlpha;
+        }
+
+        InputAssemblerDescriptor::TargetColourspace InputAssembler::colourSpace() const
+        {
+            return mColourSpace;
+        }
+
         math::vec3 InputAssembler::background() const
         {
             return mBackground;
@@ -11,6 +11,11 @@
 
 namespace anima
 {
+    namespace tasks
+    {
+        class TaskScheduler;
+    }
+
     namespace ia
     {
         class IAverageBackgroundColourLocator;
@@ -33,22 +38,55 @@ namespace anima
 
             const cv::Mat* backgroundSource;
 
+            /** If set, CV_32FC3 sources converted to rgb are referenced rather than copied,
+                such as frames living in shared memory. They must then outlive the assembler unchanged. */
+            bool borrowSources;
+
+            /** Optional garbage matte. A CV_8UC1 mat of the foreground size, where pixels
+                set to zero are excluded from processing. */
+            const cv::Mat* garbageMatte;
+
+            /** Optional list of regions of interest. If set, pixels outside all of the
+                rectangles are excluded from processing. Combined with the garbage matte if both are set. */
+            const std::vector<cv::Rect>* regionsOfInterest;
+
+            /** The alpha given to excluded pixels. */
+            float excludedAlpha;
+
+            /** The scheduler to process the input on, or null to process it serially. */
+            tasks::TaskScheduler* scheduler;
+
             /** The input processing descriptor, setting out pixel cleaning options. */
             struct InputCleanupDescriptor
             {
-                /** Wheter to remove points at random. */
+                /** Whether to subsample the points after removing duplicates.
+                    The subsampling is stratified over a coarse grid of the colour cube, and
+                    deterministic for a given seed. */
                 bool randomSimplify;
 
-                /** Percentage of points to remove randomly. */
+                /** Percentage of points to remove when subsampling. */
                 float randomSimplifyPercentage;
 
+                /** If not zero, the number of points each point set is subsampled to,
+                    instead of removing a percentage. */
+                unsigned simplifyBudget;
+
+                /** The seed of the subsampling. The same seed and input always keep the same points. */
+                unsigned simplifySeed;
+
+                /** The number of strata along each axis of the colour cube, up to 64.
+                    The first point of every stratum is kept before any other, so that sparse,
+                    extreme colours survive. 0 uses 8. */
+                unsigned simplifyStrata;
+
                 /** Used for early stage pre-processing where only one point is kept per 3D grid box. */
                 unsigned gridSize;
 
                 bool validate()
                 {
                     if(randomSimplifyPercentage < 0 ||
-                       randomSimplifyPercentage > 100)
+                       randomSimplifyPercentage > 100 ||
+                       simplifyStrata > 64)
                         return false;
                     else
                         return true;
@@ -65,14 +103,32 @@ namespace anima
         class InputAssembler
         {
             cv::Mat mForegroundF, mBackgroundF;
+
+            //The processing mask built from the garbage matte and regions of interest.
+            //Empty if every pixel is processed.
+            cv::Mat mMask;
+            cv::Rect mMaskBounds;
+            float mExcludedAlpha;
             std::vector<math::vec3> mPoints, mBackgroundPoints;
             math::vec3 mBackground;
             InputAssemblerDescriptor::TargetColourspace mColourSpace;
 
+            /** Builds the processing mask from the garbage matte and the regions of interest. */
+            void buildMask(const InputAssemblerDescriptor& desc);
+
+        public:
+
             /** Returns the normalisation multiplier for a CV code
                 CV_8UC3, CV_UC16C3 and CV_32FC3 supported.*/
             static float normalisationMultiplier(int cvCode);
-        public:
+
+            /** Converts a 3-component image into the normalised floating point
+                representation of the given colour space, as used for the internal mats.
+                8-bit, 16-bit and floating point formats are supported.
+                If borrow is set and the source is already in that representation, out references it. */
+            static void convertToColourspace(const cv::Mat& source, cv::Mat& out,
+                                             InputAssemblerDescriptor::TargetColourspace colourSpace,
+                                             bool borrow = false);
 
             /** Initialises the input, throwing an exception if failed. */
             InputAssembler(InputAssemblerDescriptor& desc);
@@ -86,6 +142,19 @@ namespace anima
             /** Returns the internal floating point image. */
             const cv::Mat& mat() const;
 
+            /** Returns the CV_8UC1 processing mask, where zero pixels are excluded.
+                Empty if all pixels are processed. */
+            const cv::Mat& mask() const;
+
+            /** Returns the bounding rectangle of the processed pixels. */
+            cv::Rect maskBounds() const;
+
+            /** Returns the alpha to be given to excluded pixels. */
+            float excludedAlpha() const;
+
+            /** Returns the colour space of the internal points. */
+            InputAssemblerDescriptor::TargetColourspace colourSpace() const;
+
             /** Returns the most dominant background point in the correct colour space. */
             math::vec3 background() const;
 
@@ -15,3 +15,8 @@ void Inform(const std::string& msg)
 {
     std::cout << ":- " << msg << "\n";
 }
+
+void InformTimer(const char* name, long long milliseconds)
+{
+    std::cout << ":- Stopping timer: " << name << " : " << milliseconds << "\n";
+}
@@ -15,6 +15,9 @@ void Warning(const std::string& msg);
 /** Prints the given information message. */
 void Inform(const std::string& msg);
 
+/** Prints the duration of a timer without building any strings, so that timed code stays allocation-free. */
+void InformTimer(const char* name, long long milliseconds);
+
 /** Converts the input to a string. */
 template <class T>
 std::string ToString(const T t)
@@ -36,5 +39,5 @@ std::string ToString(const T t)
 
 #define START_TIMER(t) auto t = std::chrono::system_clock::now();
 
-#define END_TIMER(t) {Inform("Stopping timer: "#t + std::string(" : ") + \
-    ToString(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - t).count()));}
+#define END_TIMER(t) {InformTimer(#t, \
+    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - t).count());}
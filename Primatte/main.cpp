@@ -1,8 +1,248 @@
 #include "application.h"
 #include <qapplication.h>
+#include <cstring>
+#include <stdexcept>
+#include <atomic>
+#include <cstdlib>
+#include <cerrno>
+#include <fstream>
+#include "matteserver.h"
+#include "framering.h"
+#include "parametersweep.h"
+#include "averagebackgroundcolourlocators.h"
+#include "fittingalgorithms.h"
+#include "coloursegmenters.h"
+#include "alphalocator.h"
+#include "taskscheduler.h"
+#include "io.h"
+
+using namespace anima::alg::primatte;
+
+/* The largest frame side and slot count accepted for --serve-ring. */
+const long MAX_RING_FRAME_SIDE = 16384;
+const long MAX_RING_SLOTS = 64;
+
+/** The sub-algorithms used by the service modes.
+    Models are saved with IAlgorithm::saveModel, so only these are set here. */
+struct ServiceAlgorithms
+{
+    anima::tasks::TaskScheduler scheduler;
+    StableFitting fitter;
+    DistanceColourSegmenter segmenter;
+    AlphaRayLocator alphaLocator;
+
+    ServiceAlgorithms() : scheduler(anima::tasks::TaskSchedulerDescriptor()), fitter(2, &scheduler),
+        segmenter(&scheduler), alphaLocator(&scheduler) {}
+
+    AlgorithmPrimatteDesc desc()
+    {
+        AlgorithmPrimatteDesc algDesc;
+        algDesc.scheduler = &scheduler;
+        algDesc.segmenter = &segmenter;
+        algDesc.alphaLocator = &alphaLocator;
+        algDesc.boundingPolyhedronDesc.fitter = &fitter;
+        algDesc.boundingPolyhedronDesc.phiFaces = 16;
+        algDesc.boundingPolyhedronDesc.thetaFaces = 8;
+        algDesc.boundingPolyhedronDesc.scaleMultiplier = 1.f;
+        algDesc.innerShrinkingThreshold = 0;
+        algDesc.innerShrinkingMinDistance = 0;
+        algDesc.innerPostShrinkingMultiplier = 1;
+        algDesc.outerExpansionStartThreshold = 0;
+        algDesc.outerExpandDelta = 0;
+        algDesc.outerScaleParameter = 1;
+        return algDesc;
+    }
+};
+
+/** Runs the matting service on the given socket until killed. */
+int runServer(const char* socketPath)
+{
+    try
+    {
+        ServiceAlgorithms algorithms;
+
+        anima::service::MatteServerDescriptor desc;
+        desc.socketPath = socketPath;
+        desc.algorithmDesc = algorithms.desc();
+
+        anima::service::MatteServer server(desc);
+        server.run();
+    }
+    catch(std::runtime_error& err)
+    {
+        Error(err.what());
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Parses a decimal command line argument, throwing std::runtime_error unless it is
+    an integer within [minimum, maximum]. */
+unsigned parseArgument(const char* text, const char* name, long minimum, long maximum)
+{
+    char* end = nullptr;
+    errno = 0;
+    const long value = strtol(text, &end, 10);
+
+    if(errno != 0 || end == text || *end != '\0' || value < minimum || value > maximum)
+        throw std::runtime_error(std::string("Invalid ") + name + " '" + text + "', expected " +
+                                 ToString(minimum) + " to " + ToString(maximum));
+
+    return value;
+}
+
+/** Computes the alphas of the CV_32FC3 frames written to a shared memory frame ring
+    with a single model until killed. */
+int runFrameRing(const char* name, const char* modelPath, unsigned cols, unsigned rows, unsigned slots)
+{
+    try
+    {
+        ServiceAlgorithms algorithms;
+        AlgorithmPrimatte algorithm(algorithms.desc());
+        algorithm.loadModel(modelPath);
+
+        anima::service::FrameRingDescriptor desc;
+        desc.name = name;
+        desc.create = true;
+        desc.slotCount = slots;
+        desc.maxCols = cols;
+        desc.maxRows = rows;
+        desc.frameType = CV_32FC3;
+
+        anima::service::FrameRing ring(desc);
+        Inform(std::string("Frame ring ") + name + " ready");
+
+        std::atomic<bool> running(true);
+        anima::service::serveFrameRing(ring, algorithm, running);
+    }
+    catch(std::runtime_error& err)
+    {
+        Error(err.what());
+        return 1;
+    }
+
+    return 0;
+}
+
+/** Analyses a grid of parameter variants around the previewer's defaults against one
+    assembled input, writing a CSV table and optionally alpha thumbnails. */
+int runSweep(const char* foregroundPath, const char* backgroundPath, const char* tablePath, const char* thumbnailDirectory)
+{
+    try
+    {
+        cv::Mat imageMat = cv::imread(foregroundPath);
+        cv::Mat backgroundMat = cv::imread(backgroundPath);
+        if(imageMat.data == nullptr || backgroundMat.data == nullptr)
+            throw std::runtime_error("Could not load images");
+
+        ServiceAlgorithms algorithms;
+        anima::ia::ABCL_HistogramBased backgroundLocator(32, 2, anima::ia::ABCL_HistogramBased::E_MODE,
+                                                         0.25f, &algorithms.scheduler);
+
+        anima::ia::InputAssemblerDescriptor iaDesc;
+        iaDesc.backgroundLocator = &backgroundLocator;
+        iaDesc.foregroundSource = &imageMat;
+        iaDesc.backgroundSource = &backgroundMat;
+        iaDesc.ipd.gridSize = 400;
+        iaDesc.targetColourspace = anima::ia::InputAssemblerDescriptor::ETCS_RGB;
+        iaDesc.scheduler = &algorithms.scheduler;
+
+        //Assembled once for every variant.
+        anima::ia::InputAssembler input(iaDesc);
+
+        AlgorithmPrimatteDesc base = algorithms.desc();
+        base.boundingPolyhedronDesc.scaleMultiplier = 1.2f;
+        base.innerShrinkingThreshold = 0.6f;
+        base.innerShrinkingMinDistance = 0.001f;
+        base.innerPostShrinkingMultiplier = 1.1f;
+        base.outerExpansionStartThreshold = 0.15f;
+        base.outerExpandDelta = 0.075f;
+        base.outerScaleParameter = 1.f;
+
+        ParameterSweepGrid grid;
+        grid.innerShrinkingThresholds = {0.4f, 0.6f, 0.8f};
+        grid.outerExpandDeltas = {0.05f, 0.075f, 0.1f};
+        grid.outerScaleParameters = {0.5f, 1.f};
+        grid.phiFaces = {16, 32};
+
+        StableFittingDescriptor coarseToFineDesc;
+        coarseToFineDesc.iterations = 4;
+        coarseToFineDesc.coarseLevels = 2;
+        coarseToFineDesc.decimation = 4;
+        coarseToFineDesc.refinementIterations = 1;
+        coarseToFineDesc.stopWhenSettled = true;
+        coarseToFineDesc.tolerance = 0.001f;
+        coarseToFineDesc.timeBudgetMs = 0;
+        StableFitting coarseToFineFitter(coarseToFineDesc, &algorithms.scheduler);
+
+        QuantileFittingDescriptor quantileDesc;
+        quantileDesc.outlierFraction = 0.01f;
+        quantileDesc.outlierCount = 0;
+        quantileDesc.buckets = 256;
+        QuantileFitting quantileFitter(quantileDesc, &algorithms.scheduler);
+
+        grid.fitters = {{"stable", &algorithms.fitter}, {"coarse-to-fine", &coarseToFineFitter},
+                        {"quantile", &quantileFitter}};
+
+        TextureAlphaLocatorDesc textureDesc;
+        textureDesc.resolution = 64;
+        TextureAlphaLocator textureLocator(textureDesc, &algorithms.scheduler);
+        grid.alphaLocators = {{"ray", &algorithms.alphaLocator}, {"texture", &textureLocator}};
+
+        ParameterSweepDescriptor desc;
+        desc.input = &input;
+        desc.variants = grid.variants(base, &desc.variantNames);
+        desc.scheduler = &algorithms.scheduler;
+        if(thumbnailDirectory)
+            desc.thumbnailDirectory = thumbnailDirectory;
+
+        ParameterSweep sweep(desc);
+        sweep.run();
+
+        std::ofstream table(tablePath);
+        sweep.writeTable(table);
+        if(!table)
+            throw std::runtime_error(std::string("Could not write ") + tablePath);
+    }
+    catch(std::runtime_error& err)
+    {
+        Error(err.what());
+        return 1;
+    }
+
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
+    // Service mode: Primatte --serve <socket path>
+    if(argc == 3 && strcmp(argv[1], "--serve") == 0)
+        return runServer(argv[2]);
+
+    // Shared memory mode: Primatte --serve-ring <shm name> <model> <max cols> <max rows> [slots]
+    if((argc == 6 || argc == 7) && strcmp(argv[1], "--serve-ring") == 0)
+    {
+        unsigned cols, rows, slots;
+        try
+        {
+            cols = parseArgument(argv[4], "column count", 1, MAX_RING_FRAME_SIDE);
+            rows = parseArgument(argv[5], "row count", 1, MAX_RING_FRAME_SIDE);
+            slots = argc == 7 ? parseArgument(argv[6], "slot count", 1, MAX_RING_SLOTS) : 4;
+        }
+        catch(std::runtime_error& err)
+        {
+            Error(err.what());
+            return 1;
+        }
+
+        return runFrameRing(argv[2], argv[3], cols, rows, slots);
+    }
+
+    // Parameter sweep: Primatte --sweep <foreground> <background> <table.csv> [thumbnail directory]
+    if((argc == 5 || argc == 6) && strcmp(argv[1], "--sweep") == 0)
+        return runSweep(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : nullptr);
+
     // Read command lines arguments.
     QApplication application(argc,argv);
 
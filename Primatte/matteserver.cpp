@@ -0,0 +1,516 @@
+#include "matteserver.h"
+#include "inputassembler.h"
+#include "io.h"
+#include <stdexcept>
+#include <system_error>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace anima
+{
+    namespace service
+    {
+        namespace
+        {
+            /* Reads exactly size bytes, returning false if the peer disconnected. */
+            bool readAll(int socket, void* data, size_t size)
+            {
+                char* bytes = (char*)data;
+                while(size > 0)
+                {
+                    ssize_t count = recv(socket, bytes, size, 0);
+                    if(count < 0 && errno == EINTR)
+                        continue;
+                    if(count <= 0)
+                        return false;
+                    bytes += count;
+                    size -= count;
+                }
+                return true;
+            }
+
+            /* Writes exactly size bytes, returning false if the peer disconnected. */
+            bool writeAll(int socket, const void* data, size_t size)
+            {
+                const char* bytes = (const char*)data;
+                while(size > 0)
+                {
+                    ssize_t count = send(socket, bytes, size, MSG_NOSIGNAL);
+                    if(count < 0 && errno == EINTR)
+                        continue;
+                    if(count <= 0)
+                        return false;
+                    bytes += count;
+                    size -= count;
+                }
+                return true;
+            }
+
+            /* Sends a reply header followed by a message. */
+            bool writeReply(int socket, uint32_t status, uint32_t transport,
+                            uint32_t rows, uint32_t cols, const std::string& message)
+            {
+                MatteReplyHeader reply;
+                reply.magic = MATTE_PROTOCOL_MAGIC;
+                reply.status = status;
+                reply.transport = transport;
+                reply.rows = rows;
+                reply.cols = cols;
+                reply.messageLength = message.size();
+
+                return writeAll(socket, &reply, sizeof(reply)) &&
+                        writeAll(socket, message.data(), message.size());
+            }
+
+            sockaddr_un socketAddress(const std::string& path)
+            {
+                sockaddr_un address;
+                memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+
+                if(path.size() >= sizeof(address.sun_path))
+                    throw std::runtime_error("Socket path too long: " + path);
+
+                strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path)-1);
+                return address;
+            }
+        }
+
+        MatteServer::MatteServer(const MatteServerDescriptor& desc)
+            : mListenSocket(-1), mRunning(false), mLatencyCount(0)
+        {
+            if(desc.latencyWindow == 0)
+                throw std::runtime_error("Empty latency window");
+
+            if(desc.maxModelPathLength == 0 || desc.maxFramePixels == 0)
+                throw std::runtime_error("Matte server request limits must be positive");
+
+            //Validate the algorithm descriptor
+            alg::primatte::AlgorithmPrimatte algorithm(desc.algorithmDesc);
+
+            mDesc = desc;
+            mLatencies.resize(desc.latencyWindow);
+
+            sockaddr_un address = socketAddress(desc.socketPath);
+
+            mListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(mListenSocket < 0)
+                throw std::runtime_error("Could not create server socket");
+
+            unlink(desc.socketPath.c_str());
+
+            if(bind(mListenSocket, (sockaddr*)&address, sizeof(address)) != 0 ||
+               listen(mListenSocket, 16) != 0)
+            {
+                close(mListenSocket);
+                throw std::runtime_error("Could not listen on " + desc.socketPath);
+            }
+
+            mRunning = true;
+            Inform("Matte server listening on " + desc.socketPath);
+        }
+
+        MatteServer::~MatteServer()
+        {
+            stop();
+
+            {
+                std::unique_lock<std::mutex> lock(mConnectionsMutex);
+                mConnectionClosed.wait(lock, [this]() { return mConnections.empty(); });
+            }
+
+            close(mListenSocket);
+            unlink(mDesc.socketPath.c_str());
+        }
+
+        void MatteServer::run()
+        {
+            unsigned connectionId = 0;
+
+            while(mRunning)
+            {
+                int connection = accept(mListenSocket, nullptr, nullptr);
+                if(connection < 0)
+                {
+                    if(errno == EINTR)
+                        continue;
+                    break;
+                }
+
+                std::lock_guard<std::mutex> lock(mConnectionsMutex);
+                if(!mRunning)
+                {
+                    close(connection);
+                    break;
+                }
+
+                mConnections.push_back(connection);
+                try
+                {
+                    std::thread(&MatteServer::serveConnection, this, connection, connectionId++).detach();
+                }
+                catch(const std::system_error&)
+                {
+                    mConnections.pop_back();
+                    close(connection);
+                    Warning("Matte server: could not start a thread for a client");
+                }
+            }
+        }
+
+        void MatteServer::stop()
+        {
+            mRunning = false;
+
+            //Unblocks accept() and any blocking reads.
+            shutdown(mListenSocket, SHUT_RDWR);
+
+            std::lock_guard<std::mutex> lock(mConnectionsMutex);
+            for(auto it = mConnections.begin(); it != mConnections.end(); ++it)
+                shutdown(*it, SHUT_RDWR);
+        }
+
+        std::shared_ptr<alg::IAlgorithm> MatteServer::model(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mModelsMutex);
+
+            auto it = mModels.find(path);
+            if(it != mModels.end())
+                return it->second;
+
+            std::shared_ptr<alg::IAlgorithm> algorithm(new alg::primatte::AlgorithmPrimatte(mDesc.algorithmDesc));
+            algorithm->loadModel(path);
+            mModels[path] = algorithm;
+
+            Inform("Matte server loaded model " + path);
+            return algorithm;
+        }
+
+        void MatteServer::serveConnection(int socket, unsigned id)
+        {
+            Inform("Matte server: client " + ToString(id) + " connected");
+
+            //Buffers kept for the lifetime of the connection.
+            std::vector<unsigned char> frameBuffer;
+            std::string modelPath;
+            std::vector<cv::Mat> frames(1), alphas(1);
+            cv::Mat inlineAlpha;
+
+            //The shared memory reply, grown as needed.
+            const std::string sharedName = "/primatte-" + ToString(getpid()) + "-" + ToString(id);
+            int sharedFd = -1;
+            void* shared = nullptr;
+            size_t sharedSize = 0;
+
+            while(mRunning)
+            {
+                MatteRequestHeader request;
+                if(!readAll(socket, &request, sizeof(request)))
+                    break;
+
+                auto start = std::chrono::steady_clock::now();
+
+                if(request.magic != MATTE_PROTOCOL_MAGIC)
+                {
+                    Warning("Matte server: dropping client " + ToString(id) + " after a malformed request");
+                    break;
+                }
+
+                //The sizes come from the client, so they are checked before anything is allocated.
+                //The rest of an oversized request can't be skipped safely, so the client is dropped.
+                if(request.modelPathLength > mDesc.maxModelPathLength)
+                {
+                    writeReply(socket, 1, EMT_INLINE, 0, 0, "Model path too long");
+                    break;
+                }
+
+                modelPath.resize(request.modelPathLength);
+                if(!readAll(socket, &modelPath[0], modelPath.size()))
+                    break;
+
+                if(request.type == EMR_STATS)
+                {
+                    if(!writeReply(socket, 0, EMT_INLINE, 0, 0, latencyReport()))
+                        break;
+                    continue;
+                }
+
+                //Without a valid format the frame size is unknown, so the stream can't be recovered.
+                if(request.type != EMR_ALPHA || (request.cvType != CV_8UC3 &&
+                   request.cvType != CV_16UC3 && request.cvType != CV_32FC3))
+                {
+                    writeReply(socket, 1, EMT_INLINE, 0, 0, "Unsupported request or frame format");
+                    break;
+                }
+
+                if(request.rows == 0 || request.cols == 0)
+                {
+                    writeReply(socket, 1, EMT_INLINE, 0, 0, "Empty frame");
+                    break;
+                }
+
+                //The product of the 32 bit sizes can't overflow, and OpenCV needs each to fit an int.
+                const uint64_t pixels = uint64_t(request.rows)*request.cols;
+                if(pixels > mDesc.maxFramePixels || request.rows > INT_MAX || request.cols > INT_MAX ||
+                   pixels > SIZE_MAX/CV_ELEM_SIZE(request.cvType))
+                {
+                    writeReply(socket, 1, EMT_INLINE, 0, 0, "Frame too large");
+                    break;
+                }
+
+                frameBuffer.resize(size_t(pixels)*CV_ELEM_SIZE(request.cvType));
+                if(!readAll(socket, frameBuffer.data(), frameBuffer.size()))
+                    break;
+
+                try
+                {
+                    std::shared_ptr<alg::IAlgorithm> algorithm = model(modelPath);
+
+                    frames[0] = cv::Mat(request.rows, request.cols, request.cvType, frameBuffer.data());
+
+                    const size_t alphaSize = size_t(request.rows)*request.cols*sizeof(float);
+                    const bool useShared = request.transport == EMT_SHARED_MEMORY;
+
+                    if(useShared)
+                    {
+                        if(sharedFd < 0)
+                        {
+                            sharedFd = shm_open(sharedName.c_str(), O_CREAT | O_RDWR, 0600);
+                            if(sharedFd < 0)
+                                throw std::runtime_error("Could not create shared memory " + sharedName);
+                        }
+
+                        if(alphaSize > sharedSize)
+                        {
+                            if(shared)
+                                munmap(shared, sharedSize);
+                            shared = nullptr;
+
+                            if(ftruncate(sharedFd, alphaSize) != 0)
+                                throw std::runtime_error("Could not resize shared memory " + sharedName);
+
+                            shared = mmap(nullptr, alphaSize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedFd, 0);
+                            if(shared == MAP_FAILED)
+                            {
+                                shared = nullptr;
+                                sharedSize = 0;
+                                throw std::runtime_error("Could not map shared memory " + sharedName);
+                            }
+                            sharedSize = alphaSize;
+                        }
+
+                        //The alpha is written straight into the shared memory.
+                        alphas[0] = cv::Mat(request.rows, request.cols, CV_32FC1, shared);
+                    }
+                    else
+                        alphas[0] = inlineAlpha;
+
+                    algorithm->computeAlphas(frames, alphas);
+
+                    bool written;
+                    if(useShared)
+                        written = writeReply(socket, 0, EMT_SHARED_MEMORY, request.rows, request.cols, sharedName);
+                    else
+                    {
+                        inlineAlpha = alphas[0];
+                        written = writeReply(socket, 0, EMT_INLINE, request.rows, request.cols, std::string());
+                        for(int r = 0; written && r < inlineAlpha.rows; ++r)
+                            written = writeAll(socket, inlineAlpha.data + inlineAlpha.step*r,
+                                               inlineAlpha.cols*sizeof(float));
+                    }
+
+                    if(!written)
+                        break;
+                }
+                catch(std::exception& err)
+                {
+                    if(!writeReply(socket, 1, EMT_INLINE, 0, 0, err.what()))
+                        break;
+                }
+
+                recordLatency(std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - start).count());
+            }
+
+            if(shared)
+                munmap(shared, sharedSize);
+            if(sharedFd >= 0)
+            {
+                close(sharedFd);
+                shm_unlink(sharedName.c_str());
+            }
+
+            Inform("Matte server: client " + ToString(id) + " disconnected. " + latencyReport());
+
+            //The last use of the server, as the destructor may proceed once the connection is removed.
+            std::lock_guard<std::mutex> lock(mConnectionsMutex);
+            mConnections.erase(std::remove(mConnections.begin(), mConnections.end(), socket), mConnections.end());
+            close(socket);
+            mConnectionClosed.notify_all();
+        }
+
+        void MatteServer::recordLatency(uint32_t microseconds)
+        {
+            size_t count;
+            {
+                std::lock_guard<std::mutex> lock(mLatencyMutex);
+                mLatencies[mLatencyCount % mLatencies.size()] = microseconds;
+                count = ++mLatencyCount;
+            }
+
+            if(count % 100 == 0)
+                Inform("Matte server: " + latencyReport());
+        }
+
+        float MatteServer::latencyPercentile(float percentile)
+        {
+            std::vector<uint32_t> samples;
+            {
+                std::lock_guard<std::mutex> lock(mLatencyMutex);
+                samples.assign(mLatencies.begin(), mLatencies.begin() + std::min(mLatencyCount, mLatencies.size()));
+            }
+
+            if(samples.empty())
+                return 0.f;
+
+            size_t index = std::min(samples.size()-1, size_t(percentile/100.f*samples.size()));
+            std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+            return samples[index]/1000.f;
+        }
+
+        std::string MatteServer::latencyReport()
+        {
+            size_t count;
+            {
+                std::lock_guard<std::mutex> lock(mLatencyMutex);
+                count = mLatencyCount;
+            }
+
+            return ToString(count) + " requests, latency p50 " + ToString(latencyPercentile(50)) +
+                    " ms, p99 " + ToString(latencyPercentile(99)) + " ms";
+        }
+
+        MatteClient::MatteClient(const std::string& socketPath)
+            : mShared(nullptr), mSharedSize(0)
+        {
+            sockaddr_un address = socketAddress(socketPath);
+
+            mSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(mSocket < 0)
+                throw std::runtime_error("Could not create client socket");
+
+            if(connect(mSocket, (sockaddr*)&address, sizeof(address)) != 0)
+            {
+                close(mSocket);
+                throw std::runtime_error("Could not connect to " + socketPath);
+            }
+        }
+
+        MatteClient::~MatteClient()
+        {
+            unmapShared();
+            close(mSocket);
+        }
+
+        void MatteClient::unmapShared()
+        {
+            if(mShared)
+                munmap(mShared, mSharedSize);
+            mShared = nullptr;
+            mSharedSize = 0;
+        }
+
+        void MatteClient::computeAlpha(const std::string& modelPath, const cv::Mat& frame,
+                                       cv::Mat& alpha, MatteTransport transport)
+        {
+            MatteRequestHeader request;
+            request.magic = MATTE_PROTOCOL_MAGIC;
+            request.type = EMR_ALPHA;
+            request.transport = transport;
+            request.rows = frame.rows;
+            request.cols = frame.cols;
+            request.cvType = frame.type();
+            request.modelPathLength = modelPath.size();
+
+            bool written = writeAll(mSocket, &request, sizeof(request)) &&
+                    writeAll(mSocket, modelPath.data(), modelPath.size());
+            for(int r = 0; written && r < frame.rows; ++r)
+                written = writeAll(mSocket, frame.data + frame.step*r, frame.cols*frame.elemSize());
+
+            MatteReplyHeader reply;
+            if(!written || !readAll(mSocket, &reply, sizeof(reply)) || reply.magic != MATTE_PROTOCOL_MAGIC)
+                throw std::runtime_error("Lost connection to the matte server");
+
+            std::string message(reply.messageLength, '\0');
+            if(!readAll(mSocket, &message[0], message.size()))
+                throw std::runtime_error("Lost connection to the matte server");
+
+            if(reply.status != 0)
+                throw std::runtime_error("Matte server error: " + message);
+
+            const size_t alphaSize = size_t(reply.rows)*reply.cols*sizeof(float);
+
+            if(reply.transport == EMT_INLINE)
+            {
+                alpha.create(reply.rows, reply.cols, CV_32FC1);
+                for(int r = 0; r < alpha.rows; ++r)
+                    if(!readAll(mSocket, alpha.data + alpha.step*r, alpha.cols*sizeof(float)))
+                        throw std::runtime_error("Lost connection to the matte server");
+                return;
+            }
+
+            //Remap if the server grew or replaced the shared memory.
+            if(message != mSharedName || alphaSize > mSharedSize)
+            {
+                unmapShared();
+
+                int fd = shm_open(message.c_str(), O_RDONLY, 0);
+                if(fd < 0)
+                    throw std::runtime_error("Could not open shared memory " + message);
+
+                mShared = mmap(nullptr, alphaSize, PROT_READ, MAP_SHARED, fd, 0);
+                close(fd);
+
+                if(mShared == MAP_FAILED)
+                {
+                    mShared = nullptr;
+                    throw std::runtime_error("Could not map shared memory " + message);
+                }
+
+                mSharedSize = alphaSize;
+                mSharedName = message;
+            }
+
+            alpha = cv::Mat(reply.rows, reply.cols, CV_32FC1, mShared);
+        }
+
+        std::string MatteClient::stats()
+        {
+            MatteRequestHeader request;
+            memset(&request, 0, sizeof(request));
+            request.magic = MATTE_PROTOCOL_MAGIC;
+            request.type = EMR_STATS;
+
+            MatteReplyHeader reply;
+            if(!writeAll(mSocket, &request, sizeof(request)) ||
+               !readAll(mSocket, &reply, sizeof(reply)) || reply.magic != MATTE_PROTOCOL_MAGIC)
+                throw std::runtime_error("Lost connection to the matte server");
+
+            std::string message(reply.messageLength, '\0');
+            if(!readAll(mSocket, &message[0], message.size()))
+                throw std::runtime_error("Lost connection to the matte server");
+
+            return message;
+        }
+    }
+}
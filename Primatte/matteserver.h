@@ -0,0 +1,189 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include "algorithmprimatte.h"
+
+/**
+  * A long-running matting service. Models saved with IAlgorithm::saveModel are loaded
+  * on first use and stay resident, and frames are sent to it over a local Unix domain
+  * socket by any number of concurrent clients, avoiding the process start, input assembly
+  * and fitting costs per frame.
+  *
+  * The protocol is a sequence of request/reply pairs on a stream socket:
+  *   Request: MatteRequestHeader, the model path, then the frame rows (rows*cols*elemSize bytes).
+  *   Reply: MatteReplyHeader, then either the message (on error), the CV_32FC1 alpha rows
+  *          (inline transport), or the name of a POSIX shared memory object holding them.
+  */
+
+namespace anima
+{
+    namespace service
+    {
+        /** Identifies requests and replies. */
+        const uint32_t MATTE_PROTOCOL_MAGIC = 0x4d54544d;
+
+        /** The request types. */
+        enum MatteRequestType
+        {
+            /* Computes the alpha of a frame. */
+            EMR_ALPHA,
+
+            /* Returns the latency statistics as the message. */
+            EMR_STATS
+        };
+
+        /** How the alpha is returned. */
+        enum MatteTransport
+        {
+            /* The alpha follows the reply header on the socket. */
+            EMT_INLINE,
+
+            /* The alpha is written into a shared memory object owned by the connection,
+             * whose name follows the reply header. It stays valid until the next request. */
+            EMT_SHARED_MEMORY
+        };
+
+        struct MatteRequestHeader
+        {
+            uint32_t magic;
+            uint32_t type;
+            uint32_t transport;
+            uint32_t rows, cols;
+
+            /* The OpenCV type of the frame. CV_8UC3, CV_16UC3 and CV_32FC3 are supported. */
+            int32_t cvType;
+
+            uint32_t modelPathLength;
+        };
+
+        struct MatteReplyHeader
+        {
+            uint32_t magic;
+
+            /* 0 upon success. Otherwise the message holds the error. */
+            uint32_t status;
+            uint32_t transport;
+            uint32_t rows, cols;
+
+            /* The length of the message or the shared memory name. */
+            uint32_t messageLength;
+        };
+
+        /** The descriptor of the server. */
+        struct MatteServerDescriptor
+        {
+            /* The path of the Unix domain socket to listen on. Replaced if it exists. */
+            std::string socketPath;
+
+            /* Used to create an algorithm for each model. Only the sub-algorithms are used,
+             * as the parameters are replaced by the ones stored in the model. */
+            alg::primatte::AlgorithmPrimatteDesc algorithmDesc;
+
+            /* The number of latency samples kept for the percentiles. */
+            size_t latencyWindow;
+
+            /* The longest model path accepted. Must be positive. */
+            uint32_t maxModelPathLength;
+
+            /* The most pixels accepted in a frame. Must be positive.
+             * Clients sending longer paths, or empty or larger frames, are disconnected before anything is allocated. */
+            uint64_t maxFramePixels;
+
+            MatteServerDescriptor() : latencyWindow(4096), maxModelPathLength(4096), maxFramePixels(8192*8192) {}
+        };
+
+        /** The matting server. */
+        class MatteServer
+        {
+            MatteServerDescriptor mDesc;
+
+            int mListenSocket;
+            std::atomic<bool> mRunning;
+
+            /* The resident models, by path. */
+            std::map<std::string, std::shared_ptr<alg::IAlgorithm> > mModels;
+            std::mutex mModelsMutex;
+
+            /* The open connections. Each is served by a detached thread, which removes it once
+             * done, so that finished threads do not accumulate. */
+            std::vector<int> mConnections;
+            std::mutex mConnectionsMutex;
+
+            /* Signalled whenever a connection closes. */
+            std::condition_variable mConnectionClosed;
+
+            /* A ring of the most recent request latencies in microseconds. */
+            std::vector<uint32_t> mLatencies;
+            size_t mLatencyCount;
+            std::mutex mLatencyMutex;
+
+            /** Returns the model at the path, loading it if needed. */
+            std::shared_ptr<alg::IAlgorithm> model(const std::string& path);
+
+            /** Serves a single client until it disconnects. */
+            void serveConnection(int socket, unsigned id);
+
+            /** Records a request latency. */
+            void recordLatency(uint32_t microseconds);
+
+        public:
+
+            /** Creates the listening socket, throwing std::runtime_error upon failure. */
+            MatteServer(const MatteServerDescriptor& desc);
+
+            /** Stops the server and waits for the connections to close. */
+            ~MatteServer();
+
+            /** Accepts clients until stop() is called, serving each on its own thread. */
+            void run();
+
+            /** Makes run() return and disconnects the clients. Safe to call from any thread. */
+            void stop();
+
+            /** Returns the given latency percentile (0-100) over the recent requests in milliseconds. */
+            float latencyPercentile(float percentile);
+
+            /** Returns a line with the request count and the p50/p99 latencies. */
+            std::string latencyReport();
+        };
+
+        /** A client of the matting server. */
+        class MatteClient
+        {
+            int mSocket;
+
+            /* The mapping of the shared memory reply. */
+            void* mShared;
+            size_t mSharedSize;
+            std::string mSharedName;
+
+            MatteClient(const MatteClient&);
+            MatteClient& operator=(const MatteClient&);
+
+            void unmapShared();
+
+        public:
+
+            /** Connects to the server, throwing std::runtime_error upon failure. */
+            MatteClient(const std::string& socketPath);
+            ~MatteClient();
+
+            /** Computes the alpha of a frame with the model at modelPath (as seen by the server).
+              * With EMT_SHARED_MEMORY, alpha is a view of the shared memory, which stays valid
+              * until the next request. Throws std::runtime_error upon failure. */
+            void computeAlpha(const std::string& modelPath, const cv::Mat& frame,
+                              cv::Mat& alpha, MatteTransport transport = EMT_SHARED_MEMORY);
+
+            /** Returns the latency report of the server. */
+            std::string stats();
+        };
+    }
+}
@@ -0,0 +1,53 @@
+#include "modelfile.h"
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace anima
+{
+    namespace alg
+    {
+        namespace primatte
+        {
+            MappedFile::MappedFile(const std::string& path)
+                : mData(nullptr), mSize(0)
+            {
+                int fd = open(path.c_str(), O_RDONLY);
+                if(fd < 0)
+                    throw std::runtime_error("Could not open model file " + path);
+
+                struct stat info;
+                if(fstat(fd, &info) != 0 || info.st_size == 0)
+                {
+                    close(fd);
+                    throw std::runtime_error("Could not read model file " + path);
+                }
+
+                mSize = info.st_size;
+                mData = mmap(nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                //The mapping stays valid after closing the descriptor.
+                close(fd);
+
+                if(mData == MAP_FAILED)
+                {
+                    mData = nullptr;
+                    throw std::runtime_error("Could not map model file " + path);
+                }
+            }
+
+            MappedFile::~MappedFile()
+            {
+                if(mData)
+                    munmap(mData, mSize);
+            }
+
+            void MappedFile::throwOutOfBounds()
+            {
+                throw std::runtime_error("Truncated or corrupt model file");
+            }
+        }
+    }
+}
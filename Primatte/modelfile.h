@@ -0,0 +1,103 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+  * The binary format of a fitted model, as written by IAlgorithm::saveModel, and a
+  * read-only memory mapping used to load it.
+  * The layout, in native byte order with all offsets from the start of the file:
+  *   ModelFileHeader
+  *   ModelFilePolyhedron[polyhedronCount], starting at polyhedronOffset
+  *   The vertex (3 floats) and plane (4 floats) arrays referenced by the polyhedron entries.
+  * Arrays are aligned to 16 bytes. Files with a different version are rejected.
+  */
+
+namespace anima
+{
+    namespace alg
+    {
+        namespace primatte
+        {
+            /** Identifies a model file. */
+            const char MODEL_FILE_MAGIC[8] = {'P','R','M','T','M','O','D','L'};
+
+            /** Incremented whenever the layout changes. */
+            const uint32_t MODEL_FILE_VERSION = 1;
+
+            /** The file header. */
+            struct ModelFileHeader
+            {
+                char magic[8];
+                uint32_t version;
+
+                /* sizeof(ModelFileHeader), as a sanity check. */
+                uint32_t headerSize;
+
+                /* The InputAssemblerDescriptor::TargetColourspace of the analysed input. */
+                uint32_t colourSpace;
+
+                /* The background point in that colour space. */
+                float background[3];
+
+                /* The AlgorithmPrimatteDesc parameters the model was fitted with. */
+                float innerShrinkingThreshold;
+                float innerShrinkingMinDistance;
+                float innerPostShrinkingMultiplier;
+                float outerExpansionStartThreshold;
+                float outerExpandDelta;
+                float outerScaleParameter;
+                int32_t phiFaces;
+                int32_t thetaFaces;
+                float scaleMultiplier;
+
+                /* The polyhedra, in inner->outer order. */
+                uint32_t polyhedronCount;
+                uint64_t polyhedronOffset;
+            };
+
+            /** A polyhedron entry. */
+            struct ModelFilePolyhedron
+            {
+                int32_t phiFaces;
+                int32_t thetaFaces;
+                float centre[3];
+                float radius;
+
+                uint32_t vertexCount;
+                uint32_t planeCount;
+                uint64_t vertexOffset;
+                uint64_t planeOffset;
+            };
+
+            /** Maps a file into memory read-only, throwing std::runtime_error upon failure. */
+            class MappedFile
+            {
+                void* mData;
+                size_t mSize;
+
+                MappedFile(const MappedFile&);
+                MappedFile& operator=(const MappedFile&);
+
+            public:
+                MappedFile(const std::string& path);
+                ~MappedFile();
+
+                const unsigned char* data() const { return (const unsigned char*)mData; }
+                size_t size() const { return mSize; }
+
+                /** Returns a pointer to count objects at offset, throwing if they are out of bounds. */
+                template <class T>
+                const T* at(uint64_t offset, size_t count = 1) const
+                {
+                    if(offset > mSize || count > (mSize - offset)/sizeof(T))
+                        throwOutOfBounds();
+                    return (const T*)(data() + offset);
+                }
+
+            private:
+                static void throwOutOfBounds();
+            };
+        }
+    }
+}
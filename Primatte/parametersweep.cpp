@@ -0,0 +1,287 @@
+#include "parametersweep.h"
+#include "io.h"
+#include "taskscheduler.h"
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <opencv2/opencv.hpp>
+
+namespace anima
+{
+    namespace alg
+    {
+        namespace primatte
+        {
+            namespace
+            {
+                double millisecondsSince(std::chrono::steady_clock::time_point start)
+                {
+                    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                }
+
+                /* Measures an alpha over the processed pixels of the input. */
+                void measure(const cv::Mat& alpha, const ia::InputAssembler& input,
+                             const cv::Mat* reference, ParameterSweepResult& result)
+                {
+                    const cv::Mat& mask = input.mask();
+                    const cv::Rect bounds = input.maskBounds();
+
+                    size_t count = 0, transparent = 0, opaque = 0;
+                    double sum = 0, error = 0;
+
+                    for(int r = bounds.y; r < bounds.y + bounds.height; ++r)
+                    {
+                        const float* a = alpha.ptr<float>(r);
+                        const float* ref = reference ? reference->ptr<float>(r) : nullptr;
+                        const unsigned char* m = mask.empty() ? nullptr : mask.ptr<unsigned char>(r);
+
+                        for(int c = bounds.x; c < bounds.x + bounds.width; ++c)
+                        {
+                            if(m && !m[c])
+                                continue;
+
+                            ++count;
+                            sum += a[c];
+                            transparent += a[c] <= 0.f;
+                            opaque += a[c] >= 1.f;
+                            if(ref)
+                                error += std::abs(a[c] - ref[c]);
+                        }
+                    }
+
+                    const float invCount = count ? 1.f/count : 0.f;
+                    result.transparent = transparent*invCount;
+                    result.opaque = opaque*invCount;
+                    result.mixed = (count - transparent - opaque)*invCount;
+                    result.meanAlpha = sum*invCount;
+                    result.referenceError = reference ? error*invCount : -1.f;
+                }
+
+                /* Quotes a CSV field, doubling the quotes within it. */
+                std::string quoteCsv(const std::string& field)
+                {
+                    std::string quoted = "\"";
+                    for(size_t i = 0; i < field.size(); ++i)
+                    {
+                        if(field[i] == '"')
+                            quoted += '"';
+                        quoted += field[i];
+                    }
+                    return quoted + '"';
+                }
+
+                /* Runs a range of variants. */
+                class SweepBody : public cv::ParallelLoopBody
+                {
+                    const ParameterSweepDescriptor& mDesc;
+                    std::vector<ParameterSweepResult>& mResults;
+
+                public:
+                    SweepBody(const ParameterSweepDescriptor& desc, std::vector<ParameterSweepResult>& results)
+                        : mDesc(desc), mResults(results) {}
+
+                    virtual void operator()(const cv::Range& range) const
+                    {
+                        for(int i = range.start; i < range.end; ++i)
+                        {
+                            ParameterSweepResult& result = mResults[i];
+
+                            try
+                            {
+                                AlgorithmPrimatte algorithm(result.desc);
+                                algorithm.setInput(mDesc.input);
+
+                                auto start = std::chrono::steady_clock::now();
+                                algorithm.analyse();
+                                result.analyseTime = millisecondsSince(start);
+
+                                start = std::chrono::steady_clock::now();
+                                cv::Mat alpha = algorithm.computeAlphas();
+                                result.alphaTime = millisecondsSince(start);
+
+                                measure(alpha, *mDesc.input, mDesc.referenceAlpha, result);
+
+                                if(!mDesc.thumbnailDirectory.empty())
+                                {
+                                    const int width = mDesc.thumbnailWidth;
+                                    const int height = std::max(1, alpha.rows*width/alpha.cols);
+
+                                    cv::Mat thumbnail, thumbnail8;
+                                    cv::resize(alpha, thumbnail, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+                                    thumbnail.convertTo(thumbnail8, CV_8UC1, 255.0);
+
+                                    const std::string path = mDesc.thumbnailDirectory + "/variant_" + ToString(i) + ".png";
+                                    if(!cv::imwrite(path, thumbnail8))
+                                        throw std::runtime_error("Could not write " + path);
+                                }
+                            }
+                            catch(std::exception& err)
+                            {
+                                result.error = err.what();
+                            }
+                        }
+                    }
+                };
+            }
+
+            std::vector<AlgorithmPrimatteDesc> ParameterSweepGrid::variants(const AlgorithmPrimatteDesc& base,
+                                                                           std::vector<std::string>* names) const
+            {
+                //An empty list stands for the base value.
+                auto orBase = [](const std::vector<float>& values, float value)
+                {
+                    return values.empty() ? std::vector<float>(1, value) : values;
+                };
+
+                const std::vector<float> thresholds = orBase(innerShrinkingThresholds, base.innerShrinkingThreshold);
+                const std::vector<float> deltas = orBase(outerExpandDeltas, base.outerExpandDelta);
+                const std::vector<float> scales = orBase(outerScaleParameters, base.outerScaleParameter);
+                const std::vector<int> faces = phiFaces.empty() ?
+                            std::vector<int>(1, base.boundingPolyhedronDesc.phiFaces) : phiFaces;
+
+                const std::vector<std::pair<std::string, IFittingAlgorithm*> > fitting = fitters.empty() ?
+                            std::vector<std::pair<std::string, IFittingAlgorithm*> >(1, std::make_pair(std::string(), base.boundingPolyhedronDesc.fitter)) :
+                            fitters;
+                const std::vector<std::pair<std::string, IAlphaLocator*> > locators = alphaLocators.empty() ?
+                            std::vector<std::pair<std::string, IAlphaLocator*> >(1, std::make_pair(std::string(), base.alphaLocator)) :
+                            alphaLocators;
+
+                for(size_t f = 0; f < phiFaces.size(); ++f)
+                    if(phiFaces[f] <= 3)
+                        throw std::runtime_error("Sweep phi faces must be greater than 3");
+
+                for(size_t i = 0; i < fitters.size(); ++i)
+                    if(!fitters[i].second)
+                        throw std::runtime_error("Null sweep fitter");
+
+                for(size_t l = 0; l < alphaLocators.size(); ++l)
+                    if(!alphaLocators[l].second)
+                        throw std::runtime_error("Null sweep alpha locator");
+
+                std::vector<AlgorithmPrimatteDesc> result;
+                if(names)
+                    names->clear();
+
+                for(size_t i = 0; i < fitting.size(); ++i)
+                    for(size_t l = 0; l < locators.size(); ++l)
+                    {
+                        std::string name = fitting[i].first;
+                        if(!name.empty() && !locators[l].first.empty())
+                            name += '/';
+                        name += locators[l].first;
+
+                        for(size_t f = 0; f < faces.size(); ++f)
+                            for(size_t t = 0; t < thresholds.size(); ++t)
+                                for(size_t d = 0; d < deltas.size(); ++d)
+                                    for(size_t s = 0; s < scales.size(); ++s)
+                                    {
+                                        AlgorithmPrimatteDesc desc = base;
+                                        desc.boundingPolyhedronDesc.fitter = fitting[i].second;
+                                        desc.alphaLocator = locators[l].second;
+                                        if(!phiFaces.empty())
+                                        {
+                                            desc.boundingPolyhedronDesc.phiFaces = faces[f];
+                                            desc.boundingPolyhedronDesc.thetaFaces = std::max(3, faces[f]/2);
+                                        }
+                                        desc.innerShrinkingThreshold = thresholds[t];
+                                        desc.outerExpandDelta = deltas[d];
+                                        desc.outerScaleParameter = scales[s];
+                                        result.push_back(desc);
+
+                                        if(names)
+                                            names->push_back(name);
+                                    }
+                    }
+
+                return result;
+            }
+
+            ParameterSweep::ParameterSweep(const ParameterSweepDescriptor& desc)
+            {
+                if(!desc.input)
+                    throw std::runtime_error("Null sweep input");
+
+                if(desc.variants.empty())
+                    throw std::runtime_error("No sweep variants");
+
+                if(!desc.variantNames.empty() && desc.variantNames.size() != desc.variants.size())
+                    throw std::runtime_error("The sweep needs a name for every variant, or none");
+
+                if(desc.referenceAlpha)
+                {
+                    const cv::Mat& foreground = desc.input->mat();
+                    if(desc.referenceAlpha->type() != CV_32FC1 ||
+                       desc.referenceAlpha->rows != foreground.rows || desc.referenceAlpha->cols != foreground.cols)
+                        throw std::runtime_error("The reference alpha must be CV_32FC1 of the input size");
+                }
+
+                if(!desc.thumbnailDirectory.empty() && desc.thumbnailWidth == 0)
+                    throw std::runtime_error("Empty sweep thumbnails");
+
+                mDesc = desc;
+            }
+
+            const std::vector<ParameterSweepResult>& ParameterSweep::run()
+            {
+                START_TIMER(ParameterSweep);
+
+                mResults.assign(mDesc.variants.size(), ParameterSweepResult());
+                for(size_t i = 0; i < mResults.size(); ++i)
+                {
+                    mResults[i].desc = mDesc.variants[i];
+                    if(!mDesc.variantNames.empty())
+                        mResults[i].name = mDesc.variantNames[i];
+                    mResults[i].analyseTime = mResults[i].alphaTime = 0;
+                    mResults[i].transparent = mResults[i].opaque = mResults[i].mixed = mResults[i].meanAlpha = 0;
+                    mResults[i].referenceError = -1;
+                }
+
+                //One variant per task, as their analysis times vary widely.
+                SweepBody body(mDesc, mResults);
+                if(mDesc.scheduler)
+                {
+                    mDesc.scheduler->parallelFor(0, mResults.size(), 1, [&body](size_t begin, size_t end)
+                    {
+                        body(cv::Range(begin, end));
+                    });
+                }
+                else
+                    cv::parallel_for_(cv::Range(0, (int)mResults.size()), body, (double)mResults.size());
+
+                END_TIMER(ParameterSweep);
+                return mResults;
+            }
+
+            const std::vector<ParameterSweepResult>& ParameterSweep::results() const
+            {
+                return mResults;
+            }
+
+            void ParameterSweep::writeTable(std::ostream& out) const
+            {
+                out << "variant,name,phiFaces,thetaFaces,innerShrinkingThreshold,outerExpandDelta,outerScaleParameter,"
+                       "analyseMs,alphaMs,transparent,opaque,mixed,meanAlpha,referenceError,error\n";
+
+                for(size_t i = 0; i < mResults.size(); ++i)
+                {
+                    const ParameterSweepResult& r = mResults[i];
+                    out << i << ','
+                        << quoteCsv(r.name) << ','
+                        << r.desc.boundingPolyhedronDesc.phiFaces << ','
+                        << r.desc.boundingPolyhedronDesc.thetaFaces << ','
+                        << r.desc.innerShrinkingThreshold << ','
+                        << r.desc.outerExpandDelta << ','
+                        << r.desc.outerScaleParameter << ','
+                        << r.analyseTime << ','
+                        << r.alphaTime << ','
+                        << r.transparent << ','
+                        << r.opaque << ','
+                        << r.mixed << ','
+                        << r.meanAlpha << ','
+                        << r.referenceError << ','
+                        << quoteCsv(r.error) << '\n';
+                }
+            }
+        }
+    }
+}
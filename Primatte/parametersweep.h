@@ -0,0 +1,116 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <ostream>
+#include <opencv2/core/core.hpp>
+#include "algorithmprimatte.h"
+
+/**
+  * Runs many variants of the algorithm parameters against a single assembled input,
+  * to help tuning them. The input is assembled once and its point sets are shared,
+  * read-only, by all variants, which are analysed concurrently.
+  */
+
+namespace anima
+{
+    namespace alg
+    {
+        namespace primatte
+        {
+            /** The values to combine when generating variants. Empty lists keep the base value. */
+            struct ParameterSweepGrid
+            {
+                std::vector<float> innerShrinkingThresholds;
+                std::vector<float> outerExpandDeltas;
+                std::vector<float> outerScaleParameters;
+
+                /* The mesh densities, as phi faces, which must be greater than 3.
+                 * Theta faces are half of them, and at least 3. */
+                std::vector<int> phiFaces;
+
+                /* The fitting algorithms and alpha locators to compare, each with a name for the table.
+                 * None may be null. */
+                std::vector<std::pair<std::string, IFittingAlgorithm*> > fitters;
+                std::vector<std::pair<std::string, IAlphaLocator*> > alphaLocators;
+
+                /** Returns every combination of the values applied to the base descriptor.
+                  * Throws std::runtime_error if the phi faces are out of range or a sub-algorithm is null.
+                  * @param names If not null, receives the names of the fitter and alpha locator of each
+                  *              variant, joined by '/', leaving out those that are not compared. */
+                std::vector<AlgorithmPrimatteDesc> variants(const AlgorithmPrimatteDesc& base,
+                                                            std::vector<std::string>* names = nullptr) const;
+            };
+
+            /** The descriptor of a parameter sweep. */
+            struct ParameterSweepDescriptor
+            {
+                /* The assembled input shared by all variants. */
+                const ia::InputAssembler* input;
+
+                /* The variants to run. The sub-algorithms must be safe to use concurrently. */
+                std::vector<AlgorithmPrimatteDesc> variants;
+
+                /* Either empty, or the name of each variant, as given by ParameterSweepGrid::variants. */
+                std::vector<std::string> variantNames;
+
+                /* An optional CV_32FC1 alpha of the input size to measure the error against. */
+                const cv::Mat* referenceAlpha;
+
+                /* If not empty, a thumbnail of each alpha is written in this directory as variant_<n>.png. */
+                std::string thumbnailDirectory;
+
+                /* The width of the thumbnails. The aspect ratio is kept. */
+                unsigned thumbnailWidth;
+
+                /* The scheduler to run the variants on. If null, cv::parallel_for_ is used.
+                 * Variants may use the same scheduler, whose loops then nest within the sweep. */
+                tasks::TaskScheduler* scheduler;
+
+                ParameterSweepDescriptor() : input(nullptr), referenceAlpha(nullptr), thumbnailWidth(160), scheduler(nullptr) {}
+            };
+
+            /** The measurements of a variant. */
+            struct ParameterSweepResult
+            {
+                AlgorithmPrimatteDesc desc;
+                std::string name;
+
+                /* The analysis and alpha computation times in milliseconds. */
+                double analyseTime, alphaTime;
+
+                /* The fractions of the processed pixels that are fully transparent, fully opaque, or in between. */
+                float transparent, opaque, mixed;
+
+                float meanAlpha;
+
+                /* The mean absolute difference to the reference alpha, or -1 without one. */
+                float referenceError;
+
+                /* Empty, or the reason the variant failed. */
+                std::string error;
+            };
+
+            /** The parameter sweep. */
+            class ParameterSweep
+            {
+                ParameterSweepDescriptor mDesc;
+                std::vector<ParameterSweepResult> mResults;
+
+            public:
+
+                /** Validates the descriptor, throwing std::runtime_error upon failure. */
+                ParameterSweep(const ParameterSweepDescriptor& desc);
+
+                /** Analyses every variant and computes its alpha, spreading the variants over the cores.
+                  * A failing variant records its error rather than stopping the sweep. */
+                const std::vector<ParameterSweepResult>& run();
+
+                /** Returns the results of the last run, in the order of the variants. */
+                const std::vector<ParameterSweepResult>& results() const;
+
+                /** Writes the results as a CSV table with a header row. */
+                void writeTable(std::ostream& out) const;
+            };
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "matrixd.h"
+#include <vector>
+#include <cstddef>
+
+/**
+  * A read-only view of a contiguous run of points, such as one half of a partitioned
+  * point array. Functions that only read points take a span rather than a vector, and
+  * as vectors convert to spans implicitly, either may be passed to them.
+  */
+
+namespace anima
+{
+    struct PointSpan
+    {
+        /* The first point. */
+        const math::vec3* data;
+
+        /* The number of points. */
+        size_t count;
+
+        /** Constructs an empty span. */
+        PointSpan() : data(nullptr), count(0) {}
+
+        PointSpan(const math::vec3* data_, size_t count_) : data(data_), count(count_) {}
+
+        /** Views the whole vector. The span is invalidated if the vector reallocates. */
+        PointSpan(const std::vector<math::vec3>& points) : data(points.data()), count(points.size()) {}
+
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        const math::vec3* begin() const { return data; }
+        const math::vec3* end() const { return data + count; }
+
+        const math::vec3& operator [] (size_t i) const { return data[i]; }
+    };
+}
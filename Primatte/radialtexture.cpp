@@ -0,0 +1,66 @@
+#include "radialtexture.h"
+#include "spherepolyhedron.h"
+#include <stdexcept>
+
+namespace anima
+{
+    namespace alg
+    {
+        namespace primatte
+        {
+            RadialTexture::RadialTexture() : mResolution(0)
+            {
+            }
+
+            RadialTexture::RadialTexture(unsigned resolution)
+            {
+                reset(resolution);
+            }
+
+            void RadialTexture::validate(unsigned resolution)
+            {
+                if(resolution == 0 || resolution > MAX_RADIAL_TEXTURE_RESOLUTION)
+                    throw std::runtime_error("Radial texture resolution out of range");
+            }
+
+            void RadialTexture::reset(unsigned resolution)
+            {
+                validate(resolution);
+
+                mResolution = resolution;
+                mDistances.resize((resolution+1)*(resolution+1));
+            }
+
+            math::vec3 RadialTexture::squareToDirection(const math::vec2& square)
+            {
+                const float z = 1.f - std::fabs(square.x) - std::fabs(square.y);
+                math::vec3 direction(square.x, square.y, z);
+
+                //Unfold the lower half.
+                if(z < 0)
+                {
+                    direction.x = (1.f - std::fabs(square.y))*(square.x >= 0 ? 1.f : -1.f);
+                    direction.y = (1.f - std::fabs(square.x))*(square.y >= 0 ? 1.f : -1.f);
+                }
+
+                direction.normalize();
+                return direction;
+            }
+
+            void RadialTexture::bake(const SpherePolyhedron& poly)
+            {
+                if(mResolution == 0)
+                    throw std::runtime_error("Using uninitialised radial texture");
+
+                mCentre = poly.centre();
+
+                const float cellSize = 2.f/mResolution;
+                float* distance = mDistances.data();
+                for(unsigned row = 0; row <= mResolution; ++row)
+                    for(unsigned column = 0; column <= mResolution; ++column)
+                        *distance++ = poly.findDistanceToPolyhedron(squareToDirection(math::vec2(column*cellSize - 1.f,
+                                                                                                 row*cellSize - 1.f)));
+            }
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include "matrixd.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+/**
+  * A shell stored as its distance from the centre over a grid of directions, so that a
+  * distance query is a fixed-cost texture fetch instead of a face lookup and a plane
+  * intersection, and the resolution is independent of the resolution fitted.
+  * Directions are mapped onto the square [-1,1]^2 by the octahedral mapping: the direction
+  * is projected onto the octahedron |x|+|y|+|z| = 1, whose upper half is laid flat and whose
+  * lower half is folded over the corners. The distances are stored on the corners of an
+  * NxN grid of cells over that square and filtered bilinearly. The border folds onto itself,
+  * so interpolating along it never needs to wrap around.
+  * The filtering is only exact for the stored directions, so a baked texture is a close
+  * approximation of its source rather than a copy.
+  */
+namespace anima
+{
+    class SpherePolyhedron;
+
+    namespace alg
+    {
+        namespace primatte
+        {
+            /** The highest resolution supported. */
+            const unsigned MAX_RADIAL_TEXTURE_RESOLUTION = 4096;
+
+            class RadialTexture
+            {
+            public:
+                /** A direction from the centre resolved to its cell and filtering weights.
+                  * As for SpherePolyhedron::RayContext, the result only depends on the resolution,
+                  * so it may be evaluated against any texture of the same resolution and centre. */
+                struct RayContext
+                {
+                    //The index of the lower corner of the cell.
+                    unsigned index;
+
+                    //The position within the cell, in [0, 1].
+                    float u, v;
+                };
+
+            private:
+                //The centre of the shell.
+                math::vec3 mCentre;
+
+                //The number of cells along each side.
+                unsigned mResolution;
+
+                //The distances on the (mResolution+1)^2 cell corners, in rows.
+                std::vector<float> mDistances;
+
+            public:
+                /** Creates an uninitialised texture. */
+                RadialTexture();
+
+                /** Creates a texture with the given number of cells along each side,
+                  * throwing std::runtime_error if it is out of range. */
+                RadialTexture(unsigned resolution);
+
+                /** Throws std::runtime_error if the resolution is out of range. */
+                static void validate(unsigned resolution);
+
+                /** Changes the resolution, reusing the storage. The distances are undefined until filled. */
+                void reset(unsigned resolution);
+
+                /** Maps a normalised direction onto the octahedral square [-1,1]^2. */
+                static math::vec2 directionToSquare(const math::vec3& normalisedVector)
+                {
+                    const float scale = 1.f/(std::fabs(normalisedVector.x) + std::fabs(normalisedVector.y) +
+                                             std::fabs(normalisedVector.z));
+                    const float x = normalisedVector.x*scale, y = normalisedVector.y*scale;
+                    if(normalisedVector.z >= 0)
+                        return math::vec2(x, y);
+
+                    //Fold the lower half over the corners.
+                    return math::vec2((1.f - std::fabs(y))*(x >= 0 ? 1.f : -1.f),
+                                      (1.f - std::fabs(x))*(y >= 0 ? 1.f : -1.f));
+                }
+
+                /** Maps a point of the octahedral square [-1,1]^2 to its normalised direction. */
+                static math::vec3 squareToDirection(const math::vec2& square);
+
+                /** Samples a polyhedron, such as a fitted BoundingPolyhedron, at every stored direction. */
+                void bake(const SpherePolyhedron& poly);
+
+                /** Resolves a vector from the centre into a ray context. */
+                RayContext resolveRay(const math::vec3& normalisedVector) const
+                {
+                    const math::vec2 square = directionToSquare(normalisedVector);
+
+                    const float scale = 0.5f*mResolution;
+                    const float x = (square.x + 1.f)*scale, y = (square.y + 1.f)*scale;
+                    const unsigned column = std::min(unsigned(x), mResolution-1);
+                    const unsigned row = std::min(unsigned(y), mResolution-1);
+
+                    RayContext ray = {row*(mResolution+1) + column, x - column, y - row};
+                    return ray;
+                }
+
+                /** Finds the distance to the shell along a resolved ray, which must have been
+                  * resolved by a texture with the same resolution. */
+                float findDistance(const RayContext& ray) const
+                {
+                    const float* lower = &mDistances[ray.index];
+                    const float* upper = lower + mResolution + 1;
+                    const float bottom = lower[0] + (lower[1] - lower[0])*ray.u;
+                    const float top = upper[0] + (upper[1] - upper[0])*ray.u;
+                    return bottom + (top - bottom)*ray.v;
+                }
+
+                /** Returns the centre the distances are measured from. */
+                math::vec3 centre() const { return mCentre; }
+
+                /** Returns whether rays resolved by other may be evaluated against this texture. */
+                bool sharesTopology(const RadialTexture& other) const { return mResolution == other.mResolution; }
+
+                /** Returns the number of cells along each side. */
+                unsigned resolution() const { return mResolution; }
+            };
+        }
+    }
+}
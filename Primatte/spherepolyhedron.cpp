@@ -2,6 +2,7 @@
 #include "math.h"
 #include <stdexcept>
 #include <assert.h>
+#include <algorithm>
 #include "io.h"
 #include "QGLViewer/qglviewer.h"
 
@@ -39,6 +40,11 @@ namespace anima
     }
 
     float SpherePolyhedron::findDistanceToPolyhedron(const math::vec3& normalisedVector) const
+    {
+        return findDistanceToFace(findFace(normalisedVector), normalisedVector);
+    }
+
+    SpherePolyhedron::Face SpherePolyhedron::findFace(const math::vec3& normalisedVector) const
     {
         //Get spherical coordinates of vector
         math::vec2 spherical = cartesianToSpherical(normalisedVector);
@@ -49,8 +55,11 @@ namespace anima
         //Get theta into into the [0, PI] range
         float thetaWithOffset = spherical.y + PIo2;
 
-        //Vertices to be found:
-        math::vec3 v1, v2, v3;
+        //The number of triangles in the grid, after which the pole triangles are stored.
+        const unsigned gridTriangles = mPhiFaces*(mVerticesThetaCount-1)*2;
+
+        //Face to be found:
+        Face face;
 
         //If pointing near the poles
         const float piMinusThetaAngle = PI-mThetaAngle;
@@ -58,41 +67,71 @@ namespace anima
         //If too high or low to be in the grid:
         if(thetaWithOffset < mThetaAngle || thetaWithOffset > piMinusThetaAngle)
         {
-            const int phiIndexi = (int) (spherical.x/mPhiAngle);
+            //Clamped in case rounding gives the full circle.
+            const unsigned phiIndexi = std::min((unsigned) (spherical.x/mPhiAngle), mPhiFaces-1);
 
             //If north
             if(thetaWithOffset > piMinusThetaAngle)
             {
-                v1 = getPointAtIndex(phiIndexi, mVerticesThetaCount-1);
-                v2 = getPointAtIndex((phiIndexi+1) % mVerticesPhiCount,  mVerticesThetaCount-1);
-                v3 = mVertices[mVertices.size()-2];
+                face.v1 = getIndex(phiIndexi, mVerticesThetaCount-1);
+                face.v2 = getIndex((phiIndexi+1) % mVerticesPhiCount,  mVerticesThetaCount-1);
+                face.v3 = mVertices.size()-2;
+                face.index = gridTriangles + phiIndexi;
             }
             else //if south
             {
-                v1 = getPointAtIndex(phiIndexi, 0);
-                v2 = getPointAtIndex((phiIndexi+1) % mVerticesPhiCount, 0);
-                v3 = mVertices[mVertices.size()-1];
+                face.v1 = getIndex(phiIndexi, 0);
+                face.v2 = getIndex((phiIndexi+1) % mVerticesPhiCount, 0);
+                face.v3 = mVertices.size()-1;
+                face.index = gridTriangles + mPhiFaces + phiIndexi;
             }
         }
         else //If pointing at a normal quad
         {
             //Get a quad index from the spherical coordinates.
             const math::vec2f indexf(spherical.x/mPhiAngle, thetaWithOffset/mThetaAngle);
-            const math::vec2i indexi(indexf.x, indexf.y);
+
+            //Clamped in case rounding puts the index on the far edge of the grid.
+            const math::vec2i indexi(std::min((int)indexf.x, (int)mPhiFaces-1),
+                                     std::min(std::max((int)indexf.y, 1), (int)mVerticesThetaCount-1));
 
             //Get vertices common to both triangles
-            v1 = getPointAtIndex((indexi.x+1) % mVerticesPhiCount, indexi.y);
-            v2 = getPointAtIndex(indexi.x, (indexi.y + mVerticesThetaCount-1) % mVerticesThetaCount);
+            face.v1 = getIndex((indexi.x+1) % mVerticesPhiCount, indexi.y);
+            face.v2 = getIndex(indexi.x, (indexi.y + mVerticesThetaCount-1) % mVerticesThetaCount);
+
+            const unsigned quadIndex = indexi.x*(mVerticesThetaCount-1) + indexi.y-1;
 
             //Upper triangle
             if((indexf.y-indexi.y) / mPhiAngle > (indexf.x-indexi.x) / mPhiAngle)
-                v3 = getPointAtIndex(indexi.x, indexi.y);
+            {
+                face.v3 = getIndex(indexi.x, indexi.y);
+                face.index = quadIndex*2+1;
+            }
             //Lower triange
             else
-                v3 = getPointAtIndex((indexi.x+1) % mVerticesPhiCount, (indexi.y + mVerticesThetaCount-1) % mVerticesThetaCount);
+            {
+                face.v3 = getIndex((indexi.x+1) % mVerticesPhiCount, (indexi.y + mVerticesThetaCount-1) % mVerticesThetaCount);
+                face.index = quadIndex*2;
+            }
         }
 
-        //v1,v2,v3 are now filled out.
+        return face;
+    }
+
+    float SpherePolyhedron::findDistanceToFace(const Face& face, const math::vec3& normalisedVector) const
+    {
+        //Use the baked plane if available
+        if(!mPlanes.empty())
+        {
+            const math::vec4& plane = mPlanes[face.index];
+            float vn = normalisedVector.x*plane.x + normalisedVector.y*plane.y + normalisedVector.z*plane.z;
+            assert(vn!=0);
+            return plane.w/vn;
+        }
+
+        const math::vec3& v1 = mVertices[face.v1];
+        const math::vec3& v2 = mVertices[face.v2];
+        const math::vec3& v3 = mVertices[face.v3];
 
         //Find distance to triangle
         math::vec3 normal = math::cross(v2-v1,v3-v1);
@@ -106,6 +145,54 @@ namespace anima
         return distance;
     }
 
+    void SpherePolyhedron::bakePlanes()
+    {
+        mPlanes.resize(triangleCount());
+
+        auto bake = [this](unsigned index, unsigned i1, unsigned i2, unsigned i3)
+        {
+            const math::vec3& v1 = mVertices[i1];
+            math::vec3 normal = math::cross(mVertices[i2]-v1, mVertices[i3]-v1);
+            mPlanes[index] = math::vec4(normal, math::dot(v1-mCentre, normal));
+        };
+
+        //Grid quads, in the same order as findFace.
+        for(unsigned iPhi = 0; iPhi < mVerticesPhiCount; ++iPhi)
+            for(unsigned iTheta = 1; iTheta < mVerticesThetaCount; ++iTheta)
+            {
+                const unsigned quadIndex = iPhi*(mVerticesThetaCount-1) + iTheta-1;
+                const unsigned nextPhi = (iPhi+1) % mVerticesPhiCount;
+                bake(quadIndex*2, getIndex(nextPhi, iTheta), getIndex(iPhi, iTheta-1), getIndex(nextPhi, iTheta-1));
+                bake(quadIndex*2+1, getIndex(nextPhi, iTheta), getIndex(iPhi, iTheta-1), getIndex(iPhi, iTheta));
+            }
+
+        //Poles
+        const unsigned gridTriangles = mPhiFaces*(mVerticesThetaCount-1)*2;
+        for(unsigned iPhi = 0; iPhi < mVerticesPhiCount; ++iPhi)
+        {
+            const unsigned nextPhi = (iPhi+1) % mVerticesPhiCount;
+            bake(gridTriangles + iPhi, getIndex(iPhi, mVerticesThetaCount-1),
+                 getIndex(nextPhi, mVerticesThetaCount-1), mVertices.size()-2);
+            bake(gridTriangles + mPhiFaces + iPhi, getIndex(iPhi, 0), getIndex(nextPhi, 0), mVertices.size()-1);
+        }
+    }
+
+    void SpherePolyhedron::assignMesh(const math::vec3 centre, float radius,
+                                      const math::vec3* vertices, size_t vertexCount,
+                                      const math::vec4* planes, size_t planeCount)
+    {
+        if(vertexCount != mVertices.size())
+            throw std::runtime_error("Vertex count does not match the polyhedron topology");
+
+        if(planeCount != 0 && planeCount != triangleCount())
+            throw std::runtime_error("Plane count does not match the polyhedron topology");
+
+        mCentre = centre;
+        mRadius = radius;
+        mVertices.assign(vertices, vertices + vertexCount);
+        mPlanes.assign(planes, planes + planeCount);
+    }
+
     void SpherePolyhedron::constructMesh()
     {
         using namespace math;
@@ -130,10 +217,24 @@ namespace anima
     SpherePolyhedron::SpherePolyhedron() {}
 
     SpherePolyhedron::SpherePolyhedron(unsigned phiFaces, unsigned thetaFaces)
-        : mPhiFaces(phiFaces), mThetaFaces(thetaFaces),
-          mPhiAngle(PI2/phiFaces), mThetaAngle(PI/thetaFaces), mRadius(1)
+    {
+        rebuild(phiFaces, thetaFaces);
+    }
+
+    void SpherePolyhedron::rebuild(unsigned phiFaces, unsigned thetaFaces)
     {
         assert(phiFaces > 3 && thetaFaces > 2);
+
+        mPhiFaces = phiFaces;
+        mThetaFaces = thetaFaces;
+        mPhiAngle = PI2/phiFaces;
+        mThetaAngle = PI/thetaFaces;
+        mRadius = 1;
+        mCentre = math::vec3();
+
+        //Cleared rather than reallocated, so that rebuilding at the same resolution does not allocate.
+        mVertices.clear();
+        mPlanes.clear();
         constructMesh();
     }
 
@@ -144,6 +245,7 @@ namespace anima
 
         mRadius = radius;
         mCentre = centre;
+        mPlanes.clear();
     }
 
 
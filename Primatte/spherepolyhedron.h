@@ -1,6 +1,7 @@
 #pragma once
 #include "matrixd.h"
 #include <vector>
+#include <cassert>
 #include <QGLViewer/qglviewer.h>
 
 /**
@@ -49,13 +50,48 @@ namespace anima
           * scaling or positioning it. */
         void constructMesh();
 
+        /** Rebuilds the unit mesh at the given resolution around the origin,
+          * reusing the storage of the vertices and planes. */
+        void rebuild(unsigned phiFaces, unsigned thetaFaces);
+
 
         /** Returns the vertex at the index phi,theta of the vertex grid.
           * Can not return poles unless in error. */
         math::vec3 getPointAtIndex(int phi, int theta) const;
 
+        /** Returns the index into mVertices of the vertex at phi,theta of the vertex grid. */
+        unsigned getIndex(int phi, int theta) const { return phi*mVerticesThetaCount+theta; }
+
+        //The baked triangle planes, indexed by Face::index. Each is the (unnormalised)
+        //normal in xyz and its dot product with the first vertex relative to the centre in w.
+        //Empty unless baked.
+        std::vector<math::vec4> mPlanes;
+
     public:
 
+        /** A triangle of the polyhedron, as found by a direction lookup. */
+        struct Face
+        {
+            //Indices into mVertices.
+            unsigned v1, v2, v3;
+
+            //The index of the triangle, in [0, triangleCount()).
+            unsigned index;
+        };
+
+        /** A direction from the centre resolved to the triangle it passes through.
+          * Resolving is the costly part of a distance query, while the result only depends
+          * on the resolution, so a ray may be evaluated against any polyhedron of the same
+          * resolution and centre, including this one after its vertices were moved. */
+        struct RayContext
+        {
+            //The triangle the ray passes through.
+            Face face;
+
+            //The normalised direction of the ray.
+            math::vec3 direction;
+        };
+
         /**
           * Converts cartesian coordinates to spherical coordinaes.
           * @param cartesian A cartesian coordinate normalised around the origin.
@@ -73,6 +109,7 @@ namespace anima
 
         //The inner vertices, made public as both read/write access is required.
         //Vertices must only be moved towards or from the origin.
+        //Baked planes are not updated when the vertices are changed directly.
         std::vector<math::vec3> mVertices;
 
         /** Draws the polyhedron with the given colour. */
@@ -93,6 +130,59 @@ namespace anima
           */
         float findDistanceToPolyhedron(const math::vec3& normalisedVector) const;
 
+        /** Finds the triangle a vector from the centre of the sphere passes through. */
+        Face findFace(const math::vec3& normalisedVector) const;
+
+        /** Finds the distance from the centre to the given face in the direction of the vector. */
+        float findDistanceToFace(const Face& face, const math::vec3& normalisedVector) const;
+
+        /** Resolves a vector from the centre of the sphere into a ray context. */
+        RayContext resolveRay(const math::vec3& normalisedVector) const
+        {
+            RayContext ray = {findFace(normalisedVector), normalisedVector};
+            return ray;
+        }
+
+        /** Finds the distance from the centre to the polyhedron along a resolved ray.
+          * The ray must have been resolved by a polyhedron with the same resolution. */
+        float findDistance(const RayContext& ray) const
+        {
+            assert(ray.face.index < triangleCount());
+            return findDistanceToFace(ray.face, ray.direction);
+        }
+
+        /** Returns whether rays resolved by other may be evaluated against this polyhedron. */
+        bool sharesTopology(const SpherePolyhedron& other) const
+        {
+            return mPhiFaces == other.mPhiFaces && mThetaFaces == other.mThetaFaces;
+        }
+
+        /** Computes and stores the plane of every triangle, speeding up distance queries.
+          * Must be called again (or clearPlanes) if the vertices are moved directly. */
+        void bakePlanes();
+
+        /** Discards the baked planes. */
+        void clearPlanes() { mPlanes.clear(); }
+
+        /** Returns the baked planes, which are empty if not baked. */
+        const std::vector<math::vec4>& planes() const { return mPlanes; }
+
+        /** Replaces the mesh with the given data, such as when loading a stored polyhedron.
+          * The vertex count must match the topology, and the plane count must either be
+          * zero or triangleCount(). */
+        void assignMesh(const math::vec3 centre, float radius,
+                        const math::vec3* vertices, size_t vertexCount,
+                        const math::vec4* planes, size_t planeCount);
+
+        /** Returns the number of faces around the up axis. */
+        unsigned phiFaces() const { return mPhiFaces; }
+
+        /** Returns the number of vertical faces. */
+        unsigned thetaFaces() const { return mThetaFaces; }
+
+        /** Returns the number of triangles. */
+        unsigned triangleCount() const { return mPhiFaces*(mVerticesThetaCount-1)*2 + mPhiFaces*2; }
+
         /** Transforms the polyhedron towards the given centre and radius.
           * @param centre The new centre.
           * @param radius The new radius. */
@@ -0,0 +1,267 @@
+#include "taskscheduler.h"
+#include "io.h"
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
+namespace anima
+{
+    namespace tasks
+    {
+        namespace
+        {
+            /* The scheduler and queue of the current worker thread, if any. */
+            thread_local const TaskScheduler* tlsScheduler = nullptr;
+            thread_local unsigned tlsQueue = 0;
+
+            /* Parses a list such as "0-3,8,10-11". */
+            std::vector<int> parseCpuList(const std::string& list)
+            {
+                std::vector<int> cpus;
+                std::istringstream stream(list);
+                std::string range;
+                while(std::getline(stream, range, ','))
+                {
+                    int first, last;
+                    char dash;
+                    std::istringstream rangeStream(range);
+                    if(!(rangeStream >> first))
+                        continue;
+                    if(!(rangeStream >> dash >> last))
+                        last = first;
+                    for(int cpu = first; cpu <= last; ++cpu)
+                        cpus.push_back(cpu);
+                }
+                return cpus;
+            }
+
+            /* The processors this process may run on. */
+            std::vector<int> processCpus()
+            {
+                std::vector<int> cpus;
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                if(sched_getaffinity(0, sizeof(set), &set) == 0)
+                    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                        if(CPU_ISSET(cpu, &set))
+                            cpus.push_back(cpu);
+                return cpus;
+            }
+
+            bool setAffinity(const std::vector<int>& cpus)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for(size_t i = 0; i < cpus.size(); ++i)
+                    CPU_SET(cpus[i], &set);
+                return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+            }
+        }
+
+        TaskScheduler::TaskScheduler(const TaskSchedulerDescriptor& desc)
+            : mQueuedLoops(0), mRunning(true)
+        {
+            //The processors available to the workers.
+            std::vector<int> cpus;
+            if(desc.numaNode >= 0)
+            {
+                const std::string path = "/sys/devices/system/node/node" + ToString(desc.numaNode) + "/cpulist";
+                std::ifstream file(path.c_str());
+                std::string list;
+                if(!file || !std::getline(file, list))
+                    throw std::runtime_error("Unknown NUMA node " + ToString(desc.numaNode));
+
+                cpus = parseCpuList(list);
+            }
+            else
+                cpus = processCpus();
+
+            if(cpus.empty() && (desc.numaNode >= 0 || desc.pinThreads))
+                throw std::runtime_error("No processors available to the task scheduler");
+
+            unsigned threadCount = desc.threadCount;
+            if(threadCount == 0)
+                threadCount = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : cpus.size();
+
+            mQueueCount = threadCount + 1;
+            mQueues.reset(new Queue[mQueueCount]);
+
+            for(unsigned i = 0; i < threadCount; ++i)
+            {
+                std::vector<int> workerCpus;
+                if(desc.pinThreads)
+                    workerCpus.push_back(cpus[i % cpus.size()]);
+                else if(desc.numaNode >= 0)
+                    workerCpus = cpus;
+
+                mThreads.push_back(std::thread(&TaskScheduler::workerLoop, this, i, workerCpus));
+            }
+
+            Inform("Task scheduler started with " + ToString(threadCount) + " workers");
+        }
+
+        TaskScheduler::~TaskScheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mWakeMutex);
+                mRunning = false;
+            }
+            mWake.notify_all();
+
+            for(auto it = mThreads.begin(); it != mThreads.end(); ++it)
+                it->join();
+        }
+
+        unsigned TaskScheduler::threadCount() const
+        {
+            return mThreads.size();
+        }
+
+        unsigned TaskScheduler::queueIndex() const
+        {
+            return tlsScheduler == this ? tlsQueue : mQueueCount - 1;
+        }
+
+        bool TaskScheduler::push(unsigned queue, Loop* loop)
+        {
+            Queue& q = mQueues[queue];
+            {
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if(q.count == MAX_QUEUED_LOOPS)
+                    return false;
+                q.loops[q.count++] = loop;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mWakeMutex);
+                ++mQueuedLoops;
+            }
+            mWake.notify_all();
+            return true;
+        }
+
+        void TaskScheduler::remove(unsigned queue, Loop* loop)
+        {
+            Queue& q = mQueues[queue];
+            std::lock_guard<std::mutex> lock(q.mutex);
+
+            for(unsigned i = 0; i < q.count; ++i)
+                if(q.loops[i] == loop)
+                {
+                    std::copy(q.loops + i + 1, q.loops + q.count, q.loops + i);
+                    --q.count;
+                    --mQueuedLoops;
+                    return;
+                }
+        }
+
+        void TaskScheduler::work(Loop& loop)
+        {
+            for(;;)
+            {
+                const size_t begin = loop.next.fetch_add(loop.grain);
+                if(begin >= loop.end)
+                    return;
+
+                const size_t end = std::min(begin + loop.grain, loop.end);
+
+                try
+                {
+                    loop.run(loop.body, begin, end);
+                }
+                catch(...)
+                {
+                    if(!loop.failed.exchange(true))
+                        loop.error = std::current_exception();
+                }
+
+                loop.finished.fetch_add(end - begin, std::memory_order_release);
+            }
+        }
+
+        bool TaskScheduler::helpOnce(unsigned queue)
+        {
+            //The own queue newest first, as nested loops are the most local work,
+            //then the other queues oldest first, as outer loops hold the most work.
+            Loop* found = nullptr;
+            for(unsigned n = 0; n < mQueueCount && !found; ++n)
+            {
+                Queue& q = mQueues[(queue + n) % mQueueCount];
+                std::lock_guard<std::mutex> lock(q.mutex);
+
+                for(unsigned i = 0; i < q.count && !found; ++i)
+                {
+                    Loop* loop = q.loops[n == 0 ? q.count - 1 - i : i];
+                    if(loop->next.load(std::memory_order_relaxed) < loop->end)
+                    {
+                        //Counted under the queue lock, so the owner waits for it after removing the loop.
+                        ++loop->helpers;
+                        found = loop;
+                    }
+                }
+            }
+
+            if(!found)
+                return false;
+
+            work(*found);
+            --found->helpers;
+            return true;
+        }
+
+        void TaskScheduler::runLoop(Loop& loop)
+        {
+            const unsigned queue = queueIndex();
+
+            //Too deeply nested, so run it alone.
+            if(!push(queue, &loop))
+            {
+                work(loop);
+            }
+            else
+            {
+                work(loop);
+
+                //Every chunk is claimed, so no more helpers are needed.
+                remove(queue, &loop);
+
+                //Run other loops while chunks taken by others finish.
+                while(loop.finished.load(std::memory_order_acquire) != loop.count)
+                    if(!helpOnce(queue))
+                        std::this_thread::yield();
+
+                while(loop.helpers.load(std::memory_order_acquire) != 0)
+                    std::this_thread::yield();
+            }
+
+            if(loop.failed)
+                std::rethrow_exception(loop.error);
+        }
+
+        void TaskScheduler::workerLoop(unsigned index, std::vector<int> cpus)
+        {
+            tlsScheduler = this;
+            tlsQueue = index;
+
+            if(!cpus.empty() && !setAffinity(cpus))
+                Warning("Could not set the affinity of task scheduler worker " + ToString(index));
+
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mWakeMutex);
+                    mWake.wait(lock, [this]{ return !mRunning || mQueuedLoops > 0; });
+                    if(!mRunning)
+                        return;
+                }
+
+                //Loops stay queued until their owner has claimed the last chunk.
+                if(!helpOnce(index))
+                    std::this_thread::yield();
+            }
+        }
+    }
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <exception>
+
+/**
+  * A work-stealing task scheduler shared by all the stages of the program.
+  * It is created once per process and passed to the sub-algorithms when they are constructed,
+  * and to the algorithms through their descriptors, so that the input processing, fitting,
+  * segmentation and alpha computation all run on the same workers rather than each spawning
+  * their own threads.
+  *
+  * Work is expressed as parallel loops over index ranges. A loop is published to the queue
+  * of the calling thread, and idle workers steal chunks of it, newest loops first from their
+  * own queue and oldest first from the others. The calling thread takes part in its loop,
+  * and while it waits for chunks taken by others it runs chunks of other loops, so loops
+  * may be nested freely without deadlocking. Loops allocate nothing.
+  */
+
+namespace anima
+{
+    namespace tasks
+    {
+        /** The descriptor of the task scheduler. */
+        struct TaskSchedulerDescriptor
+        {
+            /* The number of worker threads. 0 uses one per available processor. */
+            unsigned threadCount;
+
+            /* If true, each worker is pinned to a single processor, in turn. */
+            bool pinThreads;
+
+            /* If not negative, the workers are restricted to the processors of this NUMA node,
+             * as listed in /sys/devices/system/node/node<n>/cpulist. */
+            int numaNode;
+
+            TaskSchedulerDescriptor() : threadCount(0), pinThreads(false), numaNode(-1) {}
+        };
+
+        /** The task scheduler. */
+        class TaskScheduler
+        {
+        public:
+            /** A parallel loop, living on the stack of the thread that runs it. */
+            struct Loop
+            {
+                void (*run)(const void* body, size_t begin, size_t end);
+                const void* body;
+                size_t end, grain, count;
+
+                /* The next unclaimed index, and the number of finished ones. */
+                std::atomic<size_t> next, finished;
+
+                /* The number of threads other than the owner working on the loop. */
+                std::atomic<unsigned> helpers;
+
+                /* The first exception thrown by a chunk, rethrown to the owner. */
+                std::atomic<bool> failed;
+                std::exception_ptr error;
+            };
+
+        private:
+            /* The most loops queued by a thread at once, bounding the nesting depth.
+             * Deeper loops run serially. */
+            static const unsigned MAX_QUEUED_LOOPS = 64;
+
+            struct Queue
+            {
+                std::mutex mutex;
+                Loop* loops[MAX_QUEUED_LOOPS];
+                unsigned count;
+
+                Queue() : count(0) {}
+            };
+
+            std::vector<std::thread> mThreads;
+
+            /* A queue per worker, followed by one shared by the threads outside the scheduler. */
+            std::unique_ptr<Queue[]> mQueues;
+            unsigned mQueueCount;
+
+            /* Idle workers sleep until loops are queued. */
+            std::mutex mWakeMutex;
+            std::condition_variable mWake;
+            std::atomic<unsigned> mQueuedLoops;
+            std::atomic<bool> mRunning;
+
+            TaskScheduler(const TaskScheduler&);
+            TaskScheduler& operator=(const TaskScheduler&);
+
+            /** Returns the queue of the calling thread. */
+            unsigned queueIndex() const;
+
+            bool push(unsigned queue, Loop* loop);
+            void remove(unsigned queue, Loop* loop);
+
+            /** Claims and runs chunks until the loop is exhausted. */
+            static void work(Loop& loop);
+
+            /** Finds a loop with unclaimed chunks, own queue first, and works on it.
+              * Returns false if there was none. */
+            bool helpOnce(unsigned queue);
+
+            void workerLoop(unsigned index, std::vector<int> cpus);
+
+            void runLoop(Loop& loop);
+
+            template<class F>
+            static void invoke(const void* body, size_t begin, size_t end)
+            {
+                (*(const F*)body)(begin, end);
+            }
+
+        public:
+
+            /** Starts the workers, throwing std::runtime_error upon failure. */
+            TaskScheduler(const TaskSchedulerDescriptor& desc);
+
+            /** Waits for the workers to finish. No loop may be running. */
+            ~TaskScheduler();
+
+            /** Returns the number of worker threads. */
+            unsigned threadCount() const;
+
+            /** Calls body(begin, end) over consecutive sub-ranges of [begin, end) of at most
+              * grain indices, concurrently, and returns once all of them are done.
+              * Ranges of at most grain indices run directly on the calling thread.
+              * If chunks throw, the first exception is rethrown once the others are done. */
+            template<class F>
+            void parallelFor(size_t begin, size_t end, size_t grain, const F& body)
+            {
+                if(grain == 0)
+                    grain = 1;
+
+                if(end <= begin + grain)
+                {
+                    if(end > begin)
+                        body(begin, end);
+                    return;
+                }
+
+                Loop loop;
+                loop.run = &invoke<F>;
+                loop.body = &body;
+                loop.end = end;
+                loop.grain = grain;
+                loop.count = end - begin;
+                loop.next = begin;
+                loop.finished = 0;
+                loop.helpers = 0;
+                loop.failed = false;
+                runLoop(loop);
+            }
+        };
+
+        /** Runs a parallel loop on the scheduler, or as a single range on the calling thread without one. */
+        template<class F>
+        void parallelFor(TaskScheduler* scheduler, size_t begin, size_t end, size_t grain, const F& body)
+        {
+            if(scheduler)
+                scheduler->parallelFor(begin, end, grain, body);
+            else if(end > begin)
+                body(begin, end);
+        }
+
+        /** Runs two functions, concurrently on the scheduler if there is one. */
+        template<class A, class B>
+        void parallelInvoke(TaskScheduler* scheduler, const A& a, const B& b)
+        {
+            parallelFor(scheduler, 0, 2, 1, [&a, &b](size_t begin, size_t end)
+            {
+                for(size_t i = begin; i < end; ++i)
+                    if(i == 0)
+                        a();
+                    else
+                        b();
+            });
+        }
+    }
+}